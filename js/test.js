@@ -1,7 +1,9 @@
 'use strict';
 
+const {EventEmitter} = require('events');
 const test = require('tape');
 const {decode, splitReports, encode, decodeAll} = require('./');
+const upload = require('./upload.js');
 
 test('decode mouse', (t) => {
   const buf = new Buffer("0200010000", "hex");
@@ -114,3 +116,178 @@ test('encode hello world', (t) => {
   t.equal(bufs, "0102010b0000000000000000000000000100010000000000000000000000000001000108000000000000000000000000010001000000000000000000000000000100010f000000000000000000000000010001000000000000000000000000000100010f00000000000000000000000001000100000000000000000000000000010001120000000000000000000000000100010000000000000000000000000001000136000000000000000000000000010001000000000000000000000000000100012c000000000000000000000000010001000000000000000000000000000100011a00000000000000000000000001000100000000000000000000000000010001120000000000000000000000000100010000000000000000000000000001000115000000000000000000000000010001000000000000000000000000000100010f00000000000000000000000001000100000000000000000000000000010001070000000000000000000000000100010000000000000000000000000000000000000000000000000000000000");
   t.end();
 });
+
+test('crc32 check value', (t) => {
+  t.equal(upload.crc32(Buffer.from('123456789')), 0xcbf43926);
+  t.equal(upload.crc32(Buffer.from('56789'), upload.crc32(Buffer.from('1234'))), 0xcbf43926);
+  t.end();
+});
+
+test('upload header and chunk', (t) => {
+  t.equal(upload.header(upload.TARGET_RAM, 32).toString('hex', 0, 8), 'b501000020000000');
+  t.equal(upload.header(0, 3).readUInt32LE(8), upload.crc32(Buffer.from('b500000003000000', 'hex')));
+
+  const frame = upload.chunk(257, Buffer.from('abc'));
+  t.equal(frame.toString('hex', 0, 7), '01000300616263');
+  t.equal(frame.readUInt32LE(7), upload.crc32(frame.slice(0, 7)));
+  t.deepEqual(upload.parseReply(Buffer.from('b54e0700', 'hex')), { code: 'N', seq: 7, status: 0 });
+  t.end();
+});
+
+test('parse stats dump', (t) => {
+  const buf = Buffer.alloc(100);
+  buf.writeUInt32LE(3, 0);
+  buf.writeUInt32LE(90, 4);
+  buf.writeUInt32LE(150, 8);
+  buf.writeUInt32LE(560, 64);
+  buf.writeUInt32LE(1234, 92);
+  buf.writeUInt32LE(17, 96);
+
+  const stats = upload.parseStats(buf.toString('hex') + '\r\n');
+  t.deepEqual(stats.usb_isr, { count: 3, max: 90, total: 150 });
+  t.equal(stats.reports, 560);
+  t.equal(stats.boot_report, 1234);
+  t.equal(stats.cdc_dropped, 17);
+  t.end();
+});
+
+/**
+ * Serial port of a simulated device: quiet-mode console, range reads of
+ * `region` and the upload protocol as in upload.c, corrupting the chunks
+ * listed in `corrupt` once each
+ */
+function simulatedPort(corrupt, region) {
+  const port = new EventEmitter();
+  let rx = Buffer.alloc(0);
+  let upload_state = null;
+  port.received = Buffer.alloc(0);
+  port.lines = [];
+
+  const send = (buf) => setImmediate(() => port.emit('data', Buffer.from(buf)));
+  const reply = (code, seq, status) => send([0xB5, code.charCodeAt(0), seq, status || 0]);
+
+  const run = () => {
+    for (;;) {
+      if (!upload_state && rx[0] === 0xB5) {
+        if (rx.length < 12) return;
+        upload_state = { remaining: rx.readUInt32LE(4), expected: 0, acked: false };
+        rx = rx.slice(12);
+        reply('R', 0);
+        if (upload_state.remaining === 0) {
+          reply('D', 0);
+          upload_state = null;
+        }
+      } else if (!upload_state) {
+        const end = rx.indexOf('\r');
+        if (end < 0) return;
+        const line = rx.toString('latin1', 0, end);
+        rx = rx.slice(end + 1);
+        if (line) port.lines.push(line);
+        if (line.length === 17 && line[0] === 'r') {
+          const offset = parseInt(line.substr(1, 8), 16);
+          const length = parseInt(line.substr(9, 8), 16);
+          if (offset + length > region.length) {
+            send('bad range\r\n');
+            continue;
+          }
+          const frame = Buffer.alloc(16 + length);
+          frame.write('RD');
+          frame.writeUInt32LE(offset, 4);
+          frame.writeUInt32LE(length, 8);
+          region.copy(frame, 12, offset, offset + length);
+          // Reads from offset 1 get a bad CRC
+          const crc = upload.crc32(region.slice(offset, offset + length)) ^ (offset === 1);
+          frame.writeUInt32LE(crc >>> 0, 12 + length);
+          send(frame);
+        } else if (line) {
+          send(line === 'ib' ? Buffer.alloc(96).toString('hex') + '\r\n' : 'ok\r\n');
+        }
+      } else {
+        if (rx.length < 4 || rx.length < rx.readUInt16LE(2) + 8) return;
+        const len = rx.readUInt16LE(2);
+        const seq = rx[0];
+        const frame = Buffer.from(rx.slice(0, len + 8));
+        rx = rx.slice(len + 8);
+
+        if (corrupt.includes(seq)) {
+          corrupt.splice(corrupt.indexOf(seq), 1);
+          frame[4] ^= 1;
+        }
+        const good = upload.crc32(frame.slice(0, len + 4)) === frame.readUInt32LE(len + 4);
+        if (!good || (seq !== upload_state.expected && !(upload_state.acked && seq === ((upload_state.expected - 1) & 0xFF)))) {
+          reply('N', upload_state.expected);
+        } else if (seq !== upload_state.expected) {
+          reply('A', seq);
+        } else {
+          port.received = Buffer.concat([port.received, frame.slice(4, len + 4)]);
+          upload_state.remaining -= len;
+          upload_state.expected = (upload_state.expected + 1) & 0xFF;
+          upload_state.acked = true;
+          if (upload_state.remaining === 0) {
+            reply('D', seq);
+            upload_state = null;
+          } else {
+            reply('A', seq);
+          }
+        }
+      }
+    }
+  };
+
+  port.write = (buf) => {
+    rx = Buffer.concat([rx, Buffer.from(buf)]);
+    run();
+    return true;
+  };
+  return port;
+}
+
+test('pipelined upload rewinds once per NAK', (t) => {
+  const payload = upload.fromReports(Array.from({ length: 300 }, (_, i) =>
+    ({ report_id: 1, modifiers: 0, reserved: 0, keys_down: [4 + i % 26, 0, 0, 0, 0, 0], leds: 0 })));
+  const port = simulatedPort([3, 3, 12]);
+  const device = new upload.Device(port);
+
+  device.upload(payload, { name: 'test', window: 8 }).then((result) => {
+    t.deepEqual(port.lines, ['ntest']);
+    t.ok(port.received.equals(payload), 'payload received intact');
+    t.equal(result.chunks, 19);
+    t.equal(result.naks, 3);
+    t.end();
+  }, (err) => {
+    t.error(err);
+    t.end();
+  });
+});
+
+test('upload of an empty payload', (t) => {
+  const port = simulatedPort([]);
+  const device = new upload.Device(port);
+
+  device.upload(Buffer.alloc(0), { target: upload.TARGET_RAM }).then((result) => {
+    t.equal(result.chunks, 0);
+    t.end();
+  }, (err) => {
+    t.error(err);
+    t.end();
+  });
+});
+
+test('range read', (t) => {
+  const region = Buffer.alloc(1024, 0xFF);
+  Buffer.from('PDSL\r\n').copy(region, 16);
+  const device = new upload.Device(simulatedPort([], region));
+
+  device.read(12, 100).then((data) => {
+    t.ok(data.equals(region.slice(12, 112)), 'data matches');
+    return device.read(1, 10).then(() => t.fail('bad CRC accepted'), (err) => t.equal(err.message, 'read failed: CRC mismatch'));
+  }).then(() => {
+    return device.read(1000, 100).then(() => t.fail('bad range accepted'), (err) => t.equal(err.message, 'read failed: bad range'));
+  }).then(() => {
+    t.deepEqual(device.port.lines, ['r0000000c00000064', 'r000000010000000a', 'r000003e800000064']);
+    t.end();
+  }, (err) => {
+    t.error(err);
+    t.end();
+  });
+});
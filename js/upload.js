@@ -0,0 +1,712 @@
+/**
+ * @file upload.js
+ * @description Binary payload uploader and throughput benchmark for Pill Duck
+ *
+ * This module talks to the device's serial port and sends payloads with
+ * the framed binary upload protocol (see doc/serial-commands.md, "Binary
+ * Upload") instead of `w` hex lines. It can be used to:
+ *
+ * - Stream a payload file into a flash slot or the RAM payload
+ * - Run a few console commands and read the runtime counters
+ * - Back up the payload region with ranged binary reads
+ * - Measure upload bytes/s and on-device reports/s
+ *
+ * ## Pipelining
+ *
+ * Every chunk is acknowledged, but the uploader does not wait for one
+ * reply before sending the next chunk: up to `window` chunks are in
+ * flight, so the transfer is not limited by the USB round trip. The
+ * device answers every chunk with exactly one reply, in order. After a
+ * NAK the device rejects every later chunk still in flight with the
+ * same NAK; those replies are counted off and the uploader rewinds only
+ * once, to the sequence number the first NAK carried.
+ *
+ * ## Usage
+ *
+ * ### Command Line
+ *
+ * ```bash
+ * # Upload a payload file into a flash slot named "demo"
+ * node upload.js /dev/ttyACM0 payload.bin --name demo
+ *
+ * # Measure upload and playback throughput
+ * node upload.js bench /dev/ttyACM0
+ *
+ * # Save all payload slots
+ * node upload.js dump /dev/ttyACM0 backup.bin
+ * ```
+ *
+ * ### Node.js
+ *
+ * ```javascript
+ * const upload = require('./upload.js');
+ *
+ * const device = new upload.Device(upload.open('/dev/ttyACM0'));
+ * await device.quiet();
+ * const result = await device.upload(payload, { name: 'demo' });
+ * console.log(result.bytes, result.ms);
+ * device.close();
+ * ```
+ *
+ * `open()` uses the tty layer of Linux and macOS. Any other duplex stream
+ * (for example a `serialport` SerialPort on Windows) can be passed to
+ * `Device` instead.
+ *
+ * @module upload
+ * @author Pill Duck Contributors
+ * @license LGPL-3.0-or-later
+ */
+
+'use strict';
+
+const fs = require('fs');
+const tty = require('tty');
+const {execFileSync} = require('child_process');
+const {encode} = require('./hid.js');
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+/**
+ * First byte of an upload header and of every reply
+ * @constant {number}
+ */
+const MAGIC = 0xB5;
+
+/**
+ * Upload target: a payload slot in flash
+ * @constant {number}
+ */
+const TARGET_FLASH = 0;
+
+/**
+ * Upload target: the RAM payload, started as soon as it is complete
+ * @constant {number}
+ */
+const TARGET_RAM = 1;
+
+/**
+ * Largest data field accepted in one chunk
+ * @constant {number}
+ */
+const CHUNK_MAX = 256;
+
+/**
+ * Largest flash payload (user_data less one page and the slot header)
+ * @constant {number}
+ */
+const FLASH_MAX = 97252;
+
+/**
+ * Largest RAM payload
+ * @constant {number}
+ */
+const RAM_MAX = 8192;
+
+/**
+ * Size of the flash payload region read by `r` (all slots)
+ * @constant {number}
+ */
+const REGION_SIZE = 0x18000;
+
+/**
+ * Meaning of the status byte of an `E` reply, see upload.h
+ * @constant {Object}
+ */
+const ERRORS = {
+  0x01: 'bad header',
+  0x02: 'bad length',
+  0x03: 'aborted',
+};
+
+/**
+ * Names of the timings at the start of the `ib` dump, see stats.h
+ * @constant {string[]}
+ */
+const TIMINGS = ['usb_isr', 'clock_isr', 'flash_erase', 'flash_program'];
+
+/**
+ * Names of the counters following the timings in the `ib` dump
+ * @constant {string[]}
+ */
+const COUNTERS = ['reports', 'queue_full', 'cdc_in', 'cdc_out', 'cdc_spins',
+  'missed_ms', 'boot_config', 'boot_report', 'cdc_dropped'];
+
+/*============================================================================
+ * Framing Functions
+ *===========================================================================*/
+
+/**
+ * CRC-32 lookup table (reflected polynomial 0xEDB88320)
+ * @type {Uint32Array}
+ */
+const CRC_TABLE = (() => {
+  const table = new Uint32Array(256);
+  for (let i = 0; i < 256; i++) {
+    let c = i;
+    for (let k = 0; k < 8; k++) {
+      c = c & 1 ? 0xEDB88320 ^ (c >>> 1) : c >>> 1;
+    }
+    table[i] = c;
+  }
+  return table;
+})();
+
+/**
+ * Compute the CRC-32 used by the upload protocol
+ *
+ * Same as zlib's crc32() and the firmware's crc32(): check value
+ * `0xcbf43926` for "123456789".
+ *
+ * @param {Buffer} buf - Bytes to check
+ * @param {number} [crc=0] - CRC of the preceding bytes, to continue it
+ *
+ * @returns {number} Unsigned 32-bit CRC
+ */
+function crc32(buf, crc = 0) {
+  crc = ~crc >>> 0;
+  for (let i = 0; i < buf.length; i++) {
+    crc = CRC_TABLE[(crc ^ buf[i]) & 0xFF] ^ (crc >>> 8);
+  }
+  return ~crc >>> 0;
+}
+
+/**
+ * Build the 12-byte header that starts an upload
+ *
+ * @param {number} target - TARGET_FLASH or TARGET_RAM
+ * @param {number} length - Total payload bytes that will follow
+ *
+ * @returns {Buffer} Header frame
+ */
+function header(target, length) {
+  const buf = Buffer.alloc(12);
+  buf.writeUInt8(MAGIC, 0);
+  buf.writeUInt8(target, 1);
+  buf.writeUInt32LE(length, 4);
+  buf.writeUInt32LE(crc32(buf.slice(0, 8)), 8);
+  return buf;
+}
+
+/**
+ * Build one chunk frame
+ *
+ * @param {number} seq - Sequence number, taken modulo 256
+ * @param {Buffer} data - 1 to CHUNK_MAX payload bytes (empty aborts the upload)
+ *
+ * @returns {Buffer} Chunk frame of data.length + 8 bytes
+ */
+function chunk(seq, data) {
+  const buf = Buffer.alloc(data.length + 8);
+  buf.writeUInt8(seq & 0xFF, 0);
+  buf.writeUInt16LE(data.length, 2);
+  data.copy(buf, 4);
+  buf.writeUInt32LE(crc32(buf.slice(0, data.length + 4)), data.length + 4);
+  return buf;
+}
+
+/**
+ * Decode a 4-byte reply
+ *
+ * @param {Buffer} buf - Reply starting with MAGIC
+ *
+ * @returns {Object} `{code, seq, status}`, code as a character ('R', 'A', ...)
+ */
+function parseReply(buf) {
+  return {
+    code: String.fromCharCode(buf.readUInt8(1)),
+    seq: buf.readUInt8(2),
+    status: buf.readUInt8(3),
+  };
+}
+
+/**
+ * Decode the `ib` runtime counter dump
+ *
+ * @param {string} hex - Hex string returned by `ib`
+ *
+ * @returns {Object} One property per stats.h field. Timings are objects
+ *   `{count, max, total}` in CPU cycles.
+ */
+function parseStats(hex) {
+  const buf = Buffer.from(hex.trim(), 'hex');
+  const result = {};
+  let offset = 0;
+
+  TIMINGS.forEach((name) => {
+    result[name] = {
+      count: buf.readUInt32LE(offset),
+      max: buf.readUInt32LE(offset + 4),
+      total: Number(buf.readBigUInt64LE(offset + 8)),
+    };
+    offset += 16;
+  });
+  COUNTERS.forEach((name) => {
+    result[name] = buf.readUInt32LE(offset);
+    offset += 4;
+  });
+  return result;
+}
+
+/**
+ * Build a legacy payload from report objects
+ *
+ * @param {Object[]} reports - Reports in the format accepted by hid.encode()
+ *
+ * @returns {Buffer} Concatenated 16-byte records
+ */
+function fromReports(reports) {
+  return Buffer.concat(reports.map(encode));
+}
+
+/*============================================================================
+ * Device Connection
+ *===========================================================================*/
+
+/**
+ * Open the device's serial port
+ *
+ * Opening the tty asserts DTR, without which the device sends nothing.
+ * The port is switched to raw mode with stty(1) so that no byte of the
+ * binary frames is translated or echoed by the host's line discipline.
+ *
+ * @param {string} path - Device path, e.g. `/dev/ttyACM0`
+ *
+ * @returns {stream.Duplex} Port stream to pass to Device
+ */
+function open(path) {
+  const fd = fs.openSync(path, fs.constants.O_RDWR | fs.constants.O_NOCTTY);
+
+  try {
+    execFileSync('stty', [process.platform === 'darwin' ? '-f' : '-F', path,
+      'raw', '-echo'], {stdio: 'ignore'});
+  } catch (err) {
+    fs.closeSync(fd);
+    throw new Error(`cannot configure ${path}: ${err.message}`);
+  }
+  return new tty.ReadStream(fd);
+}
+
+/**
+ * Connection to one device
+ *
+ * Keeps the bytes received from the port and hands them out as reply
+ * frames or console lines.
+ */
+class Device {
+  /**
+   * @param {stream.Duplex} port - Open serial port (see open())
+   * @param {Object} [options]
+   * @param {number} [options.timeout=2000] - ms to wait for the device
+   *   to send anything
+   */
+  constructor(port, options = {}) {
+    this.port = port;
+    this.timeout = options.timeout || 2000;
+    this.rx = Buffer.alloc(0);
+    this.wake = null;
+    port.on('data', (data) => {
+      this.rx = Buffer.concat([this.rx, data]);
+      if (this.wake) this.wake();
+    });
+  }
+
+  /**
+   * Wait until a condition on the received bytes holds
+   *
+   * @param {Function} take - Returns the number of bytes that make up
+   *   the item at the start of rx, or 0 if it is not complete yet
+   *
+   * @returns {Promise<Buffer>} The item, removed from rx
+   */
+  receive(take) {
+    return new Promise((resolve, reject) => {
+      let timer;
+
+      this.wake = () => {
+        const n = take(this.rx);
+        clearTimeout(timer);
+        if (!n) {
+          // Restarted on every packet: a long read only fails if it stalls
+          timer = setTimeout(() => {
+            this.wake = null;
+            reject(new Error('timeout waiting for the device'));
+          }, this.timeout);
+          return;
+        }
+        this.wake = null;
+        const item = this.rx.slice(0, n);
+        this.rx = this.rx.slice(n);
+        resolve(item);
+      };
+      this.wake();
+    });
+  }
+
+  /**
+   * Read the next upload reply, skipping any console output before it
+   *
+   * @returns {Promise<Object>} Decoded reply, see parseReply()
+   */
+  async reply() {
+    const buf = await this.receive((rx) => {
+      const start = rx.indexOf(MAGIC);
+      if (start > 0) this.rx = rx = rx.slice(start);
+      return start === 0 && rx.length >= 4 ? 4 : 0;
+    });
+    return parseReply(buf);
+  }
+
+  /**
+   * Read one console line
+   *
+   * @returns {Promise<string>} Line without its CR LF terminator
+   */
+  async line() {
+    const buf = await this.receive((rx) => {
+      const end = rx.indexOf('\r\n');
+      return end < 0 ? 0 : end + 2;
+    });
+    return buf.toString('latin1', 0, buf.length - 2);
+  }
+
+  /**
+   * Switch the console to quiet mode and discard earlier output
+   *
+   * Quiet mode answers every command with exactly one line, which is
+   * what command() relies on.
+   *
+   * @returns {Promise<void>}
+   */
+  async quiet() {
+    this.port.write('\rq1\r');
+    while (!(await this.line()).endsWith('quiet')) {
+      // prompt, echo and replies from before quiet mode
+    }
+  }
+
+  /**
+   * Run one console command (quiet mode)
+   *
+   * @param {string} cmd - Command line without terminator, e.g. `nDemo`
+   *
+   * @returns {Promise<string>} The reply line
+   */
+  command(cmd) {
+    this.port.write(cmd + '\r');
+    return this.line();
+  }
+
+  /**
+   * Read the runtime counters with `ib`
+   *
+   * @returns {Promise<Object>} See parseStats()
+   */
+  async stats() {
+    return parseStats(await this.command('ib'));
+  }
+
+  /**
+   * Read part of the payload region with `r` (quiet mode)
+   *
+   * @param {number} offset - First byte, 0 is the start of slot 0
+   * @param {number} length - Bytes to read
+   *
+   * @returns {Promise<Buffer>} Flash contents
+   *
+   * @throws {Error} If the device rejects the range or the CRC does not match
+   */
+  async read(offset, length) {
+    const hex32 = (value) => value.toString(16).padStart(8, '0');
+
+    this.port.write('r' + hex32(offset) + hex32(length) + '\r');
+    const frame = await this.receive((rx) => {
+      if (rx.length >= 2 && rx.toString('latin1', 0, 2) !== 'RD') {
+        const end = rx.indexOf('\r\n');
+        return end < 0 ? 0 : end + 2;
+      }
+      if (rx.length < 12) return 0;
+      const size = 12 + rx.readUInt32LE(8) + 4;
+      return rx.length >= size ? size : 0;
+    });
+
+    if (frame.toString('latin1', 0, 2) !== 'RD') {
+      throw new Error(`read failed: ${frame.toString('latin1').trim()}`);
+    }
+    // The CRC is the last byte: no status line follows a range read
+
+    const data = frame.slice(12, frame.length - 4);
+    if (crc32(data) !== frame.readUInt32LE(frame.length - 4)) {
+      throw new Error('read failed: CRC mismatch');
+    }
+    return data;
+  }
+
+  /**
+   * Upload a payload with the binary protocol
+   *
+   * @param {Buffer} payload - Payload bytes (legacy records or compact format)
+   * @param {Object} [options]
+   * @param {number} [options.target=TARGET_FLASH] - TARGET_FLASH or TARGET_RAM
+   * @param {string} [options.name] - Slot name, sent with `n` first (flash only)
+   * @param {number} [options.chunk=CHUNK_MAX] - Data bytes per chunk
+   * @param {number} [options.window=8] - Chunks in flight (1 waits for every ACK)
+   *
+   * @returns {Promise<Object>} Result with the following properties:
+   *   - `bytes` {number}: Payload bytes written
+   *   - `chunks` {number}: Chunks in the payload
+   *   - `sent` {number}: Bytes put on the wire, including resends
+   *   - `naks` {number}: Rewinds after a NAK
+   *   - `ms` {number}: Time from header to DONE
+   *
+   * @throws {Error} On an `E` reply, a failed commit or a timeout
+   */
+  async upload(payload, options = {}) {
+    const target = options.target || TARGET_FLASH;
+    const size = Math.min(options.chunk || CHUNK_MAX, CHUNK_MAX);
+    const window = Math.min(options.window || 8, 128);
+    const count = Math.ceil(payload.length / size);
+    const result = {bytes: payload.length, chunks: count, sent: 0, naks: 0, ms: 0};
+
+    if (options.name !== undefined && target === TARGET_FLASH) {
+      await this.command('n' + options.name);
+    }
+
+    const start = process.hrtime.bigint();
+    const send = (buf) => {
+      this.port.write(buf);
+      result.sent += buf.length;
+    };
+
+    send(header(target, payload.length));
+    let reply = await this.reply();
+    if (reply.code !== 'R') throw replyError(reply);
+
+    let base = 0;   // oldest chunk not yet acknowledged
+    let next = 0;   // next chunk to send
+    let stale = 0;  // NAKs still due for chunks sent before a rewind
+
+    for (;;) {
+      for (; next < count && next - base < window; next++) {
+        send(chunk(next, payload.slice(next * size, (next + 1) * size)));
+      }
+
+      reply = await this.reply();
+      if (reply.code === 'D') {
+        if (reply.status !== 0) throw replyError(reply);
+        break;
+      }
+
+      if (reply.code === 'A' && reply.seq === (base & 0xFF)) {
+        base++;
+      } else if (reply.code === 'N' && stale) {
+        stale--;
+      } else if (reply.code === 'N' && reply.seq === (base & 0xFF)) {
+        stale = next - base - 1;
+        next = base;
+        result.naks++;
+      } else {
+        throw replyError(reply);
+      }
+    }
+
+    result.ms = Number(process.hrtime.bigint() - start) / 1e6;
+    return result;
+  }
+
+  /**
+   * Leave quiet mode and close the port
+   */
+  close() {
+    this.port.write('q0\r', () => this.port.destroy());
+  }
+}
+
+/**
+ * Describe an unexpected reply as an Error
+ *
+ * @param {Object} reply - Decoded reply
+ *
+ * @returns {Error} Error with `reply` attached
+ */
+function replyError(reply) {
+  let text;
+
+  if (reply.code === 'E' || reply.code === 'D') {
+    const reason = ERRORS[reply.status] || `flash status 0x${reply.status.toString(16)}`;
+    text = `upload failed at chunk ${reply.seq}: ${reason}`;
+  } else {
+    text = `unexpected reply ${reply.code} for chunk ${reply.seq}`;
+  }
+
+  const err = new Error(text);
+  err.reply = reply;
+  return err;
+}
+
+/*============================================================================
+ * Benchmark
+ *===========================================================================*/
+
+/**
+ * Build a payload of empty keyboard reports
+ *
+ * Every record is sent to the host as a report, but none presses a key,
+ * so the benchmark does not type into the focused window.
+ *
+ * @param {number} bytes - Payload size, rounded down to whole records
+ *
+ * @returns {Buffer} Legacy payload
+ */
+function benchPayload(bytes) {
+  const reports = [];
+  for (let i = 0; i < Math.floor(bytes / 16); i++) {
+    reports.push({report_id: 1, modifiers: 0, reserved: 0, keys_down: [0, 0, 0, 0, 0, 0], leds: 0});
+  }
+  return fromReports(reports);
+}
+
+/**
+ * Measure upload and playback throughput
+ *
+ * Clears the counters, uploads a payload of empty reports and then
+ * samples the `reports` counter while it plays.
+ *
+ * @param {Device} device - Device in quiet mode
+ * @param {Object} [options] - Options of Device.upload(), plus:
+ * @param {number} [options.size] - Payload bytes (default: the target's maximum)
+ * @param {number} [options.seconds=2] - Playback sampling time
+ *
+ * @returns {Promise<Object>} `{upload, bytes_per_s, reports_per_s, stats}`,
+ *   upload being the Device.upload() result and stats the counter
+ *   differences over the sampling time
+ */
+async function bench(device, options = {}) {
+  const max = options.target === TARGET_RAM ? RAM_MAX : FLASH_MAX;
+  const payload = benchPayload(Math.min(options.size || max, max));
+  const seconds = options.seconds || 2;
+
+  await device.command('iz');
+  const upload = await device.upload(payload, options);
+
+  const before = await device.stats();
+  const start = process.hrtime.bigint();
+  await new Promise((resolve) => setTimeout(resolve, seconds * 1000));
+  const after = await device.stats();
+  const elapsed = Number(process.hrtime.bigint() - start) / 1e9;
+
+  const stats = {};
+  COUNTERS.forEach((name) => {
+    stats[name] = after[name] - before[name];
+  });
+
+  return {
+    upload,
+    bytes_per_s: upload.bytes / (upload.ms / 1000),
+    reports_per_s: stats.reports / elapsed,
+    stats,
+  };
+}
+
+/*============================================================================
+ * Command Line
+ *===========================================================================*/
+
+/**
+ * Parse `--key value` options following the positional arguments
+ *
+ * @param {string[]} args - Command line arguments
+ *
+ * @returns {Object} `{positional, options}`
+ */
+function parseArgs(args) {
+  const positional = [];
+  const options = {};
+
+  for (let i = 0; i < args.length; i++) {
+    if (args[i] === '--ram') {
+      options.target = TARGET_RAM;
+    } else if (args[i].startsWith('--')) {
+      const value = args[++i];
+      options[args[i - 1].slice(2)] = args[i - 1] === '--name' ? value : Number(value);
+    } else {
+      positional.push(args[i]);
+    }
+  }
+  return {positional, options};
+}
+
+/**
+ * Entry point for `node upload.js`
+ *
+ * @param {string[]} args - Arguments after the script name
+ *
+ * @returns {Promise<void>}
+ */
+async function main(args) {
+  const {positional, options} = parseArgs(args);
+  const command = ['bench', 'dump'].includes(positional[0]) ? positional.shift() : 'upload';
+  const [path, file] = positional;
+
+  if (!path || (command !== 'bench' && !file)) {
+    console.error('usage: node upload.js <port> <file> [--ram] [--name NAME] [--window N] [--chunk N]');
+    console.error('       node upload.js bench <port> [--ram] [--size N] [--seconds N] [--window N] [--chunk N]');
+    console.error('       node upload.js dump <port> <file> [--offset N] [--length N]');
+    process.exitCode = 2;
+    return;
+  }
+
+  const device = new Device(open(path), options);
+  try {
+    await device.quiet();
+
+    if (command === 'bench') {
+      const result = await bench(device, Object.assign({name: 'bench'}, options));
+      console.log(`upload   ${result.upload.bytes} bytes in ${result.upload.ms.toFixed(1)} ms, ` +
+        `${Math.round(result.bytes_per_s)} bytes/s, ${result.upload.naks} NAKs`);
+      console.log(`playback ${Math.round(result.reports_per_s)} reports/s, ` +
+        `queue_full ${result.stats.queue_full}, missed_ms ${result.stats.missed_ms}`);
+    } else if (command === 'dump') {
+      const offset = options.offset || 0;
+      const data = await device.read(offset, options.length || REGION_SIZE - offset);
+      fs.writeFileSync(file, data);
+      console.log(`${data.length} bytes from offset ${offset}`);
+    } else {
+      const result = await device.upload(fs.readFileSync(file), options);
+      console.log(`${result.bytes} bytes in ${result.ms.toFixed(1)} ms`);
+    }
+  } finally {
+    device.close();
+  }
+}
+
+if (require.main === module) {
+  main(process.argv.slice(2)).catch((err) => {
+    console.error(err.message);
+    process.exitCode = 1;
+  });
+}
+
+/*============================================================================
+ * Module Exports
+ *===========================================================================*/
+
+/**
+ * Module exports for CommonJS (Node.js)
+ *
+ * @exports crc32 - CRC-32 of the upload protocol
+ * @exports header - Build an upload header
+ * @exports chunk - Build a chunk frame
+ * @exports parseReply - Decode a reply
+ * @exports parseStats - Decode the `ib` counter dump
+ * @exports fromReports - Build a legacy payload from report objects
+ * @exports open - Open the serial port
+ * @exports Device - Connection to one device (upload, read, stats)
+ * @exports bench - Measure upload and playback throughput
+ */
+module.exports = {
+  MAGIC, TARGET_FLASH, TARGET_RAM, CHUNK_MAX, FLASH_MAX, RAM_MAX, REGION_SIZE,
+  crc32, header, chunk, parseReply, parseStats, fromReports,
+  open, Device, bench,
+};
@@ -24,17 +24,22 @@
  * | w<hex>  | Write raw hex data to flash                      |
  * | d<hex>  | Write compiled DuckyScript to flash              |
  * | j       | Write mouse jiggler pattern to flash             |
+ * | m<hex>  | Load raw hex data into RAM and run it            |
+ * | c       | Commit the RAM payload to flash                  |
  * | r       | Read first 16 bytes from flash (hex-encoded)     |
  * | @       | Show current report execution index              |
  * | p       | Pause/resume script execution                    |
  * | s       | Single-step execution                            |
  * | z       | Reset report index to zero                       |
  *
+ * A line starting with the byte UPLOAD_MAGIC (0xB5) switches the port
+ * into framed binary upload mode until the transfer ends (see upload.h).
+ *
  * ## USB Architecture
  *
  * CDC ACM requires two USB interfaces:
- * 1. **Communication Interface** (Interface 1): Handles CDC control requests
- * 2. **Data Interface** (Interface 2): Carries actual serial data
+ * 1. **Communication Interface** (Interface 2): Handles CDC control requests
+ * 2. **Data Interface** (Interface 3): Carries actual serial data
  *
  * An Interface Association Descriptor (IAD) groups these interfaces.
  *
@@ -84,6 +89,9 @@
 #include <string.h>
 
 #include "cdcacm.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "upload.h"
 #include "version.h"
 
 /*============================================================================
@@ -116,6 +124,37 @@
  */
 #define CDCACM_INTR_ENDPOINT	0x84
 
+/**
+ * @brief Interface numbers of the CDC ACM function
+ *
+ * They follow the two HID interfaces (keyboard 0, mouse 1).
+ * @{
+ */
+#define CDCACM_COMM_INTERFACE	2  /**< Communication (control) interface */
+#define CDCACM_DATA_INTERFACE	3  /**< Data interface */
+/** @} */
+
+/**
+ * @brief Size of the accumulated command line buffer
+ */
+#define TYPING_BUF_SIZE		2048
+
+/**
+ * @brief Size of the transmit ring buffer (power of two)
+ *
+ * Four packets: enough for an echo, a response and the prompt, while
+ * longer output (dumps, traces) streams through it.
+ */
+#define CDCACM_TX_SIZE		512
+
+/**
+ * @brief Longest wait for the host to read, in ms, before output is dropped
+ *
+ * A host that reads at all frees a packet per frame (1 ms), so this only
+ * expires when it has stopped reading with the port still open.
+ */
+#define CDCACM_TX_TIMEOUT_MS	50
+
 /*============================================================================
  * USB Endpoint Descriptors
  *===========================================================================*/
@@ -217,7 +256,7 @@ static const struct {
 		.bDescriptorType = CS_INTERFACE,
 		.bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
 		.bmCapabilities = 0,                       /* No call management */
-		.bDataInterface = 2,                       /* Data interface number */
+		.bDataInterface = CDCACM_DATA_INTERFACE,   /* Data interface number */
 	},
 	/* Abstract Control Model Descriptor - defines ACM capabilities */
 	.acm = {
@@ -231,8 +270,8 @@ static const struct {
 		.bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
 		.bDescriptorType = CS_INTERFACE,
 		.bDescriptorSubtype = USB_CDC_TYPE_UNION,
-		.bControlInterface = 1,                    /* Communication interface */
-		.bSubordinateInterface0 = 2,               /* Data interface */
+		.bControlInterface = CDCACM_COMM_INTERFACE, /* Communication interface */
+		.bSubordinateInterface0 = CDCACM_DATA_INTERFACE, /* Data interface */
 	 }
 };
 
@@ -243,13 +282,13 @@ static const struct {
 /**
  * @brief CDC Communication Class interface descriptor
  *
- * Defines Interface 1, which handles CDC control functions including:
+ * Defines Interface 2, which handles CDC control functions including:
  * - SET_LINE_CODING (baud rate, parity, etc. - ignored by firmware)
  * - SET_CONTROL_LINE_STATE (DTR, RTS signals)
  * - Serial state notifications (DCD, DSR)
  *
  * Configuration:
- * - **Interface Number**: 1
+ * - **Interface Number**: 2
  * - **Class**: CDC (Communications Device Class)
  * - **SubClass**: ACM (Abstract Control Model)
  * - **Protocol**: AT commands (V.250)
@@ -261,7 +300,7 @@ static const struct {
 const struct usb_interface_descriptor uart_comm_iface[] = {{
 	.bLength = USB_DT_INTERFACE_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = 1,                    /* Second interface (after HID) */
+	.bInterfaceNumber = CDCACM_COMM_INTERFACE, /* After the HID interfaces */
 	.bAlternateSetting = 0,
 	.bNumEndpoints = 1,                       /* One interrupt endpoint */
 	.bInterfaceClass = USB_CLASS_CDC,
@@ -278,19 +317,19 @@ const struct usb_interface_descriptor uart_comm_iface[] = {{
 /**
  * @brief CDC Data Class interface descriptor
  *
- * Defines Interface 2, which carries the actual serial data.
+ * Defines Interface 3, which carries the actual serial data.
  * This interface has two bulk endpoints for bidirectional
  * communication.
  *
  * Configuration:
- * - **Interface Number**: 2
+ * - **Interface Number**: 3
  * - **Class**: CDC Data
  * - **Endpoints**: 2 (bulk IN and OUT)
  */
 const struct usb_interface_descriptor uart_data_iface[] = {{
 	.bLength = USB_DT_INTERFACE_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = 2,                    /* Third interface */
+	.bInterfaceNumber = CDCACM_DATA_INTERFACE, /* Last interface */
 	.bAlternateSetting = 0,
 	.bNumEndpoints = 2,                       /* Bulk IN and OUT */
 	.bInterfaceClass = USB_CLASS_DATA,        /* Data class */
@@ -304,7 +343,7 @@ const struct usb_interface_descriptor uart_data_iface[] = {{
 /**
  * @brief Interface Association Descriptor for CDC function
  *
- * Groups the Communication (1) and Data (2) interfaces into a single
+ * Groups the Communication (2) and Data (3) interfaces into a single
  * CDC ACM function. This is required for composite USB devices so that
  * the host OS can properly associate related interfaces.
  *
@@ -317,14 +356,68 @@ const struct usb_interface_descriptor uart_data_iface[] = {{
 const struct usb_iface_assoc_descriptor uart_assoc = {
 	.bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
-	.bFirstInterface = 1,                     /* Start at interface 1 */
-	.bInterfaceCount = 2,                     /* Includes interfaces 1 and 2 */
+	.bFirstInterface = CDCACM_COMM_INTERFACE, /* Start at interface 2 */
+	.bInterfaceCount = 2,                     /* Includes interfaces 2 and 3 */
 	.bFunctionClass = USB_CLASS_CDC,
 	.bFunctionSubClass = USB_CDC_SUBCLASS_ACM,
 	.bFunctionProtocol = USB_CDC_PROTOCOL_AT,
 	.iFunction = 0,                           /* No string descriptor */
 };
 
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+/**
+ * @brief USB device the CDC interface was configured on
+ *
+ * Recorded in cdcacm_set_config() so that cdcacm_write() can be used by
+ * modules that do not see the usbd_device handle.
+ */
+static usbd_device *cdcacm_dev;
+
+/**
+ * @brief Data waiting to be sent on the bulk IN endpoint (0x83)
+ *
+ * Filled by the main loop (cdcacm_write()), drained one packet at a
+ * time by cdcacm_tx_kick() from the endpoint's IN-complete callback, so
+ * a host that reads slowly only holds up writers once the ring is full.
+ * head is only written by the main loop; tail by cdcacm_tx_kick() with
+ * the USB interrupt masked or from the interrupt itself, and by the
+ * interrupt when queued output is discarded. Both count bytes and wrap
+ * as uint32_t.
+ */
+static struct {
+	uint8_t buf[CDCACM_TX_SIZE];  /**< Ring storage */
+	volatile uint32_t head;       /**< Bytes ever queued */
+	volatile uint32_t tail;       /**< Bytes ever handed to the endpoint */
+	volatile bool busy;           /**< A packet is in the endpoint buffer */
+	volatile bool open;           /**< Host asserts DTR: a terminal is reading */
+	bool stalled;                 /**< Last wait timed out, host not reading */
+} cdcacm_tx;
+
+/**
+ * @brief Packet handed from the USB interrupt to the main loop
+ *
+ * The OUT endpoint is NAKed while a packet is waiting, so the host
+ * holds back further data until cdcacm_poll() has consumed it.
+ */
+static struct {
+	char buf[CDCACM_PACKET_SIZE];  /**< Packet payload */
+	volatile int len;              /**< Bytes in buf, 0 when empty */
+	volatile bool reset;           /**< Configuration changed since last poll */
+} cdcacm_rx;
+
+/**
+ * @brief Quiet mode: no echo, no prompt, one status line per command
+ */
+static bool cdcacm_quiet;
+
+/**
+ * @brief The command just run sent a binary response, see cdcacm_end_binary()
+ */
+static bool cdcacm_binary;
+
 /*============================================================================
  * Internal Functions
  *===========================================================================*/
@@ -345,7 +438,7 @@ const struct usb_iface_assoc_descriptor uart_assoc = {
  * 0       1     bmRequestType   0xA1 (device-to-host, class, interface)
  * 1       1     bNotification   0x20 (SERIAL_STATE)
  * 2       2     wValue          0
- * 4       2     wIndex          Interface number
+ * 4       2     wIndex          Communication interface number
  * 6       2     wLength         2
  * 8       2     Data            Modem state bits
  * @endcode
@@ -355,13 +448,12 @@ const struct usb_iface_assoc_descriptor uart_assoc = {
  * - Bit 1: DSR (Data Set Ready)
  *
  * @param dev  USB device instance
- * @param iface Interface number (used to calculate endpoint address)
  * @param dsr  DSR signal state (true = asserted)
  * @param dcd  DCD signal state (true = asserted)
  *
- * @note This function sends to endpoint 0x82 + iface (e.g., 0x84 for iface 2)
+ * @note Sent on the notification endpoint (CDCACM_INTR_ENDPOINT)
  */
-static void cdcacm_set_modem_state(usbd_device *dev, int iface, bool dsr, bool dcd)
+static void cdcacm_set_modem_state(usbd_device *dev, bool dsr, bool dcd)
 {
 	char buf[10];
 	struct usb_cdc_notification *notif = (void*)buf;
@@ -370,13 +462,13 @@ static void cdcacm_set_modem_state(usbd_device *dev, int iface, bool dsr, bool d
 	notif->bmRequestType = 0xA1;                     /* Class, interface, device-to-host */
 	notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
 	notif->wValue = 0;
-	notif->wIndex = iface;
+	notif->wIndex = CDCACM_COMM_INTERFACE;
 	notif->wLength = 2;                              /* 2 bytes of data follow */
 	buf[8] = (dsr ? 2 : 0) | (dcd ? 1 : 0);          /* Modem state bits */
 	buf[9] = 0;
 
 	/* Send notification on interrupt endpoint */
-	usbd_ep_write_packet(dev, 0x82 + iface, buf, 10);
+	usbd_ep_write_packet(dev, CDCACM_INTR_ENDPOINT, buf, 10);
 }
 
 /**
@@ -419,7 +511,13 @@ static int cdcacm_control_request(usbd_device *dev,
 	switch(req->bRequest) {
 	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
 		/* Host is setting DTR/RTS - respond with DCD/DSR asserted */
-		cdcacm_set_modem_state(dev, req->wIndex, true, true);
+		cdcacm_set_modem_state(dev, true, true);
+
+		/* DTR (bit 0): a terminal has opened the port, see cdcacm_write() */
+		cdcacm_tx.open = req->wValue & 1;
+		if (!cdcacm_tx.open)
+			cdcacm_tx.tail = cdcacm_tx.head;
+		cdcacm_tx.stalled = false;
 		return 1;
 
 	case USB_CDC_REQ_SET_LINE_CODING:
@@ -432,46 +530,6 @@ static int cdcacm_control_request(usbd_device *dev,
 	return 0;
 }
 
-/**
- * @brief Send data to host in chunks, blocking until complete
- *
- * Sends a buffer to the host by breaking it into USB packet-sized
- * chunks. This function blocks until all data has been transmitted,
- * retrying each chunk until the endpoint buffer accepts it.
- *
- * This is necessary because:
- * 1. USB endpoints have limited buffer sizes (CDCACM_PACKET_SIZE)
- * 2. usbd_ep_write_packet() may return 0 if the buffer is full
- *
- * @param buf              Pointer to data buffer to send
- * @param len              Total number of bytes to send
- * @param dev              USB device instance
- * @param endpoint         Endpoint address to write to (e.g., 0x83)
- * @param max_packet_length Maximum bytes per USB packet (CDCACM_PACKET_SIZE)
- *
- * @note This function is blocking and will spin-wait if the endpoint
- *       buffer is full. Use with caution in interrupt contexts.
- *
- * @warning Large transfers may block for extended periods if the host
- *          is not reading data from the endpoint.
- */
-static void send_chunked_blocking(char *buf, int len, usbd_device *dev, int endpoint, int max_packet_length) {
-	uint16_t bytes_written = 0;
-	uint16_t total_bytes_written = 0;
-	uint16_t bytes_remaining = len;
-
-	do {
-		/* Determine chunk size (limited by max packet) */
-		uint16_t this_length = bytes_remaining;
-		if (this_length > max_packet_length) this_length = max_packet_length;
-
-		/* Try to send chunk, may return 0 if buffer full */
-		bytes_written = usbd_ep_write_packet(dev, endpoint, buf + total_bytes_written, this_length);
-		bytes_remaining -= bytes_written;
-		total_bytes_written += bytes_written;
-	} while (bytes_remaining > 0);
-}
-
 /**
  * @brief External reference to command processor in main.c
  *
@@ -484,114 +542,359 @@ static void send_chunked_blocking(char *buf, int len, usbd_device *dev, int endp
 extern char *process_serial_command(char *buf, int len);
 
 /**
- * @brief USB callback for received serial data (OUT endpoint)
+ * @brief Run one command line, which may hold several commands
  *
- * Called by the USB stack when data is received on the bulk OUT
- * endpoint (0x03). This function implements the serial console:
+ * Commands are separated by ';' and run in order, as if each had been
+ * sent on a line of its own. Hex arguments never contain ';'.
  *
- * 1. Reads incoming data from USB endpoint
- * 2. Echoes characters back to the host (for terminal display)
- * 3. Accumulates characters until CR or LF (Enter key)
- * 4. Processes complete commands via process_serial_command()
- * 5. Sends command response and new prompt to host
+ * - Normal mode: the responses are separated by line breaks and followed
+ *   by one "duck> " prompt
+ * - Quiet mode: every command is answered with one line, "ok" if the
+ *   command has no other response, and there is no prompt. Empty
+ *   commands are skipped, so a host may pipeline lines ending in CR LF
+ *   and count one reply line per command
+ *
+ * @param line Command line including its terminator (CR or LF); the
+ *             separators are replaced with LF in place
+ * @param len  Length of line including the terminator
+ */
+static void cdcacm_run_line(char *line, int len)
+{
+	char *cmd = line;
+	bool first = true;
+	bool binary = false;
+
+	for (int i = 0; i < len; i++) {
+		if (line[i] != ';' && i != len - 1)
+			continue;
+
+		/* Each command sees its own line terminator, as when typed alone */
+		if (line[i] == ';') line[i] = '\n';
+		int cmd_len = &line[i] - cmd + 1;
+		char *command = cmd;
+		cmd = &line[i + 1];
+
+		if (cdcacm_quiet && cmd_len == 1)
+			continue;
+
+		char *response = process_serial_command(command, cmd_len);
+
+		/* Nothing may follow a binary block but the next command's output */
+		binary = cdcacm_binary;
+		cdcacm_binary = false;
+		if (binary) {
+			first = true;
+			continue;
+		}
+
+		/* The command may have switched quiet mode */
+		if (cdcacm_quiet) {
+			cdcacm_write(*response ? response : "ok", *response ? strlen(response) : 2);
+			cdcacm_write("\r\n", 2);
+		} else {
+			if (!first) cdcacm_write("\r\n", 2);
+			cdcacm_write(response, strlen(response));
+		}
+		first = false;
+	}
+
+	/* Prompt for next command */
+	if (!cdcacm_quiet && !binary)
+		cdcacm_write("\r\nduck> ", 8);
+}
+
+/**
+ * @brief Run the serial console on one received packet
+ *
+ * Called by cdcacm_poll() from the main loop for each packet received
+ * on the bulk OUT endpoint (0x03). This function implements the serial
+ * console:
+ *
+ * 1. Echoes characters back to the host (for terminal display)
+ * 2. Accumulates characters until CR or LF (Enter key)
+ * 3. Processes complete commands via process_serial_command(), see
+ *    cdcacm_run_line() for batches of ';' separated commands
+ * 4. Sends command response and new prompt to host
  *
  * ## Input Buffer
  *
  * Characters are accumulated in a static 2048-byte buffer until
  * a newline is received. This allows for long commands (hex data).
+ * Characters beyond the buffer size are dropped (but still echoed)
+ * until the line ends.
  *
  * ## Echo Behavior
  *
  * - All received characters are echoed back immediately
  * - CR (\\r) is converted to CR+LF for proper line advancement
  * - After command execution, response + "duck> " prompt is sent
+ * - In quiet mode ('q1') nothing is echoed and there is no prompt; each
+ *   command is answered with exactly one line
  *
- * @param dev USB device instance
- * @param ep  Endpoint that received data (always CDCACM_UART_ENDPOINT)
+ * ## Binary Upload
+ *
+ * If UPLOAD_MAGIC arrives at the start of a line, or an upload is
+ * already in progress, the remaining bytes of the packet are handed to
+ * upload_receive() instead of being echoed. Any bytes the upload parser
+ * does not consume (after the final frame) continue in line mode.
+ *
+ * All output goes through the transmit ring (cdcacm_write()), so the
+ * echo, responses and upload replies reach the host in order.
+ *
+ * @param buf Packet data
+ * @param len Packet length
  *
  * @note Uses static variables, so this function is not reentrant.
  *       The typing buffer supports commands up to 2048 characters.
  *
  * @see process_serial_command() for command handling
- * @see send_chunked_blocking() for response transmission
+ * @see cdcacm_write() for response transmission
  */
-static void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep)
+static void cdcacm_process(const char *buf, int len)
 {
-	(void)ep;
-
-	char buf[CDCACM_PACKET_SIZE];     /* Receive buffer for USB packet */
-	char reply_buf[256];              /* Response buffer for echo + response */
-
-	static char typing_buf[2048] = {0}; /* Accumulated command line */
+	static char typing_buf[TYPING_BUF_SIZE] = {0}; /* Accumulated command line */
 	static int typing_index = 0;        /* Current position in typing_buf */
 
-	/* Read data from USB endpoint */
-	int len = usbd_ep_read_packet(dev, CDCACM_UART_ENDPOINT,
-					buf, CDCACM_PACKET_SIZE);
-
-
-	int j = 0;  /* Reply buffer write index */
 	for(int i = 0; i < len; i++) {
 		gpio_toggle(GPIOC, GPIO13);  /* Toggle LED on activity */
 
+		/* Binary upload frames bypass the line editor */
+		if (upload_active() || (typing_index == 0 && (uint8_t)buf[i] == UPLOAD_MAGIC)) {
+			i += upload_receive((const uint8_t *)&buf[i], len - i) - 1;
+			continue;
+		}
+
 		/* Echo character back to host */
 		/* CR needs LF added for proper terminal line advancement */
-		if (buf[i] == '\r') reply_buf[j++] = '\n';
-		reply_buf[j++] = buf[i];
+		if (!cdcacm_quiet) {
+			if (buf[i] == '\r') cdcacm_write("\n", 1);
+			cdcacm_write(&buf[i], 1);
+		}
 
-		/* Accumulate character in typing buffer */
-		typing_buf[typing_index++] = buf[i];
+		/* Accumulate character in typing buffer, dropping overflow */
+		if (typing_index < TYPING_BUF_SIZE)
+			typing_buf[typing_index++] = buf[i];
 
 		/* Check for end of line (command complete) */
 		if (buf[i] == '\r' || buf[i] == '\n') {
-			/* Process the complete command */
-			char *response = process_serial_command(typing_buf, typing_index);
+			/* Process the complete command line */
+			cdcacm_run_line(typing_buf, typing_index);
 			typing_index = 0;  /* Reset for next command */
-
-			/* Append command response to reply */
-			for (size_t k = 0; k < strlen(response); ++k) {
-				reply_buf[j++] = response[k];
-			}
-
-			/* Append prompt for next command */
-			reply_buf[j++] = '\r';
-			reply_buf[j++] = '\n';
-			reply_buf[j++] = 'd';
-			reply_buf[j++] = 'u';
-			reply_buf[j++] = 'c';
-			reply_buf[j++] = 'k';
-			reply_buf[j++] = '>';
-			reply_buf[j++] = ' ';
 		}
 	}
+}
+
+/**
+ * @brief Move the next packet from the transmit ring into the endpoint
+ *
+ * Sends up to one packet of contiguous ring data. Does nothing while
+ * the host has not read the previous packet or the ring is empty. Runs
+ * from RAM: it is called from the USB interrupt, which keeps running
+ * during flash writes. Callers in the main loop mask the USB interrupt.
+ */
+static RAMFUNC void cdcacm_tx_kick(void)
+{
+	uint32_t queued = cdcacm_tx.head - cdcacm_tx.tail;
+	uint32_t offset = cdcacm_tx.tail % CDCACM_TX_SIZE;
+	uint16_t len;
+
+	if (cdcacm_tx.busy || queued == 0 || !cdcacm_dev)
+		return;
+
+	/* Up to the end of the ring, the rest goes in the next packet */
+	len = queued;
+	if (len > CDCACM_TX_SIZE - offset) len = CDCACM_TX_SIZE - offset;
+	if (len > CDCACM_PACKET_SIZE) len = CDCACM_PACKET_SIZE;
+
+	if (usbd_ep_write_packet(cdcacm_dev, 0x80 | CDCACM_UART_ENDPOINT, &cdcacm_tx.buf[offset], len) == 0)
+		return;
+
+	cdcacm_tx.busy = true;
+	cdcacm_tx.tail += len;
+	stats.cdc_out += len;
+}
+
+/**
+ * @brief USB callback for received serial data (OUT endpoint)
+ *
+ * Runs in the USB interrupt. Commands can take a long time (a flash
+ * write erases and programs many pages), so the packet is only copied
+ * to cdcacm_rx here and the endpoint is NAKed; cdcacm_poll() processes
+ * it from the main loop and re-enables reception.
+ *
+ * @param dev USB device instance
+ * @param ep  Endpoint that received data (always CDCACM_UART_ENDPOINT)
+ */
+static RAMFUNC void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep)
+{
+	(void)ep;
 
-	/* Send accumulated reply (echo + response + prompt) */
-	send_chunked_blocking(reply_buf, j, dev, CDCACM_UART_ENDPOINT, CDCACM_PACKET_SIZE);
+	/* NAK before reading so the endpoint is not re-armed by the read */
+	usbd_ep_nak_set(dev, CDCACM_UART_ENDPOINT, 1);
+
+	cdcacm_rx.len = usbd_ep_read_packet(dev, CDCACM_UART_ENDPOINT,
+					cdcacm_rx.buf, CDCACM_PACKET_SIZE);
+
+	stats.cdc_in += cdcacm_rx.len;
+
+	/* Zero length packet: nothing to hand over */
+	if (cdcacm_rx.len == 0)
+		usbd_ep_nak_set(dev, CDCACM_UART_ENDPOINT, 0);
 }
 
 /**
  * @brief USB callback for serial data transmission complete (IN endpoint)
  *
- * Called by the USB stack when a packet has been successfully transmitted
- * on the bulk IN endpoint (0x83). Currently this callback is a no-op
- * since data transmission is handled synchronously in send_chunked_blocking().
+ * Called by the USB stack when the host has read the packet on the bulk
+ * IN endpoint (0x83). Sends the next part of the transmit ring, if any.
  *
  * @param dev USB device instance (unused)
  * @param ep  Endpoint that completed transmission (unused)
- *
- * @note This callback could be used to implement asynchronous/buffered
- *       transmission in a future enhancement.
  */
-static void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep)
+static RAMFUNC void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep)
 {
 	(void) dev;
 	(void) ep;
+
+	cdcacm_tx.busy = false;
+	cdcacm_tx_kick();
+}
+
+/**
+ * @brief Copy bytes into the transmit ring and start sending them
+ *
+ * Copies the data into the transmit ring and starts sending if the
+ * endpoint is idle; the IN-complete callback sends the rest. Only waits
+ * when the ring is full, i.e. when more than CDCACM_TX_SIZE bytes are
+ * still on their way to the host, and then for at most
+ * CDCACM_TX_TIMEOUT_MS without the host reading anything. After that the
+ * rest is dropped (counted in stats.cdc_dropped), and so is any output
+ * that finds the ring still full, until the host reads again.
+ *
+ * The timeout runs on the cycle counter: the playback clock stops while
+ * playback is paused.
+ *
+ * @param data  Data to send
+ * @param len   Number of bytes
+ * @param reply true to send even with DTR off
+ */
+static void cdcacm_queue(const uint8_t *data, int len, bool reply)
+{
+	bool waited = false;
+	uint32_t since = 0;
+
+	while (len > 0 && cdcacm_dev && (cdcacm_tx.open || reply)) {
+		uint32_t space = CDCACM_TX_SIZE - (cdcacm_tx.head - cdcacm_tx.tail);
+		uint32_t offset = cdcacm_tx.head % CDCACM_TX_SIZE;
+		uint32_t chunk = len;
+
+		if (chunk > space) chunk = space;
+		if (chunk > CDCACM_TX_SIZE - offset) chunk = CDCACM_TX_SIZE - offset;
+
+		memcpy(&cdcacm_tx.buf[offset], data, chunk);
+		cdcacm_tx.head += chunk;
+		data += chunk;
+		len -= chunk;
+
+		nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+		cdcacm_tx_kick();
+		nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+
+		if (chunk != 0) {
+			/* The host is reading: wait anew the next time the ring is full */
+			cdcacm_tx.stalled = false;
+			since = stats_cycles();
+			continue;
+		}
+
+		/* Ring full: the IN-complete interrupt frees space as the host reads */
+		if (!waited) {
+			waited = true;
+			since = stats_cycles();
+			if (!cdcacm_tx.stalled)
+				++stats.cdc_spins;
+		}
+		if (cdcacm_tx.stalled ||
+		    stats_cycles() - since >= CDCACM_TX_TIMEOUT_MS * 1000 * STATS_CYCLES_PER_US) {
+			cdcacm_tx.stalled = true;
+			stats.cdc_dropped += len;
+			return;
+		}
+	}
 }
 
 /*============================================================================
  * Public Functions
  *===========================================================================*/
 
+bool cdcacm_pending(void)
+{
+	return cdcacm_rx.len != 0 || cdcacm_rx.reset;
+}
+
+void cdcacm_poll(void)
+{
+	if (cdcacm_rx.reset) {
+		cdcacm_rx.reset = false;
+
+		/* A new configuration abandons any half finished upload */
+		upload_reset();
+	}
+
+	if (cdcacm_rx.len == 0)
+		return;
+
+	cdcacm_process(cdcacm_rx.buf, cdcacm_rx.len);
+
+	/* Accept the next packet */
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	cdcacm_rx.len = 0;
+	usbd_ep_nak_set(cdcacm_dev, CDCACM_UART_ENDPOINT, 0);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+/**
+ * @brief Switch quiet (batch) mode on or off
+ *
+ * @param quiet true: no echo and no prompt, one reply line per command
+ */
+void cdcacm_set_quiet(bool quiet)
+{
+	cdcacm_quiet = quiet;
+}
+
+void cdcacm_end_binary(void)
+{
+	cdcacm_binary = true;
+}
+
+/**
+ * @brief Queue raw bytes for the host on the data IN endpoint
+ *
+ * Output is dropped before the interface has been configured and while
+ * no terminal has the port open (DTR off), so a host that is not
+ * reading cannot stall the firmware. See cdcacm_queue() for the
+ * full ring.
+ *
+ * @param buf Data to send
+ * @param len Number of bytes
+ */
+void cdcacm_write(const void *buf, int len)
+{
+	cdcacm_queue(buf, len, false);
+}
+
+/**
+ * @brief Queue a protocol reply, whatever the DTR state
+ *
+ * @param buf Data to send
+ * @param len Number of bytes
+ */
+void cdcacm_write_reply(const void *buf, int len)
+{
+	cdcacm_queue(buf, len, true);
+}
+
 /**
  * @brief Configure the CDC ACM interface after USB enumeration
  *
@@ -599,10 +902,11 @@ static void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep)
  * (SET_CONFIGURATION request). It performs the following setup:
  *
  * 1. **Bulk OUT endpoint (0x03)**: Receives serial data from host
- *    - Callback: usbuart_usb_out_cb() for command processing
+ *    - Callback: usbuart_usb_out_cb() hands packets to cdcacm_poll()
  *
  * 2. **Bulk IN endpoint (0x83)**: Sends serial data to host
- *    - Callback: usbuart_usb_in_cb() (currently unused)
+ *    - Callback: usbuart_usb_in_cb() sends the next part of the
+ *      transmit ring
  *
  * 3. **Interrupt IN endpoint (0x84)**: Sends modem state notifications
  *    - No callback (notification-only)
@@ -634,6 +938,17 @@ void cdcacm_set_config(usbd_device *dev, uint16_t wValue)
 {
 	(void) wValue;
 
+	cdcacm_dev = dev;
+
+	/* Drop any half finished upload from the main loop, see cdcacm_poll() */
+	cdcacm_rx.reset = true;
+
+	/* Output queued for the previous configuration is lost with it */
+	cdcacm_tx.tail = cdcacm_tx.head;
+	cdcacm_tx.busy = false;
+	cdcacm_tx.open = false;
+	cdcacm_tx.stalled = false;
+
 	/* Configure bulk endpoints for serial data */
 	usbd_ep_setup(dev, CDCACM_UART_ENDPOINT, USB_ENDPOINT_ATTR_BULK,
 	              CDCACM_PACKET_SIZE, usbuart_usb_out_cb);      /* OUT: receive */
@@ -654,7 +969,7 @@ void cdcacm_set_config(usbd_device *dev, uint16_t wValue)
 	 * This is required for proper serial port detection on *BSD and macOS,
 	 * which wait for carrier signal before allowing port access.
 	 */
-	cdcacm_set_modem_state(dev, 2, true, true);
+	cdcacm_set_modem_state(dev, true, true);
 }
 
 
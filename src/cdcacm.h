@@ -15,8 +15,8 @@
  * ## USB Configuration
  *
  * The CDC ACM implementation uses two USB interfaces:
- * - **Interface 1**: Communication Class Interface (control)
- * - **Interface 2**: Data Class Interface (bulk data transfer)
+ * - **Interface 2**: Communication Class Interface (control)
+ * - **Interface 3**: Data Class Interface (bulk data transfer)
  *
  * These are associated using an Interface Association Descriptor (IAD)
  * for proper composite device recognition.
@@ -37,6 +37,7 @@
 #ifndef __CDCACM_H
 #define __CDCACM_H
 
+#include <stdbool.h>
 #include <libopencm3/usb/cdc.h>
 
 /*============================================================================
@@ -46,7 +47,7 @@
 /**
  * @brief CDC Communication Class interface descriptor
  *
- * Defines the CDC control interface (Interface 1) including:
+ * Defines the CDC control interface (Interface 2) including:
  * - Functional descriptors (Header, Call Management, ACM, Union)
  * - Interrupt endpoint for notifications (0x84)
  *
@@ -58,7 +59,7 @@ extern const struct usb_interface_descriptor uart_comm_iface[];
 /**
  * @brief CDC Data Class interface descriptor
  *
- * Defines the CDC data interface (Interface 2) with:
+ * Defines the CDC data interface (Interface 3) with:
  * - Bulk OUT endpoint (0x03) for receiving data from host
  * - Bulk IN endpoint (0x83) for sending data to host
  *
@@ -74,8 +75,8 @@ extern const struct usb_interface_descriptor uart_data_iface[];
  * identify multi-interface functions.
  *
  * Configuration:
- * - First Interface: 1
- * - Interface Count: 2 (interfaces 1 and 2)
+ * - First Interface: 2
+ * - Interface Count: 2 (interfaces 2 and 3)
  * - Function Class: CDC
  * - Function SubClass: ACM
  */
@@ -112,4 +113,70 @@ extern const struct usb_iface_assoc_descriptor uart_assoc;
  */
 void cdcacm_set_config(usbd_device *dev, uint16_t wValue);
 
+/**
+ * @brief Send raw bytes to the host on the CDC data IN endpoint (0x83)
+ *
+ * Copies the data into the transmit ring, which the IN-complete callback
+ * drains; only waits while the ring is full, and drops the rest once the
+ * host has read nothing for CDCACM_TX_TIMEOUT_MS (50 ms). Used for the
+ * console output, including binary command output such as range reads.
+ * Output is dropped before cdcacm_set_config() and while the host has
+ * DTR off, so the console needs a host that asserts DTR.
+ *
+ * @param buf Data to send
+ * @param len Number of bytes (0 sends nothing)
+ */
+void cdcacm_write(const void *buf, int len);
+
+/**
+ * @brief Send a protocol reply to the host, also with DTR off
+ *
+ * Like cdcacm_write(), but not gated on DTR: the host has just sent the
+ * frame being answered, so it is reading the port whatever its modem
+ * lines say. Used for the upload protocol replies.
+ *
+ * @param buf Data to send
+ * @param len Number of bytes (0 sends nothing)
+ */
+void cdcacm_write_reply(const void *buf, int len);
+
+/**
+ * @brief Switch the console's quiet (batch) mode on or off
+ *
+ * In quiet mode received characters are not echoed, no prompt is sent
+ * and every command is answered with exactly one line ("ok" when it
+ * has no other response). Set by the 'q' command.
+ *
+ * @param quiet true for quiet mode, false for the interactive console
+ */
+void cdcacm_set_quiet(bool quiet);
+
+/**
+ * @brief Mark the current command's response as binary
+ *
+ * For a command handler that has written its response itself with
+ * cdcacm_write(): no prompt follows it, and in quiet mode no status
+ * line, so the binary block is the last thing the host receives.
+ * The next command of a ';' batch starts right after it.
+ */
+void cdcacm_end_binary(void);
+
+/**
+ * @brief Process serial data received by the USB interrupt
+ *
+ * Call from the main loop. Runs the command line (or the binary upload
+ * parser) on the packet waiting from the OUT endpoint, if any, then
+ * lets the host send the next one. Command handlers such as flash
+ * writes therefore never run inside the USB interrupt.
+ */
+void cdcacm_poll(void);
+
+/**
+ * @brief Check whether cdcacm_poll() has work waiting
+ *
+ * @return true if a received packet or a configuration change has not
+ *         been processed yet
+ */
+bool cdcacm_pending(void);
+
 #endif /* __CDCACM_H */
@@ -0,0 +1,233 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file clock.c
+ * @brief Playback clock and one-shot delay alarms on TIM2
+ *
+ * ## Timer Configuration
+ *
+ * ```
+ * TIM2 clock (48 MHz) --> PSC (/48000) --> CNT (1 kHz, 0..0xFFFF)
+ *                                           |        |
+ *                                  overflow (UIF)   CCRn match (CCnIF)
+ *                                           |        |
+ *                               clock_overflows++   alarm n check
+ * ```
+ *
+ * The counter never stops or reloads; alarm n (0..3) is implemented by
+ * programming compare channel n + 1 with the low 16 bits of its
+ * deadline. For deadlines more than one counter wrap away, the compare
+ * value is stepped forward half a wrap (32.8 s) at a time until the
+ * remaining time fits.
+ *
+ * Stopping the counter (clock_pause()) stops both the clock and the
+ * alarm countdowns, since all are derived from CNT.
+ *
+ * @see clock.h for interface documentation
+ * @license LGPL-3.0-or-later
+ */
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+
+#include "clock.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+/**
+ * @brief Playback clock frequency in Hz
+ */
+#define CLOCK_HZ 1000
+
+/**
+ * @brief Compare register of an alarm (TIM2_CCR1..TIM2_CCR4 are adjacent)
+ */
+#define CLOCK_CCR(alarm)	((&TIM_CCR1(TIM2))[alarm])
+
+/**
+ * @brief Compare flag (TIM_SR) and interrupt enable (TIM_DIER) bit of an alarm
+ */
+#define CLOCK_CC_BIT(alarm)	(TIM_SR_CC1IF << (alarm))
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+/**
+ * @brief Number of TIM2 counter wraps, upper 16 bits of clock_now()
+ */
+static volatile uint32_t clock_overflows;
+
+/**
+ * @brief Alarm deadlines in clock_now() time
+ */
+static volatile uint32_t alarm_deadline[CLOCK_ALARMS];
+
+/**
+ * @brief Alarm is armed and has not expired yet
+ */
+static volatile bool alarm_armed[CLOCK_ALARMS];
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Program an alarm's compare channel for the next step towards
+ *        its deadline
+ *
+ * Expires the alarm immediately if the deadline has already passed.
+ * Runs from RAM with direct register access, like everything on the
+ * tim2_isr() path, so delays expire on time during flash writes.
+ *
+ * The compare flag is cleared before CCRn is written, so a match right
+ * after the write is kept. A match only fires when the counter steps
+ * onto CCRn: if it got there (or past) while the value was computed,
+ * the deadline is checked again rather than waiting a whole counter
+ * wrap (65.5 s) for the next match.
+ *
+ * @param alarm Alarm number, below CLOCK_ALARMS
+ */
+static RAMFUNC void clock_alarm_program(uint8_t alarm)
+{
+	for (;;) {
+		int32_t remaining = (int32_t)(alarm_deadline[alarm] - clock_now());
+		uint16_t compare;
+
+		if (remaining <= 0) {
+			/* Expired late, e.g. while interrupts were held off */
+			stats.missed_ms -= remaining;
+			trace(TRACE_DELAY_END, -remaining);
+			alarm_armed[alarm] = false;
+			TIM_DIER(TIM2) &= ~CLOCK_CC_BIT(alarm);
+			return;
+		}
+
+		/* Too far away to express in 16 bits: check again half a wrap later */
+		if (remaining > 0xFFFF)
+			remaining = 0x8000;
+
+		TIM_SR(TIM2) = ~CLOCK_CC_BIT(alarm);
+		compare = TIM_CNT(TIM2) + remaining;
+		CLOCK_CCR(alarm) = compare;
+		TIM_DIER(TIM2) |= CLOCK_CC_BIT(alarm);
+
+		/* Still ahead of the counter (1..remaining ticks), or already matched: the interrupt follows */
+		uint16_t ahead = compare - TIM_CNT(TIM2);
+		if ((ahead != 0 && ahead <= remaining) || (TIM_SR(TIM2) & CLOCK_CC_BIT(alarm)))
+			return;
+	}
+}
+
+/*============================================================================
+ * Interrupt Handlers
+ *===========================================================================*/
+
+/**
+ * @brief TIM2 interrupt handler: counter overflow and alarm compares
+ */
+RAMFUNC void tim2_isr(void)
+{
+	uint32_t start = stats_cycles();
+
+	/* Status flags are cleared by writing 0, other bits are unaffected by 1 */
+	if (TIM_SR(TIM2) & TIM_SR_UIF) {
+		TIM_SR(TIM2) = ~TIM_SR_UIF;
+		++clock_overflows;
+	}
+
+	for (uint8_t alarm = 0; alarm < CLOCK_ALARMS; alarm++) {
+		if (TIM_SR(TIM2) & CLOCK_CC_BIT(alarm)) {
+			TIM_SR(TIM2) = ~CLOCK_CC_BIT(alarm);
+			if (alarm_armed[alarm])
+				clock_alarm_program(alarm);
+		}
+	}
+
+	stats_time(&stats.clock_isr, start);
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+void clock_setup(void)
+{
+	rcc_periph_clock_enable(RCC_TIM2);
+
+	timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+
+	/* APB1 runs at half the system clock, so TIM2 is clocked at 2x APB1 */
+	timer_set_prescaler(TIM2, (rcc_apb1_frequency * 2) / CLOCK_HZ - 1);
+	timer_set_period(TIM2, 0xFFFF);
+	timer_continuous_mode(TIM2);
+
+	/* Load the prescaler now rather than at the first overflow */
+	timer_generate_event(TIM2, TIM_EGR_UG);
+	timer_clear_flag(TIM2, TIM_SR_UIF);
+
+	timer_enable_irq(TIM2, TIM_DIER_UIE);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+
+	timer_enable_counter(TIM2);
+}
+
+RAMFUNC uint32_t clock_now(void)
+{
+	uint32_t high, low;
+	bool wrapped;
+
+	do {
+		high = clock_overflows;
+		low = TIM_CNT(TIM2);
+
+		/* Overflow happened but its interrupt has not run yet */
+		wrapped = (TIM_SR(TIM2) & TIM_SR_UIF) && low < 0x8000;
+	} while (high != clock_overflows);
+
+	return ((high + wrapped) << 16) | low;
+}
+
+void clock_alarm_start(uint8_t alarm, uint32_t ms)
+{
+	/* Deadlines are compared as signed differences */
+	if (ms > 0x7FFFFFFF) ms = 0x7FFFFFFF;
+
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+
+	alarm_deadline[alarm] = clock_now() + ms;
+	alarm_armed[alarm] = true;
+	clock_alarm_program(alarm);
+
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+bool clock_alarm_pending(uint8_t alarm)
+{
+	return alarm_armed[alarm];
+}
+
+void clock_alarm_cancel(uint8_t alarm)
+{
+	nvic_disable_irq(NVIC_TIM2_IRQ);
+
+	alarm_armed[alarm] = false;
+	timer_disable_irq(TIM2, CLOCK_CC_BIT(alarm));
+
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+}
+
+void clock_pause(void)
+{
+	timer_disable_counter(TIM2);
+}
+
+void clock_resume(void)
+{
+	timer_enable_counter(TIM2);
+}
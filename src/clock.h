@@ -0,0 +1,94 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file clock.h
+ * @brief Playback clock and one-shot delay alarms on TIM2
+ *
+ * TIM2 runs as a free-running 16-bit counter at 1 kHz, extended to 32
+ * bits in software by counting overflows. Delays are scheduled on the
+ * four compare channels, one alarm per channel (one per playback
+ * track, see engine.c). A channel interrupts only when its delay is
+ * due (or every 32.8 s on the way to very long delays), instead of a
+ * periodic tick waking the CPU every millisecond. The clock can be
+ * stopped while playback is paused, freezing any delay in progress.
+ *
+ * ## Timing
+ *
+ * | Property        | Value                                  |
+ * |-----------------|----------------------------------------|
+ * | Resolution      | 1 ms                                   |
+ * | Counter wrap    | 65.536 s (extended to 32 bits)         |
+ * | Longest alarm   | 2^31 ms (~24.8 days)                   |
+ * | Alarms          | CLOCK_ALARMS (TIM2 CC1-CC4)            |
+ *
+ * @see clock.c for implementation
+ */
+
+#ifndef __CLOCK_H
+#define __CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Number of independent alarms (TIM2 compare channels)
+ */
+#define CLOCK_ALARMS 4
+
+/**
+ * @brief Start TIM2 as the 1 kHz playback clock
+ *
+ * Requires the system clock to be configured first.
+ */
+void clock_setup(void);
+
+/**
+ * @brief Milliseconds since clock_setup()
+ *
+ * Safe to call from any context. Wraps after ~49.7 days; compare times
+ * with signed differences.
+ *
+ * @return Current playback clock time in ms
+ */
+uint32_t clock_now(void);
+
+/**
+ * @brief Arm a one-shot alarm
+ *
+ * Any delay already armed on the same alarm is replaced.
+ *
+ * @param alarm Alarm number, below CLOCK_ALARMS
+ * @param ms    Delay from now in milliseconds (0 expires immediately)
+ */
+void clock_alarm_start(uint8_t alarm, uint32_t ms);
+
+/**
+ * @brief Check whether an alarm is armed and has not yet expired
+ *
+ * @param alarm Alarm number, below CLOCK_ALARMS
+ *
+ * @return true while waiting for the alarm
+ */
+bool clock_alarm_pending(uint8_t alarm);
+
+/**
+ * @brief Disarm an alarm without waiting for it
+ *
+ * @param alarm Alarm number, below CLOCK_ALARMS
+ */
+void clock_alarm_cancel(uint8_t alarm);
+
+/**
+ * @brief Stop the playback clock
+ *
+ * Freezes clock_now() and all armed alarms: the remaining delays resume
+ * where they left off after clock_resume(). TIM2 raises no interrupts
+ * while stopped.
+ */
+void clock_pause(void);
+
+/**
+ * @brief Restart the playback clock after clock_pause()
+ */
+void clock_resume(void);
+
+#endif /* __CLOCK_H */
@@ -0,0 +1,64 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file crc.h
+ * @brief CRC-32 checksum interface
+ *
+ * Provides the standard CRC-32 (IEEE 802.3, as used by zlib, PNG and
+ * Ethernet) for framing and integrity checks on data exchanged with the
+ * host. The calling convention matches zlib's `crc32()` so host tools
+ * can use their stock implementation unchanged:
+ *
+ * ```
+ * uint32_t crc = crc32(0, first, first_len);
+ * crc = crc32(crc, second, second_len);   // continue over more data
+ * ```
+ *
+ * | Parameter     | Value      |
+ * |---------------|------------|
+ * | Polynomial    | 0x04C11DB7 (reflected 0xEDB88320) |
+ * | Initial value | 0xFFFFFFFF |
+ * | Final XOR     | 0xFFFFFFFF |
+ * | Check ("123456789") | 0xCBF43926 |
+ *
+ * crc32_hw() computes the same checksum with the STM32 CRC unit, which
+ * is much faster for large regions such as a whole payload slot.
+ *
+ * @see crc.c for implementation
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __CRC_H
+#define __CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Compute or continue a CRC-32 over a buffer
+ *
+ * @param crc  0 to start a new checksum, or the result of a previous
+ *             call to continue over more data
+ * @param buf  Input data
+ * @param len  Number of bytes in buf
+ *
+ * @return Updated CRC-32 value
+ */
+uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * @brief CRC-32 of a buffer using the hardware CRC unit
+ *
+ * Returns the same value as crc32(0, buf, len). Whole words are fed to
+ * the CRC peripheral (one word per cycle instead of about 30 cycles per
+ * byte in software); a trailing partial word is finished with crc32().
+ * Cannot continue a previous checksum: the unit always starts from
+ * 0xFFFFFFFF. Not reentrant, call from the main loop only.
+ *
+ * @param buf  Input data, word aligned for the fast path
+ * @param len  Number of bytes in buf
+ *
+ * @return CRC-32 value
+ */
+uint32_t crc32_hw(const void *buf, size_t len);
+
+#endif /* __CRC_H */
@@ -0,0 +1,46 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file ducky.c
+ * @brief Compiled DuckyScript to compact payload conversion
+ *
+ * @see ducky.h for the input and output formats
+ * @license LGPL-3.0-or-later
+ */
+
+#include "ducky.h"
+#include "payload.h"
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+int convert_ducky_binary(uint8_t *buf, int len, uint8_t *out)
+{
+	int j = 0;
+
+	/* DuckyScript uses 16-bit words, ensure even length */
+	if ((len % 2) != 0) len -= 1;
+
+	for (int i = 0; i < len; i += 2) {
+		/* Read 16-bit word (little-endian) */
+		uint16_t word = buf[i] | (buf[i + 1] << 8);
+
+		if ((word & 0xff) == 0) {
+			/* Special case: delay command (low byte = 0) */
+			/* High byte contains delay duration in ms */
+			out[j++] = OP_DELAY;
+			out[j++] = word >> 8;
+			continue;
+		}
+
+		/* Key tap: high byte modifiers, low byte keycode */
+		out[j++] = OP_TAP;
+		out[j++] = word >> 8;
+		out[j++] = word & 0xff;
+	}
+
+	/* Add end marker */
+	out[j++] = OP_END;
+
+	return j;
+}
@@ -0,0 +1,74 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file ducky.h
+ * @brief Compiled DuckyScript to compact payload conversion
+ *
+ * Turns the 16-bit words of a compiled DuckyScript (inject.bin) into
+ * compact payload records, as used by the 'd' serial command. Kept
+ * apart from main.c so it builds on the host too (`make host`).
+ *
+ * @see ducky.c for implementation
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __DUCKY_H
+#define __DUCKY_H
+
+#include <stdint.h>
+
+/**
+ * @brief Convert compiled DuckyScript binary to compact payload records
+ *
+ * Parses the binary format produced by the DuckyScript encoder and
+ * generates the corresponding compact records (see payload.h). Each
+ * DuckyScript instruction becomes one or two records.
+ *
+ * ## DuckyScript Binary Format
+ *
+ * The compiled format consists of 16-bit little-endian words:
+ *
+ * | Byte 0 (Low)    | Byte 1 (High) | Meaning                    |
+ * |-----------------|---------------|----------------------------|
+ * | 0x00            | delay_ms      | Delay for delay_ms ticks   |
+ * | keycode         | modifiers     | Press key with modifiers   |
+ *
+ * ## Output Format
+ *
+ * | Instruction | Records                          | Bytes |
+ * |-------------|----------------------------------|-------|
+ * | Delay       | OP_DELAY ms                      | 2     |
+ * | Keypress    | OP_TAP modifiers keycode         | 3     |
+ *
+ * The engine synthesizes the key release for each OP_TAP (skipping it
+ * between distinct keys with the same modifiers), which ensures proper
+ * key event generation for the host OS.
+ *
+ * ## Modifier Byte Format
+ *
+ * | Bit | Modifier       |
+ * |-----|----------------|
+ * | 0   | Left Control   |
+ * | 1   | Left Shift     |
+ * | 2   | Left Alt       |
+ * | 3   | Left GUI       |
+ * | 4   | Right Control  |
+ * | 5   | Right Shift    |
+ * | 6   | Right Alt      |
+ * | 7   | Right GUI      |
+ *
+ * @param buf Input buffer containing compiled DuckyScript binary
+ * @param len Length of input buffer in bytes
+ * @param out Output buffer for compact records
+ *            Must have space for 3 * len / 2 + 1 bytes
+ *
+ * @return Number of bytes written to out
+ *
+ * @note Input length is rounded down to even (16-bit boundary)
+ * @note Output always ends with OP_END; the payload header is not
+ *       included (see add_payload_header() in main.c)
+ *
+ * @see https://github.com/hak5darren/USB-Rubber-Ducky for DuckyScript
+ */
+int convert_ducky_binary(uint8_t *buf, int len, uint8_t *out);
+
+#endif /* __DUCKY_H */
@@ -0,0 +1,1347 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file engine.c
+ * @brief Payload execution engine implementation
+ *
+ * Plays back the HID report sequence in the active payload slot.
+ *
+ * ## Pipeline
+ *
+ * ```
+ *  payload (flash)        main loop              USB stack
+ * +-----------------+   +-------------+   +-------------------+
+ * | report records  |-->| engine_poll |-->| keyboard queue    |--> EP 0x81
+ * +-----------------+   +-------------+   | mouse queue       |--> EP 0x82
+ *                        track 0..3       +-------------------+
+ *                              ^
+ *                              | clock_alarm_pending(track)
+ *                       +-------------+
+ *                       | TIM2 alarms |  (one-shot per track, clock.c)
+ *                       +-------------+
+ * ```
+ *
+ * ## Decoding
+ *
+ * The active slot and its payload format (legacy 16-byte records or
+ * compact opcodes, see payload.h) are picked up each time playback
+ * starts from the beginning, so a newly written payload takes over at
+ * the end of the current pass.
+ * Every record is decoded into a struct engine_op, so the rest of the
+ * engine does not care which format it came from:
+ *
+ * | Operation          | Action                                      |
+ * |--------------------|---------------------------------------------|
+ * | ENGINE_OP_SKIP     | Nothing                                     |
+ * | ENGINE_OP_DELAY    | Wait for queue to drain, then delay N ms    |
+ * | ENGINE_OP_REPORT   | Queue the 9-byte keyboard / 5-byte mouse    |
+ * | ENGINE_OP_JUMP     | Continue at another record                  |
+ * | ENGINE_OP_WAIT_LED | Wait for the host to set the keyboard LEDs  |
+ * | ENGINE_OP_TRACK    | Start another track at a record             |
+ * | ENGINE_OP_END      | End the track (loop once all have ended)    |
+ *
+ * A delay is measured from the moment the host has read every report
+ * before it, so queueing does not shorten the gaps a script relies on.
+ *
+ * OP_REPEAT, OP_LOOP, OP_CALL and OP_RET move the read position
+ * instead, keeping loop counters and return positions on a small stack
+ * that is cleared whenever playback restarts.
+ *
+ * An OP_MOVE record decodes into one mouse report per host poll, each
+ * covering the distance due since the previous one, and an OP_STRING
+ * record decodes into one tap per character. The engine stays on such
+ * a record (tracking the distance sent, or advancing a cursor through
+ * the text) until its last report.
+ *
+ * An OP_WAIT_LED record holds playback until the LED bits the host
+ * sends in its keyboard output report match, or its timeout expires.
+ * Like a delay, the wait starts once the host has read every report
+ * before it. Typing Caps Lock and waiting for the host to echo the LED
+ * back paces a script by how fast the host accepts input, instead of
+ * by worst-case delays.
+ *
+ * ## Tracks
+ *
+ * Playback runs up to ENGINE_TRACKS tracks side by side. Each has its
+ * own read position, loop stack, pending tap release, clock alarm
+ * (track n uses alarm n) and wait state; engine_poll() advances every
+ * running track in turn. Track 0 starts at the first record, the others
+ * are started by OP_TRACK. A track's delays and LED waits drain only
+ * the interfaces it has queued reports on, so a mouse track keeps
+ * moving while a keyboard track holds a key through a delay.
+ *
+ * OP_END ends the track that reaches it. Once every track has ended,
+ * playback restarts from the beginning with track 0 alone.
+ *
+ * ## Enumeration
+ *
+ * Nothing plays until the host has configured the device (see
+ * engine_set_online()): before that no endpoint would take the reports
+ * and a leading delay would run out while the host is still
+ * enumerating. The playback clock stays stopped until then, so the
+ * timeline starts at SET_CONFIGURATION, plus SETTLE_MS on track 0.
+ *
+ * ## Idle
+ *
+ * engine_poll() records why each track stopped. engine_idle() re-checks
+ * those conditions so the main loop can sleep until an interrupt (USB,
+ * TIM2 alarm, LED output report) could change one of them. The playback
+ * clock is stopped while paused.
+ *
+ * @see engine.h for the public interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <libopencm3/stm32/gpio.h>
+
+#include <string.h>
+
+#include "clock.h"
+#include "engine.h"
+#include "flash.h"
+#include "hid.h"
+#include "keymap.h"
+#include "payload.h"
+#include "stats.h"
+#include "trace.h"
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+/**
+ * @brief Maximum records processed per engine_poll() call
+ *
+ * Bounds the time spent away from usbd_poll() when the payload contains
+ * long runs of records that queue nothing (NOPs).
+ */
+#define ENGINE_POLL_BUDGET 16
+
+#ifndef SETTLE_MS
+/**
+ * @brief Wait after SET_CONFIGURATION before playback starts, in ms
+ *
+ * Gives hosts that open the HID device some time after configuring it
+ * the chance to do so before the first report. Override at build time
+ * with `make SETTLE_MS=200`.
+ */
+#define SETTLE_MS 0
+#endif
+
+/**
+ * @brief Largest record in either payload format (a legacy record)
+ */
+#define ENGINE_MAX_RECORD sizeof(struct composite_report)
+
+/**
+ * @brief Key slots in a keyboard report (keys_down[])
+ */
+#define ENGINE_MAX_KEYS 6
+
+/**
+ * @brief Nesting depth of loops and calls
+ */
+#define ENGINE_STACK_DEPTH 8
+
+/**
+ * @brief Tracks played in parallel, one clock alarm each
+ */
+#define ENGINE_TRACKS CLOCK_ALARMS
+
+/**
+ * @defgroup EngineDrain Interfaces a track waits on before a delay
+ * @{
+ */
+#define ENGINE_DRAIN_KEYBOARD	0x01  /**< Keyboard reports queued */
+#define ENGINE_DRAIN_MOUSE	0x02  /**< Mouse reports queued */
+/** @} */
+
+/*============================================================================
+ * Private Types and State
+ *===========================================================================*/
+
+/**
+ * @brief Payload formats, see payload.h
+ */
+enum engine_format {
+	ENGINE_FORMAT_LEGACY,   /**< 16-byte struct composite_report records */
+	ENGINE_FORMAT_COMPACT,  /**< Header + variable-length opcodes */
+};
+
+/**
+ * @brief Kinds of decoded operation
+ */
+enum engine_op_kind {
+	ENGINE_OP_SKIP,     /**< Nothing to do */
+	ENGINE_OP_REPORT,   /**< Queue report[0..len-1] */
+	ENGINE_OP_DELAY,    /**< Wait delay milliseconds */
+	ENGINE_OP_JUMP,     /**< Flow control, continue at next */
+	ENGINE_OP_WAIT_LED, /**< Wait for (hid_leds() & led_mask) == led_value */
+	ENGINE_OP_TRACK,    /**< Start a track at target */
+	ENGINE_OP_END,      /**< End the track */
+};
+
+/**
+ * @brief Why the last engine_poll() call stopped on a track
+ */
+enum engine_wait {
+	ENGINE_WAIT_NONE,    /**< Ran out of budget, more work available */
+	ENGINE_WAIT_PAUSED,  /**< Playback paused */
+	ENGINE_WAIT_ALARM,   /**< Delay in progress */
+	ENGINE_WAIT_QUEUE,   /**< HID transmit queue of blocked full */
+	ENGINE_WAIT_DRAIN,   /**< Waiting for the host to read the reports in drain */
+	ENGINE_WAIT_MOVE,    /**< OP_MOVE step waiting for the host to read the last one */
+	ENGINE_WAIT_EMPTY,   /**< Payload looped without doing anything */
+	ENGINE_WAIT_LED,     /**< Waiting for the host to set the keyboard LEDs */
+	ENGINE_WAIT_ENDED,   /**< Track not running */
+};
+
+/**
+ * @brief One decoded payload record
+ */
+struct engine_op {
+	enum engine_op_kind kind;          /**< What to do */
+	uint32_t next;                     /**< Byte position of the following record */
+	uint16_t sub;                      /**< Text cursor at next (OP_STRING) */
+	uint32_t delay;                    /**< Delay or LED timeout in ms */
+	uint16_t len;                      /**< Report length (ENGINE_OP_REPORT) */
+	bool release;                      /**< Queue a key release after the report */
+	bool move;                         /**< Report is a step of an OP_MOVE */
+	uint8_t led_mask;                  /**< LED bits to check (ENGINE_OP_WAIT_LED) */
+	uint8_t led_value;                 /**< Required state of those bits */
+	uint32_t target;                   /**< First record of the new track (ENGINE_OP_TRACK) */
+	uint8_t report[9];                 /**< Report bytes, starting with report ID */
+};
+
+/**
+ * @brief Loop or call in progress
+ */
+struct engine_frame {
+	uint32_t pos;        /**< Loop: the LOOP/REPEAT record; call: return position */
+	uint16_t remaining;  /**< Loop: jumps back still to take */
+	bool call;           /**< Pushed by OP_CALL */
+};
+
+/**
+ * @brief State of one track
+ */
+struct engine_track {
+	/**
+	 * @brief Track is playing (started and not ended yet)
+	 */
+	bool running;
+
+	/**
+	 * @brief Byte offset of the next record in engine.data
+	 *
+	 * Read via the '@' serial command (track 0) and reset via 'z'.
+	 */
+	uint32_t pos;
+
+	/**
+	 * @brief Offset into the text of the OP_STRING record at pos
+	 */
+	uint16_t sub;
+
+	/**
+	 * @brief Progress of the OP_MOVE record at pos, valid while sub is 1
+	 */
+	struct {
+		uint32_t start;  /**< clock_now() at the first step */
+		int32_t x;       /**< Distance sent so far */
+		int32_t y;
+	} move;
+
+	/**
+	 * @brief OP_WAIT_LED in progress at pos
+	 *
+	 * The timeout runs on the track's clock alarm, so a pending alarm
+	 * does not hold up the track while active: the LEDs are checked on
+	 * each poll.
+	 */
+	struct {
+		bool active;     /**< Wait started (reports drained, alarm armed) */
+		bool timeout;    /**< Alarm armed for the timeout; false: no timeout */
+		uint8_t mask;    /**< LED bits to check */
+		uint8_t value;   /**< Required state of those bits */
+	} led;
+
+	/**
+	 * @brief Start of the last record that was not flow control,
+	 *        repeated by OP_REPEAT
+	 */
+	uint32_t last;
+
+	/**
+	 * @brief Loops and calls in progress, innermost last
+	 */
+	struct engine_frame stack[ENGINE_STACK_DEPTH];
+
+	/**
+	 * @brief Number of entries in stack
+	 */
+	uint8_t depth;
+
+	/**
+	 * @brief An OP_TAP press has been queued but not its release yet
+	 *
+	 * Flushed before anything else, even while paused or after the
+	 * track has ended, so a key is never left held down.
+	 */
+	bool release_pending;
+
+	/**
+	 * @brief Interfaces the track has queued reports on since its last
+	 *        delay, as ENGINE_DRAIN_* bits
+	 */
+	uint8_t drain;
+
+	/**
+	 * @brief Why the last engine_poll() stopped on this track, see
+	 *        engine_idle()
+	 */
+	enum engine_wait wait;
+
+	/**
+	 * @brief Report ID whose queue was full (ENGINE_WAIT_QUEUE)
+	 */
+	uint8_t blocked;
+};
+
+/**
+ * @brief Playback state
+ */
+static struct {
+	/**
+	 * @brief Payload being played (see payload_data())
+	 */
+	const uint8_t *data;
+
+	/**
+	 * @brief Length of that payload in bytes
+	 */
+	uint32_t len;
+
+	/**
+	 * @brief Bytes that may be read from data (see payload_capacity())
+	 */
+	uint32_t cap;
+
+	/**
+	 * @brief Tracks, track n using clock alarm n
+	 */
+	struct engine_track tracks[ENGINE_TRACKS];
+
+	/**
+	 * @brief Format of the payload being played
+	 */
+	enum engine_format format;
+
+	/**
+	 * @brief Keys a tap report may hold: ENGINE_MAX_KEYS with
+	 *        PAYLOAD_FLAG_PACK, otherwise 1
+	 */
+	uint8_t max_keys;
+
+	/**
+	 * @brief Something was queued or delayed since the last restart
+	 *
+	 * An empty payload (END first) otherwise loops back to the start
+	 * on every poll without ever waiting for anything.
+	 */
+	bool lap_active;
+
+	/**
+	 * @brief Host has configured the device, as applied by engine_poll()
+	 */
+	bool online;
+
+	/**
+	 * @brief Online state last reported by the USB interrupt
+	 *
+	 * engine_set_online() only records it: the clock alarms are driven
+	 * from the main loop alone, so it is applied by engine_poll().
+	 */
+	volatile bool online_request;
+
+	/**
+	 * @brief The host configured the device since the last engine_poll()
+	 */
+	volatile bool settle_request;
+
+	/**
+	 * @brief Playback paused, toggled via the 'p' serial command
+	 */
+	volatile bool paused;
+
+	/**
+	 * @brief Queue exactly one more report then pause ('s' command)
+	 */
+	volatile bool single_step;
+} engine = {
+	.paused = true,
+};
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Check whether playback may make progress
+ */
+static bool engine_running(void)
+{
+	return engine.online && (!engine.paused || engine.single_step);
+}
+
+/**
+ * @brief Run the playback clock only while playback may progress
+ *
+ * Stopping TIM2 while paused (or not yet enumerated) freezes a delay in
+ * progress, so resuming continues it with the time it had left, and the
+ * timer raises no interrupts while the device is paused.
+ */
+static void engine_update_clock(void)
+{
+	if (engine_running())
+		clock_resume();
+	else
+		clock_pause();
+}
+
+/**
+ * @brief Apply the online state reported by the USB interrupt
+ *
+ * Runs in the main loop, like every other caller of the clock: the
+ * alarm functions mask TIM2 as their critical section, which a nested
+ * call from the USB interrupt would end early.
+ */
+static void engine_apply_online(void)
+{
+	struct engine_track *t = &engine.tracks[0];
+	bool online = engine.online_request;
+
+	/* A reset and a new configuration since the last poll still settle */
+	if (__atomic_exchange_n(&engine.settle_request, false, __ATOMIC_RELAXED) &&
+	    SETTLE_MS && !clock_alarm_pending(0) && !t->led.active)
+		clock_alarm_start(0, SETTLE_MS);
+
+	if (online == engine.online)
+		return;
+
+	engine.online = online;
+	engine_update_clock();
+}
+
+/**
+ * @brief Start a track at a record
+ *
+ * @param t   Track, not running
+ * @param pos Byte offset of its first record
+ */
+static void engine_track_start(struct engine_track *t, uint32_t pos)
+{
+	t->running = true;
+	t->pos = pos;
+	t->sub = 0;
+	t->depth = 0;
+	t->led.active = false;
+	t->last = pos;
+	t->wait = ENGINE_WAIT_NONE;
+}
+
+/**
+ * @brief Select the active payload, detect its format and return the
+ *        first record position
+ *
+ * Stops every track; the caller starts track 0 at the returned position.
+ */
+static uint32_t engine_start(void)
+{
+	engine.data = payload_data();
+	engine.len = payload_length();
+	engine.cap = payload_capacity();
+	engine.max_keys = 1;
+
+	for (int i = 0; i < ENGINE_TRACKS; ++i) {
+		engine.tracks[i].running = false;
+		engine.tracks[i].wait = ENGINE_WAIT_ENDED;
+	}
+
+	if (engine.len >= sizeof(struct payload_header) &&
+	    engine.data[0] == PAYLOAD_MAGIC0 && engine.data[1] == PAYLOAD_MAGIC1) {
+		const struct payload_header *header = (const struct payload_header *)engine.data;
+
+		engine.format = ENGINE_FORMAT_COMPACT;
+		if (header->flags & PAYLOAD_FLAG_PACK)
+			engine.max_keys = ENGINE_MAX_KEYS;
+		return sizeof(struct payload_header);
+	}
+
+	engine.format = ENGINE_FORMAT_LEGACY;
+	return 0;
+}
+
+/**
+ * @brief Decode one legacy 16-byte record
+ *
+ * @param pos Byte offset of the record
+ * @param op  [out] Decoded operation
+ */
+static void engine_decode_legacy(uint32_t pos, struct engine_op *op)
+{
+	const struct composite_report *record = (const struct composite_report *)&engine.data[pos];
+
+	op->next = pos + sizeof(struct composite_report);
+	op->sub = 0;
+	op->release = false;
+	op->move = false;
+
+	switch (record->report_id) {
+	case REPORT_ID_NOP:
+		op->kind = ENGINE_OP_SKIP;
+		break;
+	case REPORT_ID_DELAY:
+		op->kind = ENGINE_OP_DELAY;
+		op->delay = record->padding[0];
+		break;
+	case REPORT_ID_KEYBOARD:
+		/* Keyboard report: 1 byte ID + 8 bytes data */
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 9;
+		memcpy(op->report, record, op->len);
+		break;
+	case REPORT_ID_MOUSE:
+		/* Mouse report: 1 byte ID + 4 bytes data */
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 5;
+		memcpy(op->report, record, op->len);
+		break;
+	default:
+		/* Unknown ID (including REPORT_ID_END) */
+		op->kind = ENGINE_OP_END;
+		break;
+	}
+}
+
+/**
+ * @brief Start a keyboard tap report holding one key
+ */
+static void engine_tap_begin(struct engine_op *op, uint8_t modifiers, uint8_t keycode)
+{
+	op->kind = ENGINE_OP_REPORT;
+	op->len = 9;
+	memset(op->report, 0, sizeof(op->report));
+	op->report[0] = REPORT_ID_KEYBOARD;
+	op->report[1] = modifiers;
+	op->report[3] = keycode;  /* keys_down[0] */
+}
+
+/**
+ * @brief Try to add another key to a tap report
+ *
+ * The key joins the report if it has the same modifiers and is not
+ * down already, and the report has a free slot (see engine.max_keys).
+ *
+ * @return true if the key was added
+ */
+static bool engine_tap_add(struct engine_op *op, uint8_t modifiers, uint8_t keycode)
+{
+	uint8_t *keys = &op->report[3];
+	int count;
+
+	if (modifiers != op->report[1])
+		return false;
+
+	for (count = 0; count < ENGINE_MAX_KEYS && keys[count]; ++count)
+		if (keys[count] == keycode)
+			return false;
+
+	if (count >= engine.max_keys)
+		return false;
+
+	keys[count] = keycode;
+	return true;
+}
+
+/**
+ * @brief Check whether the next tap report makes the release of a report
+ *        redundant
+ *
+ * A report with the same modifiers and none of the keys currently down
+ * lifts those keys by itself. With PAYLOAD_FLAG_PACK every key of the
+ * next report counts, not just its first: a key that stayed down would
+ * reach the host as held instead of pressed again.
+ */
+static bool engine_tap_follows(const struct engine_op *op, const struct engine_op *next)
+{
+	if (next->kind != ENGINE_OP_REPORT || next->report[1] != op->report[1])
+		return false;
+
+	for (int i = 0; i < ENGINE_MAX_KEYS && next->report[3 + i]; ++i)
+		for (int j = 0; j < ENGINE_MAX_KEYS && op->report[3 + j]; ++j)
+			if (next->report[3 + i] == op->report[3 + j])
+				return false;
+
+	return true;
+}
+
+/**
+ * @brief Collect a run of OP_TAP records into one report
+ *
+ * The first tap always yields a report; following taps join it as far
+ * as engine_tap_add() allows.
+ *
+ * @param pos Byte offset of the first OP_TAP
+ * @param op  [out] Tap report, release not set
+ *
+ * @return Byte offset after the run
+ */
+static uint32_t engine_tap_run(uint32_t pos, struct engine_op *op)
+{
+	const uint8_t *data = engine.data;
+	uint32_t next = pos + 3;
+
+	engine_tap_begin(op, data[pos + 1], data[pos + 2]);
+
+	/* A tap followed by OP_REPEAT stays a run of its own, so only it repeats */
+	while (next + 3 <= engine.len && data[next] == OP_TAP &&
+	       !(next + 3 < engine.len && data[next + 3] == OP_REPEAT) &&
+	       engine_tap_add(op, data[next + 1], data[next + 2]))
+		next += 3;
+
+	return next;
+}
+
+/**
+ * @brief Decode a run of OP_TAP records
+ *
+ * @param pos Byte offset of the first OP_TAP
+ * @param op  [out] Decoded operation
+ *
+ * @return Bytes covered by the run
+ */
+static uint32_t engine_decode_taps(uint32_t pos, struct engine_op *op)
+{
+	uint32_t next = engine_tap_run(pos, op);
+	struct engine_op follow;
+
+	/* Skip the release if the following run lifts these keys anyway */
+	op->release = true;
+	if (next + 3 <= engine.len && engine.data[next] == OP_TAP) {
+		engine_tap_run(next, &follow);
+		op->release = !engine_tap_follows(op, &follow);
+	}
+
+	return next - pos;
+}
+
+/**
+ * @brief Collect a run of OP_STRING characters into one report
+ *
+ * @param text   Text of the record
+ * @param len    Its length in bytes
+ * @param layout Keymap layout ID
+ * @param sub    Offset of the first character, below len
+ * @param op     [out] Tap report (release not set), or ENGINE_OP_SKIP if
+ *               the layout has no key for the first character
+ *
+ * @return Offset after the run
+ */
+static uint16_t engine_string_run(const uint8_t *text, uint16_t len, uint8_t layout,
+				  uint16_t sub, struct engine_op *op)
+{
+	uint32_t codepoint;
+	uint8_t modifiers, keycode;
+	int n;
+
+	op->kind = ENGINE_OP_SKIP;
+
+	sub += keymap_decode_utf8(&text[sub], len - sub, &codepoint);
+	if (!keymap_lookup(layout, codepoint, &modifiers, &keycode))
+		return sub;
+
+	engine_tap_begin(op, modifiers, keycode);
+
+	/* Same rules as a run of OP_TAP, looking ahead within the text */
+	while (sub < len) {
+		n = keymap_decode_utf8(&text[sub], len - sub, &codepoint);
+		if (!keymap_lookup(layout, codepoint, &modifiers, &keycode) ||
+		    !engine_tap_add(op, modifiers, keycode))
+			break;
+		sub += n;
+	}
+
+	return sub;
+}
+
+/**
+ * @brief Decode the next character of an OP_STRING record
+ *
+ * Produces a tap of the character at text offset sub, or a skip if the
+ * layout has no key for it. The operation stays on the record until the
+ * last character, then moves on to the following record.
+ *
+ * @param pos Byte offset of the opcode
+ * @param sub Offset of the character in the text
+ * @param op  [out] Decoded operation
+ *
+ * @return Bytes to advance pos by: 0 within the text, the record size
+ *         after the last character
+ */
+static uint32_t engine_decode_string(uint32_t pos, uint16_t sub, struct engine_op *op)
+{
+	const uint8_t *rec = &engine.data[pos];
+	uint8_t layout = rec[1];
+	uint16_t len = rec[2];
+	const uint8_t *text = &rec[3];
+	struct engine_op follow;
+
+	op->kind = ENGINE_OP_SKIP;
+
+	if (sub < len) {
+		sub = engine_string_run(text, len, layout, sub, op);
+
+		op->release = true;
+		if (op->kind == ENGINE_OP_REPORT && sub < len) {
+			engine_string_run(text, len, layout, sub, &follow);
+			op->release = !engine_tap_follows(op, &follow);
+		}
+	}
+
+	if (sub >= len) {
+		op->sub = 0;
+		return 3 + len;
+	}
+
+	op->sub = sub;
+	return 0;
+}
+
+/**
+ * @brief Apply an OP_MOVE easing curve
+ *
+ * @param curve    MOVE_CURVE_* value
+ * @param fraction Elapsed part of the duration, 0..65536
+ *
+ * @return Covered part of the distance, 0..65536
+ */
+static uint32_t engine_ease(uint8_t curve, uint32_t fraction)
+{
+	uint64_t f = fraction;
+
+	switch (curve) {
+	case MOVE_CURVE_IN:
+		return (f * f) >> 16;
+	case MOVE_CURVE_OUT:
+		return (f * (2 * 65536 - f)) >> 16;
+	case MOVE_CURVE_IN_OUT:
+		/* Smoothstep: 3f^2 - 2f^3 */
+		return (f * f * (3 * 65536 - 2 * f)) >> 32;
+	default:
+		return f;
+	}
+}
+
+/**
+ * @brief Clamp a distance to one mouse report axis
+ */
+static int8_t engine_move_step(int32_t distance)
+{
+	if (distance > 127)
+		return 127;
+	if (distance < -127)
+		return -127;
+	return distance;
+}
+
+/**
+ * @brief Decode the next step of an OP_MOVE record
+ *
+ * The step covers the distance due by now along the curve, minus what
+ * has been sent already, so a host polling slower than HID_INTERVAL_MS
+ * gets bigger steps rather than slower motion. The record is finished
+ * once the duration is over and the whole distance has been sent. When
+ * no movement is due yet it waits a millisecond instead.
+ *
+ * @param t   Track playing the record
+ * @param pos Byte offset of the opcode
+ * @param sub 0 for the first step, 1 afterwards
+ * @param op  [out] Decoded operation
+ */
+static void engine_decode_move(struct engine_track *t, uint32_t pos, uint16_t sub, struct engine_op *op)
+{
+	const uint8_t *rec = &engine.data[pos];
+	int32_t dx = (int16_t)(rec[2] | (rec[3] << 8));
+	int32_t dy = (int16_t)(rec[4] | (rec[5] << 8));
+	uint32_t duration = rec[6] | (rec[7] << 8);
+	uint32_t elapsed, progress;
+	int8_t step_x, step_y;
+
+	if (sub == 0) {
+		t->move.start = clock_now();
+		t->move.x = 0;
+		t->move.y = 0;
+	}
+
+	elapsed = clock_now() - t->move.start;
+	progress = elapsed >= duration ? 65536 : engine_ease(rec[8], (elapsed << 16) / duration);
+
+	step_x = engine_move_step(((int64_t)dx * progress >> 16) - t->move.x);
+	step_y = engine_move_step(((int64_t)dy * progress >> 16) - t->move.y);
+
+	op->next = pos;
+	op->sub = 1;
+
+	if (step_x == 0 && step_y == 0 && progress < 65536) {
+		op->kind = ENGINE_OP_DELAY;
+		op->delay = 1;
+		return;
+	}
+
+	op->kind = ENGINE_OP_REPORT;
+	op->move = true;
+	op->len = 5;
+	op->report[0] = REPORT_ID_MOUSE;
+	op->report[1] = rec[1];  /* buttons */
+	op->report[2] = step_x;
+	op->report[3] = step_y;
+	op->report[4] = 0;       /* wheel */
+
+	if (progress == 65536 && t->move.x + step_x == dx && t->move.y + step_y == dy) {
+		op->next = pos + 9;
+		op->sub = 0;
+	}
+}
+
+/**
+ * @brief Check that a jump target lies within the payload records
+ */
+static bool engine_target_valid(uint32_t target)
+{
+	return target >= sizeof(struct payload_header) && target < engine.len;
+}
+
+/**
+ * @brief Decode an OP_LOOP or OP_REPEAT record
+ *
+ * The first time the record is reached, a loop frame is pushed that
+ * counts the jumps back to target. Reaching it again with that frame on
+ * top takes the next jump, until the count runs out and the frame is
+ * popped. Loops running forever need no frame.
+ *
+ * @param t      Track playing the record
+ * @param pos    Byte offset of the record
+ * @param size   Size of the record
+ * @param target Byte offset of the first record of the body
+ * @param count  Total number of passes over the body, 0 for forever
+ * @param op     [out] Decoded operation
+ */
+static void engine_decode_loop(struct engine_track *t, uint32_t pos, uint32_t size, uint32_t target, uint32_t count, struct engine_op *op)
+{
+	struct engine_frame *top = t->depth ? &t->stack[t->depth - 1] : NULL;
+
+	op->kind = ENGINE_OP_JUMP;
+	op->next = pos + size;
+
+	if (!engine_target_valid(target)) {
+		op->kind = ENGINE_OP_END;
+		return;
+	}
+
+	if (count == 0) {
+		op->next = target;
+	} else if (top && !top->call && top->pos == pos) {
+		if (--top->remaining == 0)
+			--t->depth;
+		else
+			op->next = target;
+	} else if (count > 1) {
+		if (t->depth == ENGINE_STACK_DEPTH) {
+			op->kind = ENGINE_OP_END;
+			return;
+		}
+		t->stack[t->depth++] = (struct engine_frame){ pos, count - 1, false };
+		op->next = target;
+	}
+}
+
+/**
+ * @brief Decode an OP_CALL or OP_RET record
+ *
+ * OP_RET drops any loop the subroutine left unfinished and returns
+ * after the innermost OP_CALL. Without one it ends the payload.
+ *
+ * @param t   Track playing the record
+ * @param pos Byte offset of the record
+ * @param rec Record bytes
+ * @param op  [out] Decoded operation
+ */
+static void engine_decode_call(struct engine_track *t, uint32_t pos, const uint8_t *rec, struct engine_op *op)
+{
+	uint32_t target;
+
+	op->kind = ENGINE_OP_END;
+
+	if (rec[0] == OP_CALL) {
+		target = rec[1] | (rec[2] << 8);
+		if (!engine_target_valid(target) || t->depth == ENGINE_STACK_DEPTH)
+			return;
+
+		t->stack[t->depth++] = (struct engine_frame){ pos + 3, 0, true };
+		op->kind = ENGINE_OP_JUMP;
+		op->next = target;
+		return;
+	}
+
+	while (t->depth > 0) {
+		struct engine_frame *frame = &t->stack[--t->depth];
+
+		if (frame->call) {
+			op->kind = ENGINE_OP_JUMP;
+			op->next = frame->pos;
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Decode one compact record
+ *
+ * @param t   Track playing the record
+ * @param pos Byte offset of the opcode
+ * @param sub Text cursor within an OP_STRING record
+ * @param op  [out] Decoded operation
+ */
+static void engine_decode_compact(struct engine_track *t, uint32_t pos, uint16_t sub, struct engine_op *op)
+{
+	const uint8_t *rec = &engine.data[pos];
+	uint32_t size;
+
+	op->sub = 0;
+	op->release = false;
+	op->move = false;
+
+	switch (rec[0]) {
+	case OP_NOP:
+		op->kind = ENGINE_OP_SKIP;
+		size = 1;
+		break;
+	case OP_KEYBOARD:
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 9;
+		op->report[0] = REPORT_ID_KEYBOARD;
+		memcpy(&op->report[1], &rec[1], 8);
+		size = 9;
+		break;
+	case OP_MOUSE:
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 5;
+		op->report[0] = REPORT_ID_MOUSE;
+		memcpy(&op->report[1], &rec[1], 4);
+		size = 5;
+		break;
+	case OP_KEY:
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 9;
+		memset(op->report, 0, sizeof(op->report));
+		op->report[0] = REPORT_ID_KEYBOARD;
+		op->report[1] = rec[1];  /* modifiers */
+		op->report[3] = rec[2];  /* keys_down[0] */
+		size = 3;
+		break;
+	case OP_RELEASE:
+		op->kind = ENGINE_OP_REPORT;
+		op->len = 9;
+		memset(op->report, 0, sizeof(op->report));
+		op->report[0] = REPORT_ID_KEYBOARD;
+		size = 1;
+		break;
+	case OP_DELAY:
+		op->kind = ENGINE_OP_DELAY;
+		op->delay = rec[1];
+		size = 2;
+		break;
+	case OP_DELAY16:
+		op->kind = ENGINE_OP_DELAY;
+		op->delay = rec[1] | (rec[2] << 8);
+		size = 3;
+		break;
+	case OP_DELAY32:
+		op->kind = ENGINE_OP_DELAY;
+		op->delay = rec[1] | (rec[2] << 8) | (rec[3] << 16) | ((uint32_t)rec[4] << 24);
+		size = 5;
+		break;
+	case OP_TAP:
+		size = engine_decode_taps(pos, op);
+		break;
+	case OP_STRING:
+		/* The text must lie within the payload */
+		if (pos + 3 + rec[2] > engine.len) {
+			op->kind = ENGINE_OP_END;
+			size = 1;
+			break;
+		}
+		size = engine_decode_string(pos, sub, op);
+		break;
+	case OP_MOVE:
+		engine_decode_move(t, pos, sub, op);
+		return;
+	case OP_REPEAT:
+		/* REPEAT n: n more passes over the previous record */
+		engine_decode_loop(t, pos, 3, t->last, (rec[1] | (rec[2] << 8)) + 1, op);
+		return;
+	case OP_LOOP:
+		engine_decode_loop(t, pos, 5, rec[1] | (rec[2] << 8), rec[3] | (rec[4] << 8), op);
+		return;
+	case OP_CALL:
+	case OP_RET:
+		engine_decode_call(t, pos, rec, op);
+		return;
+	case OP_WAIT_LED:
+		op->kind = ENGINE_OP_WAIT_LED;
+		op->led_mask = rec[1];
+		op->led_value = rec[2] & rec[1];
+		op->delay = rec[3] | (rec[4] << 8);
+		size = 5;
+		break;
+	case OP_TRACK:
+		op->kind = ENGINE_OP_TRACK;
+		op->target = rec[1] | (rec[2] << 8);
+		size = 3;
+		if (!engine_target_valid(op->target))
+			op->kind = ENGINE_OP_END;
+		break;
+	default:
+		/* OP_END or unknown opcode */
+		op->kind = ENGINE_OP_END;
+		size = 1;
+		break;
+	}
+
+	op->next = pos + size;
+}
+
+/**
+ * @brief Drain bit of the interface a report goes out on
+ */
+static uint8_t engine_drain_bit(uint8_t report_id)
+{
+	return report_id == REPORT_ID_MOUSE ? ENGINE_DRAIN_MOUSE : ENGINE_DRAIN_KEYBOARD;
+}
+
+/**
+ * @brief Check whether the host has yet to read reports a track queued
+ */
+static bool engine_draining(const struct engine_track *t)
+{
+	return ((t->drain & ENGINE_DRAIN_KEYBOARD) && !hid_tx_idle(REPORT_ID_KEYBOARD)) ||
+	       ((t->drain & ENGINE_DRAIN_MOUSE) && !hid_tx_idle(REPORT_ID_MOUSE));
+}
+
+/**
+ * @brief Check whether any track other than t is playing
+ */
+static bool engine_others_running(const struct engine_track *t)
+{
+	for (int i = 0; i < ENGINE_TRACKS; ++i)
+		if (&engine.tracks[i] != t && engine.tracks[i].running)
+			return true;
+	return false;
+}
+
+/**
+ * @brief Start OP_TRACK's track on a free track
+ *
+ * @return false if every track is playing
+ */
+static bool engine_fork(uint32_t target)
+{
+	for (int i = 0; i < ENGINE_TRACKS; ++i) {
+		if (!engine.tracks[i].running) {
+			engine_track_start(&engine.tracks[i], target);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Feed the HID transmit queue from one track
+ *
+ * @param t     Track
+ * @param alarm Its clock alarm
+ */
+static void engine_poll_track(struct engine_track *t, uint8_t alarm)
+{
+	struct engine_op op;
+
+	t->wait = ENGINE_WAIT_NONE;
+
+	for (int budget = ENGINE_POLL_BUDGET; budget > 0; --budget) {
+		/* Finish a tap first, even if paused or ended in the meantime */
+		if (t->release_pending) {
+			static const uint8_t release[9] = { REPORT_ID_KEYBOARD };
+
+			if (!hid_queue_report(release, sizeof(release))) {
+				t->wait = ENGINE_WAIT_QUEUE;
+				t->blocked = REPORT_ID_KEYBOARD;
+				++stats.queue_full;
+				return;
+			}
+			t->release_pending = false;
+		}
+
+		if (!t->running) {
+			t->wait = ENGINE_WAIT_ENDED;
+			return;
+		}
+		if (!engine_running()) {
+			t->wait = ENGINE_WAIT_PAUSED;
+			return;
+		}
+		if (clock_alarm_pending(alarm) && !t->led.active) {
+			t->wait = ENGINE_WAIT_ALARM;
+			return;
+		}
+
+		/*
+		 * The end of the payload acts as an end marker. Records are
+		 * decoded only if they cannot run off the end of the slot.
+		 */
+		if (t->pos >= engine.len || t->pos + ENGINE_MAX_RECORD > engine.cap)
+			op.kind = ENGINE_OP_END;
+		else if (engine.format == ENGINE_FORMAT_COMPACT)
+			engine_decode_compact(t, t->pos, t->sub, &op);
+		else
+			engine_decode_legacy(t->pos, &op);
+
+		switch (op.kind) {
+		case ENGINE_OP_JUMP:
+			t->pos = op.next;
+			t->sub = 0;
+			continue;
+
+		case ENGINE_OP_SKIP:
+			break;
+
+		case ENGINE_OP_DELAY:
+			/* Start timing only once the host has read this track's reports */
+			if (engine_draining(t)) {
+				t->wait = ENGINE_WAIT_DRAIN;
+				return;
+			}
+			t->drain = 0;
+			if (op.delay) {
+				trace(TRACE_DELAY_START, op.delay > 0xFFFF ? 0xFFFF : op.delay);
+				clock_alarm_start(alarm, op.delay);
+			}
+			engine.lap_active = true;
+			break;
+
+		case ENGINE_OP_WAIT_LED:
+			if (!t->led.active) {
+				/* Time out only once the host has read this track's reports */
+				if (engine_draining(t)) {
+					t->wait = ENGINE_WAIT_DRAIN;
+					return;
+				}
+				t->drain = 0;
+				t->led.active = true;
+				t->led.timeout = op.delay != 0;
+				t->led.mask = op.led_mask;
+				t->led.value = op.led_value;
+				if (op.delay)
+					clock_alarm_start(alarm, op.delay);
+			}
+
+			if ((hid_leds() & t->led.mask) == t->led.value) {
+				clock_alarm_cancel(alarm);
+				trace(TRACE_LED_WAIT, 1);
+			} else if (!t->led.timeout || clock_alarm_pending(alarm)) {
+				t->wait = ENGINE_WAIT_LED;
+				return;
+			} else {
+				trace(TRACE_LED_WAIT, 0);
+			}
+
+			t->led.active = false;
+			engine.lap_active = true;
+			break;
+
+		case ENGINE_OP_REPORT:
+			/* Motion is paced by the host: one step per report it reads */
+			if (op.move && !hid_tx_idle(REPORT_ID_MOUSE)) {
+				t->wait = ENGINE_WAIT_MOVE;
+				return;
+			}
+
+			/* Queue full: retry this record on the next poll */
+			if (!hid_queue_report(op.report, op.len)) {
+				t->wait = ENGINE_WAIT_QUEUE;
+				t->blocked = op.report[0];
+				++stats.queue_full;
+				return;
+			}
+
+			if (op.move) {
+				t->move.x += (int8_t)op.report[2];
+				t->move.y += (int8_t)op.report[3];
+			}
+
+			/* Toggle LED to indicate activity */
+			gpio_toggle(GPIOC, GPIO13);
+
+			t->drain |= engine_drain_bit(op.report[0]);
+			t->release_pending = op.release;
+			engine.lap_active = true;
+
+			/* Handle single-step mode: pause after one report */
+			if (engine.single_step) {
+				engine.single_step = false;
+				engine.paused = true;
+				engine_update_clock();
+			}
+			break;
+
+		case ENGINE_OP_TRACK:
+			if (engine_fork(op.target)) {
+				t->pos = op.next;
+				t->sub = 0;
+				continue;
+			}
+			/* Every track playing: end this one instead */
+			/* fall through */
+		case ENGINE_OP_END:
+			t->running = false;
+			t->wait = ENGINE_WAIT_ENDED;
+			if (engine_others_running(t))
+				return;
+
+			/* Last track ended: restart from the beginning (re-detecting the format) */
+			engine_track_start(&engine.tracks[0], engine_start());
+			if (!engine.lap_active)
+				engine.tracks[0].wait = ENGINE_WAIT_EMPTY;
+			engine.lap_active = false;
+			return;
+		}
+
+		t->last = t->pos;
+		t->pos = op.next;
+		t->sub = op.sub;
+	}
+}
+
+/**
+ * @brief Check whether a track has nothing to do, see engine_idle()
+ */
+static bool engine_track_idle(const struct engine_track *t, uint8_t alarm)
+{
+	switch (t->wait) {
+	case ENGINE_WAIT_PAUSED:
+		return !engine_running();
+	case ENGINE_WAIT_ALARM:
+		return clock_alarm_pending(alarm);
+	case ENGINE_WAIT_QUEUE:
+		return hid_queue_full(t->blocked);
+	case ENGINE_WAIT_DRAIN:
+		return engine_draining(t);
+	case ENGINE_WAIT_MOVE:
+		return !hid_tx_idle(REPORT_ID_MOUSE);
+	case ENGINE_WAIT_EMPTY:
+	case ENGINE_WAIT_ENDED:
+		return true;
+	case ENGINE_WAIT_LED:
+		return (hid_leds() & t->led.mask) != t->led.value &&
+		       (!t->led.timeout || clock_alarm_pending(alarm));
+	default:
+		return false;
+	}
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+void engine_init(void)
+{
+	struct engine_track *t = &engine.tracks[0];
+
+	engine_track_start(t, engine_start());
+	engine.single_step = false;
+
+	/* Auto-start if a payload is stored */
+	if (t->pos >= engine.len)
+		engine.paused = true;
+	else if (engine.format == ENGINE_FORMAT_COMPACT)
+		engine.paused = (engine.data[t->pos] == OP_END);
+	else
+		engine.paused = (engine.data[0] == REPORT_ID_END);
+
+	engine_update_clock();
+}
+
+void engine_poll(void)
+{
+	engine_apply_online();
+
+	for (uint8_t i = 0; i < ENGINE_TRACKS; ++i)
+		engine_poll_track(&engine.tracks[i], i);
+}
+
+void engine_set_online(bool online)
+{
+	if (online && !engine.online_request)
+		engine.settle_request = true;
+	engine.online_request = online;
+}
+
+void engine_set_paused(bool paused)
+{
+	engine.paused = paused;
+	engine_update_clock();
+	trace(TRACE_PAUSE, engine.paused);
+}
+
+bool engine_toggle_pause(void)
+{
+	engine_set_paused(!engine.paused);
+	return engine.paused;
+}
+
+void engine_step(void)
+{
+	engine.single_step = true;
+	engine_update_clock();
+	trace(TRACE_STEP, 0);
+}
+
+void engine_rewind(void)
+{
+	engine_track_start(&engine.tracks[0], engine_start());
+	engine.lap_active = false;
+	for (uint8_t i = 0; i < ENGINE_TRACKS; ++i)
+		clock_alarm_cancel(i);
+}
+
+bool engine_reading(const uint8_t *payload)
+{
+	return engine.data == payload;
+}
+
+bool engine_idle(void)
+{
+	if (engine.online != engine.online_request || engine.settle_request)
+		return false;
+
+	for (uint8_t i = 0; i < ENGINE_TRACKS; ++i)
+		if (!engine_track_idle(&engine.tracks[i], i))
+			return false;
+	return true;
+}
+
+uint32_t engine_index(void)
+{
+	if (engine.format == ENGINE_FORMAT_LEGACY)
+		return engine.tracks[0].pos / sizeof(struct composite_report);
+	return engine.tracks[0].pos;
+}
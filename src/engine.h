@@ -0,0 +1,122 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file engine.h
+ * @brief Payload execution engine interface
+ *
+ * The execution engine walks the payload stored in user_data and turns
+ * it into HID reports. It works as follows:
+ *
+ * - engine_poll() runs from the main loop. It decodes records from the
+ *   active payload slot (legacy or compact format, see payload.h) and feeds the HID transmit
+ *   queue (hid_queue_report()) until the queue is full, a delay starts
+ *   or playback is paused.
+ * - Delays are one-shot alarms on the TIM2 playback clock (clock.h);
+ *   nothing runs periodically while waiting.
+ * - Up to four tracks (see OP_TRACK in payload.h) play side by side,
+ *   each with its own read position and delay alarm.
+ *
+ * Because the engine never waits for the host, a slow HID poll rate can
+ * no longer stall USB or serial processing.
+ *
+ * @see engine.c for implementation
+ * @see hid.h for the report format and transmit queue
+ */
+
+#ifndef __ENGINE_H
+#define __ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Initialize engine state at boot
+ *
+ * Rewinds to the first record and starts playback automatically if a
+ * payload is stored (the first record is not REPORT_ID_END), once the
+ * host has configured the device. Call after payload_init().
+ */
+void engine_init(void);
+
+/**
+ * @brief Feed the HID transmit queue from the payload
+ *
+ * Call from the main loop. Advances every playing track, processing a
+ * bounded number of records per track and call so USB polling stays
+ * responsive.
+ */
+void engine_poll(void);
+
+/**
+ * @brief Tell the engine whether the host has configured the device
+ *
+ * Playback, and the clock its delays run on, only progress while
+ * online. Going online holds the first track for SETTLE_MS more (a
+ * build option, 0 by default) unless it is already waiting on a delay.
+ * Called from the USB interrupt, also before engine_init(): it only
+ * records the state, which the next engine_poll() applies.
+ *
+ * @param online true on SET_CONFIGURATION, false on a USB reset
+ */
+void engine_set_online(bool online);
+
+/**
+ * @brief Pause or resume playback
+ *
+ * @param paused true to pause
+ */
+void engine_set_paused(bool paused);
+
+/**
+ * @brief Toggle between paused and running
+ *
+ * @return true if playback is now paused
+ */
+bool engine_toggle_pause(void);
+
+/**
+ * @brief Run until one more report has been queued, then pause
+ */
+void engine_step(void);
+
+/**
+ * @brief Restart playback from the first record
+ *
+ * Switches to the active payload slot, ends every track but the first
+ * and cancels any delay in progress.
+ */
+void engine_rewind(void);
+
+/**
+ * @brief Position of the next record to be executed on the first track
+ *
+ * @return Record index into user_data for legacy payloads, byte offset
+ *         for compact payloads (see payload.h)
+ */
+uint32_t engine_index(void);
+
+/**
+ * @brief Check whether playback is using a given payload
+ *
+ * Playback keeps reading the payload it started with until it next
+ * restarts, even after another slot has become active.
+ *
+ * @param payload Start of a payload slot's data (see payload_data())
+ *
+ * @return true if the engine may still read from it
+ */
+bool engine_reading(const uint8_t *payload);
+
+/**
+ * @brief Check whether engine_poll() has nothing to do
+ *
+ * True when the last engine_poll() stopped every track on a condition
+ * that only an interrupt can end: paused, a delay in progress, the HID queue waiting
+ * for the host, or an empty payload looping at its end marker. Meant to
+ * be called with interrupts disabled right before sleeping, so a wakeup
+ * between engine_poll() and the sleep is not missed.
+ *
+ * @return true if the CPU may sleep until the next interrupt
+ */
+bool engine_idle(void);
+
+#endif /* __ENGINE_H */
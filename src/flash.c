@@ -28,7 +28,11 @@
  * - Based on libopencm3 flash example code
  * - Performs verification after each word write
  * - Automatically handles page alignment
- * - Does not re-lock flash after operations (could be improved)
+ * - Streaming writer compares flash before writing: unchanged words are
+ *   skipped, blank words are programmed directly, and a page is erased
+ *   only when a word in it has to change. Payloads may span the whole
+ *   user_data region
+ * - Re-locks flash when a write session finishes
  *
  * @note Flash operations should not be interrupted. Consider disabling
  *       interrupts during critical flash operations in production code.
@@ -64,9 +68,13 @@
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/flash.h>
+#include <string.h>
 
 #include "flash.h"
 #include "hid.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
 
 /*============================================================================
  * Constants
@@ -82,42 +90,340 @@
  */
 #define FLASH_PAGE_NUM_MAX 127
 
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Status flags that end a flash operation
+ */
+#define FLASH_SR_DONE (FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+
+/**
+ * @brief Wait for the flash controller from RAM
+ *
+ * Interrupts stay enabled: the USB and TIM2 handlers run from RAM too,
+ * so they are serviced while the flash is busy instead of stalling on
+ * an instruction fetch.
+ *
+ * @return Status flags of the operation, FLASH_SR_EOP on success
+ */
+static RAMFUNC uint32_t flash_ram_wait(void)
+{
+	while (FLASH_SR & FLASH_SR_BSY)
+		;
+
+	return FLASH_SR & FLASH_SR_DONE;
+}
+
+/**
+ * @brief Erase one page, running from RAM
+ *
+ * Register level equivalent of flash_erase_page(), which runs from
+ * flash and would stall the CPU (and the USB interrupt) for the whole
+ * erase.
+ *
+ * @return Status flags, FLASH_SR_EOP on success
+ */
+static RAMFUNC uint32_t flash_ram_erase_page(uint32_t page_address)
+{
+	uint32_t status;
+
+	flash_ram_wait();
+	FLASH_SR = FLASH_SR_DONE;  /* Write 1 to clear */
+
+	FLASH_CR |= FLASH_CR_PER;
+	FLASH_AR = page_address;
+	FLASH_CR |= FLASH_CR_STRT;
+	status = flash_ram_wait();
+	FLASH_CR &= ~FLASH_CR_PER;
+
+	return status;
+}
+
+/**
+ * @brief Program one 32-bit word as two half-words, running from RAM
+ *
+ * @return Status flags, FLASH_SR_EOP on success
+ */
+static RAMFUNC uint32_t flash_ram_program_word(uint32_t address, uint32_t word)
+{
+	uint32_t status;
+
+	flash_ram_wait();
+	FLASH_SR = FLASH_SR_DONE;
+
+	FLASH_CR |= FLASH_CR_PG;
+	MMIO16(address) = (uint16_t)word;
+	status = flash_ram_wait();
+	if (status == FLASH_SR_EOP) {
+		FLASH_SR = FLASH_SR_DONE;
+		MMIO16(address + 2) = (uint16_t)(word >> 16);
+		status = flash_ram_wait();
+	}
+	FLASH_CR &= ~FLASH_CR_PG;
+
+	return status;
+}
+
+/**
+ * @brief Erased state of a flash word
+ */
+#define FLASH_ERASED_WORD 0xFFFFFFFF
+
+/**
+ * @brief Copy of the part of a page saved across its erase
+ */
+static uint32_t flash_page_copy[FLASH_PAGE_SIZE / 4];
+
 /**
- * @brief Size of one flash page in bytes
+ * @brief Erase the page holding address, keeping the words before it
  *
- * STM32F103 medium-density devices have 1KB (0x400) pages.
- * This is the minimum erasable unit.
+ * Everything the session wrote to the page so far is still valid after
+ * the erase: the words in [page start, address) are copied to RAM first
+ * and programmed back. They are either unchanged data that was skipped
+ * or words programmed into blank flash earlier in this session.
+ *
+ * @return RESULT_OK or flash status flags
+ */
+static uint32_t flash_writer_erase_page(struct flash_writer *writer, uint32_t address)
+{
+	uint32_t page_address = address - (address % FLASH_PAGE_SIZE);
+	uint32_t kept = (address - page_address) / 4;
+	uint32_t flash_status;
+	uint32_t start;
+	uint32_t i;
+
+	memcpy(flash_page_copy, (const void *)page_address, kept * 4);
+
+	/* Page number: offset from the start of flash (0x08000000) */
+	trace(TRACE_FLASH_ERASE_BEGIN, (page_address & 0xFFFFF) / FLASH_PAGE_SIZE);
+	start = stats_cycles();
+	flash_status = flash_ram_erase_page(page_address);
+	stats_time(&stats.flash_erase, start);
+	trace(TRACE_FLASH_ERASE_END, (page_address & 0xFFFFF) / FLASH_PAGE_SIZE);
+	if(flash_status != FLASH_SR_EOP)  /* EOP = End Of Program (success) */
+		return flash_status;
+
+	writer->erased_end = page_address + FLASH_PAGE_SIZE;
+
+	for (i = 0; i < kept; i++) {
+		if (flash_page_copy[i] == FLASH_ERASED_WORD)
+			continue;
+
+		flash_status = flash_ram_program_word(page_address + i * 4, flash_page_copy[i]);
+		if (flash_status != FLASH_SR_EOP)
+			return flash_status;
+	}
+
+	return RESULT_OK;
+}
+
+/**
+ * @brief Program one 32-bit word, erasing its page only if needed
+ *
+ * Flash is compared before it is touched, so rewriting a payload that
+ * is mostly unchanged costs little time and wear:
+ * - A word that already holds the value is skipped
+ * - A blank (0xFFFFFFFF) word is programmed without an erase
+ * - Any other word needs its page erased; this happens at most once per
+ *   page and session (see flash_writer_erase_page()). Afterwards the
+ *   rest of the page is blank.
+ *
+ * Pages that only ever compare equal or blank are never erased. Data
+ * past the end of a write in such a page is left as it was, not erased.
+ *
+ * Programmed words are not read back one by one: the controller's
+ * status flags catch failed operations, and the caller checks the
+ * result as a whole (the payload CRC, or flash_verify()).
+ *
+ * @param writer  Streaming writer state
+ * @param word    Value to program at writer->cursor
+ *
+ * @return RESULT_OK, FLASH_OUT_OF_RANGE or flash status flags on error
  */
-#define FLASH_PAGE_SIZE 0x400
+static uint32_t flash_writer_program_word(struct flash_writer *writer, uint32_t word)
+{
+	uint32_t flash_status;
+	uint32_t address = writer->cursor;
+	uint32_t current;
+	uint32_t start;
+
+	if (address + 4 > writer->limit)
+		return FLASH_OUT_OF_RANGE;
+
+	current = *((uint32_t*)address);
+	if (current == word) {
+		writer->cursor += 4;
+		return RESULT_OK;
+	}
+
+	/*
+	 * Pages below erased_end were erased in this session (or are blank
+	 * by contract, see flash_program_erased()): never erase them again,
+	 * a programming error is reported instead.
+	 */
+	if (current != FLASH_ERASED_WORD && address >= writer->erased_end) {
+		flash_status = flash_writer_erase_page(writer, address);
+		if (flash_status != RESULT_OK)
+			return flash_status;
+	}
+
+	/* Write one 32-bit word to flash */
+	start = stats_cycles();
+	flash_status = flash_ram_program_word(address, word);
+	stats_time(&stats.flash_program, start);
+
+	/* Check for programming errors */
+	if(flash_status != FLASH_SR_EOP)
+		return flash_status;
+
+	writer->cursor += 4;
+	return RESULT_OK;
+}
+
+/**
+ * @brief Compare a finished write with its source data
+ *
+ * @return result if it already is an error, otherwise RESULT_OK or
+ *         FLASH_WRONG_DATA_WRITTEN
+ */
+static uint32_t flash_verify(uint32_t result, uint32_t start_address, const uint8_t *input_data, uint32_t num_elements)
+{
+	if (result != RESULT_OK)
+		return result;
+
+	if (memcmp((const void *)start_address, input_data, num_elements) != 0)
+		return FLASH_WRONG_DATA_WRITTEN;
+
+	return RESULT_OK;
+}
 
 /*============================================================================
  * Public Functions
  *===========================================================================*/
 
 /**
- * @brief Program data to internal flash memory
+ * @brief Start a streaming write session
+ *
+ * Unlocks flash and records the write window. No page is erased yet;
+ * flash_writer_write() erases a page only when data in it changes, so
+ * a session never erases pages it does not use or leaves unchanged.
+ *
+ * @param writer        Writer state to initialize
+ * @param start_address First address to program (word aligned)
+ * @param limit_address One past the last address that may be programmed
+ *
+ * @return RESULT_OK, or FLASH_OUT_OF_RANGE if the window is invalid
+ */
+uint32_t flash_writer_begin(struct flash_writer *writer, uint32_t start_address, uint32_t limit_address)
+{
+	writer->cursor = start_address;
+	writer->limit = limit_address;
+	writer->erased_end = start_address;  /* Permits erasing from the first page on */
+	writer->pending_len = 0;
+	writer->status = RESULT_OK;
+
+	if ((start_address % 4) != 0 || limit_address < start_address) {
+		writer->status = FLASH_OUT_OF_RANGE;
+		return writer->status;
+	}
+
+	/* Unlock flash for write operations */
+	flash_unlock();
+
+	return RESULT_OK;
+}
+
+/**
+ * @brief Append a chunk of data to a streaming write session
+ *
+ * Chunks may have any length. Bytes that do not complete a 32-bit word
+ * are held back and combined with the start of the next chunk, so the
+ * caller can feed data exactly as it arrives (e.g. per USB packet).
+ *
+ * Errors are sticky: once a write fails, further calls return the same
+ * status without touching flash.
+ *
+ * @param writer Active writer from flash_writer_begin()
+ * @param data   Source bytes
+ * @param len    Number of bytes in this chunk
  *
- * Erases the flash page containing the start address, then programs
- * the provided data. Each word is verified after programming.
+ * @return RESULT_OK on success, otherwise the first error encountered
+ */
+uint32_t flash_writer_write(struct flash_writer *writer, const uint8_t *data, uint32_t len)
+{
+	uint32_t word;
+
+	while (len > 0 && writer->status == RESULT_OK) {
+		/* Fast path: whole words straight from the input */
+		if (writer->pending_len == 0 && len >= 4) {
+			word = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+			writer->status = flash_writer_program_word(writer, word);
+			data += 4;
+			len -= 4;
+			continue;
+		}
+
+		/* Slow path: collect a partial word */
+		writer->pending[writer->pending_len++] = *data++;
+		--len;
+		if (writer->pending_len == 4) {
+			memcpy(&word, writer->pending, 4);
+			writer->pending_len = 0;
+			writer->status = flash_writer_program_word(writer, word);
+		}
+	}
+
+	return writer->status;
+}
+
+/**
+ * @brief Finish a streaming write session
  *
- * ## Algorithm
+ * Flushes any held-back partial word (padded with 0x00 bytes) and
+ * re-locks the flash.
  *
- * 1. Calculate page-aligned start address
- * 2. Unlock flash (write key sequence to FLASH_KEYR)
- * 3. Erase the page (sets all bits to 1)
- * 4. For each 32-bit word:
- *    a. Program the word
- *    b. Check status flags
- *    c. Verify written value
- * 5. Return success or error code
+ * @param writer Active writer from flash_writer_begin()
+ *
+ * @return RESULT_OK if the whole session succeeded, otherwise the first
+ *         error encountered
+ */
+uint32_t flash_writer_finish(struct flash_writer *writer)
+{
+	if (writer->status == RESULT_OK && writer->pending_len > 0) {
+		uint32_t word = 0;
+
+		memcpy(&word, writer->pending, writer->pending_len);
+		writer->pending_len = 0;
+		writer->status = flash_writer_program_word(writer, word);
+	}
+
+	flash_lock();
+
+	return writer->status;
+}
+
+/**
+ * @brief Program data to internal flash memory
+ *
+ * Programs the provided data, erasing the pages covering the
+ * destination range where their contents differ. The whole range is
+ * compared with the source data at the end.
+ *
+ * This is a one-shot wrapper around the streaming writer
+ * (flash_writer_begin(), flash_writer_write(), flash_writer_finish()),
+ * so the data may span any number of pages.
  *
  * ## Error Handling
  *
  * The function checks for errors at two points:
- * - After page erase: Returns flash status if not FLASH_SR_EOP
- * - After each word write: Returns status or FLASH_WRONG_DATA_WRITTEN
+ * - After each page erase: Returns flash status if not FLASH_SR_EOP
+ * - After each word write: Returns flash status if not FLASH_SR_EOP
+ * - After the write: Returns FLASH_WRONG_DATA_WRITTEN if flash differs
+ *   from input_data
  *
- * @param start_address Destination address in flash (e.g., 0x08002000)
+ * @param start_address Destination address in flash (e.g., 0x08008000)
  * @param input_data    Source data buffer
  * @param num_elements  Number of bytes to program
  *
@@ -125,19 +431,16 @@
  * @return FLASH_WRONG_DATA_WRITTEN (0x80) on verification failure
  * @return Flash status flags on other errors
  *
- * @warning Erases entire page - existing data will be lost!
- * @warning num_elements should be multiple of 4 for word alignment
+ * @warning A page is erased as a whole when any word in it changes:
+ *          data in it past the end of the write is lost.
  *
  * @note Based on libopencm3 flash_rw_example
  *
  * @see https://github.com/libopencm3/libopencm3-examples/blob/master/examples/stm32/f1/stm32-h107/flash_rw_example/flash_rw_example.c
  */
-uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_t num_elements)
+uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint32_t num_elements)
 {
-	uint16_t iter;
-	uint32_t current_address = start_address;
-	uint32_t page_address = start_address;
-	uint32_t flash_status = 0;
+	struct flash_writer writer;
 
 	/*
 	 * Address range check (commented out - relies on linker script)
@@ -146,36 +449,65 @@ uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_
 	/* if((start_address - FLASH_BASE) >= (FLASH_PAGE_SIZE * (FLASH_PAGE_NUM_MAX+1)))
 		return 1; */
 
-	/* Calculate page-aligned address (round down to page boundary) */
-	if(start_address % FLASH_PAGE_SIZE)
-		page_address -= (start_address % FLASH_PAGE_SIZE);
+	/* Allow the trailing partial word to be padded out */
+	if (flash_writer_begin(&writer, start_address, start_address + ((num_elements + 3) & ~3u)) != RESULT_OK)
+		return writer.status;
 
-	/* Unlock flash for write operations */
-	flash_unlock();
+	flash_writer_write(&writer, input_data, num_elements);
 
-	/* Erase the target page (required before programming) */
-	flash_erase_page(page_address);
-	flash_status = flash_get_status_flags();
-	if(flash_status != FLASH_SR_EOP)  /* EOP = End Of Program (success) */
-		return flash_status;
+	return flash_verify(flash_writer_finish(&writer), start_address, input_data, num_elements);
+}
 
-	/* Program data in 32-bit words */
-	for(iter=0; iter<num_elements; iter += 4)
-	{
-		/* Write one 32-bit word to flash */
-		flash_program_word(current_address+iter, *((uint32_t*)(input_data + iter)));
+/**
+ * @brief Program data into flash that is already erased
+ *
+ * Same as flash_program_data() but never erases: the destination must
+ * still be in the erased state (0xFF), e.g. a placeholder left by an
+ * earlier write session. Used to program a small record last, after the
+ * data it describes.
+ *
+ * @param start_address Destination address in flash (word aligned)
+ * @param input_data    Source data buffer
+ * @param num_elements  Number of bytes to program
+ *
+ * @return RESULT_OK (0) on success
+ * @return FLASH_WRONG_DATA_WRITTEN (0x80) on verification failure
+ * @return Flash status flags on other errors
+ */
+uint32_t flash_program_erased(uint32_t start_address, const uint8_t *input_data, uint32_t num_elements)
+{
+	struct flash_writer writer;
+	uint32_t limit = start_address + ((num_elements + 3) & ~3u);
 
-		/* Check for programming errors */
-		flash_status = flash_get_status_flags();
-		if(flash_status != FLASH_SR_EOP)
-			return flash_status;
+	if (flash_writer_begin(&writer, start_address, limit) != RESULT_OK)
+		return writer.status;
 
-		/* Verify the written data by reading it back */
-		if(*((uint32_t*)(current_address+iter)) != *((uint32_t*)(input_data + iter)))
-			return FLASH_WRONG_DATA_WRITTEN;
-	}
+	/* Treat the whole window as erased already */
+	writer.erased_end = limit;
 
-	return RESULT_OK;
+	flash_writer_write(&writer, input_data, num_elements);
+
+	return flash_verify(flash_writer_finish(&writer), start_address, input_data, num_elements);
+}
+
+/**
+ * @brief Program a flash word to zero
+ *
+ * @param address Flash address of the word (word aligned)
+ *
+ * @return RESULT_OK, FLASH_WRONG_DATA_WRITTEN or flash status flags
+ */
+uint32_t flash_clear_word(uint32_t address)
+{
+	uint32_t flash_status;
+
+	flash_unlock();
+	flash_status = flash_ram_program_word(address, 0);
+	flash_lock();
+
+	if (flash_status != FLASH_SR_EOP)
+		return flash_status;
+	return *((uint32_t*)address) == 0 ? RESULT_OK : FLASH_WRONG_DATA_WRITTEN;
 }
 
 /**
@@ -188,7 +520,7 @@ uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_
  * Reading is done in 32-bit word increments for efficiency, matching
  * the bus width of the ARM Cortex-M3.
  *
- * @param start_address Source address in flash (e.g., 0x08002000)
+ * @param start_address Source address in flash (e.g., 0x08008000)
  * @param num_elements  Number of bytes to read (should be multiple of 4)
  * @param output_data   Destination buffer (must have enough space)
  *
@@ -202,9 +534,9 @@ uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_
  * flash_read_data((uint32_t)&user_data, sizeof(report), (uint8_t*)&report);
  * @endcode
  */
-void flash_read_data(uint32_t start_address, uint16_t num_elements, uint8_t *output_data)
+void flash_read_data(uint32_t start_address, uint32_t num_elements, uint8_t *output_data)
 {
-	uint16_t iter;
+	uint32_t iter;
 	uint32_t *memory_ptr= (uint32_t*)start_address;
 
 	/* Read data in 32-bit word increments */
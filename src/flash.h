@@ -13,8 +13,8 @@
  *
  * | Region    | Address Range         | Size  | Purpose              |
  * |-----------|-----------------------|-------|----------------------|
- * | Firmware  | 0x08000000-0x08001FFF | 8 KB  | Bootloader/firmware  |
- * | User Data | 0x08002000-0x0801FFFF | 120KB | Payload storage      |
+ * | Firmware  | 0x08000000-0x08007FFF | 32 KB | Bootloader/firmware  |
+ * | User Data | 0x08008000-0x0801FFFF | 96 KB | Payload storage      |
  *
  * ## Flash Characteristics
  *
@@ -26,7 +26,9 @@
  * ## Usage Notes
  *
  * - Flash must be unlocked before write operations
- * - The page containing the target address is erased before writing
+ * - Writes compare flash first and erase a page only when a word in it
+ *   changes (blank words are programmed directly), so rewriting
+ *   unchanged data costs no erase; writes may span multiple pages
  * - Data verification is performed after each word write
  * - Functions handle flash unlock/lock internally
  *
@@ -89,23 +91,120 @@
  */
 #define RESULT_OK 0
 
+/**
+ * @brief Error code: Write would fall outside the permitted window
+ *
+ * Returned by the streaming writer when the write cursor would pass the
+ * limit address given to flash_writer_begin(), or when the window
+ * itself is not word aligned.
+ *
+ * @note Value chosen to not conflict with libopencm3 FLASH_SR flags
+ */
+#define FLASH_OUT_OF_RANGE 0x40
+
+/**
+ * @brief Size of one flash page in bytes
+ *
+ * STM32F103 medium-density devices have 1KB (0x400) pages.
+ * This is the minimum erasable unit.
+ */
+#define FLASH_PAGE_SIZE 0x400
+
+/**
+ * @brief Size of the user_data payload region in bytes
+ *
+ * Must match the `data` memory region in bluepill.ld (128K - 32K).
+ */
+#define USER_DATA_SIZE ((128 - 32) * 1024)
+
+/*============================================================================
+ * Data Structures
+ *===========================================================================*/
+
+/**
+ * @brief Streaming flash writer state
+ *
+ * Tracks a write session that accepts data in arbitrarily sized chunks
+ * and erases a page only when a word in it has to change. Used for payloads that do not fit in a single RAM buffer.
+ *
+ * @code
+ * struct flash_writer writer;
+ * flash_writer_begin(&writer, (uint32_t)&user_data, (uint32_t)&user_data + USER_DATA_SIZE);
+ * flash_writer_write(&writer, chunk1, len1);
+ * flash_writer_write(&writer, chunk2, len2);
+ * uint32_t result = flash_writer_finish(&writer);
+ * @endcode
+ */
+struct flash_writer {
+	uint32_t cursor;      /**< Next flash address to program */
+	uint32_t limit;       /**< One past the last writable address */
+	uint32_t erased_end;  /**< End of the most recently erased page, nothing below is erased again */
+	uint32_t status;      /**< Sticky result of the session so far */
+	uint8_t pending[4];   /**< Bytes held back until a full word is available */
+	uint8_t pending_len;  /**< Number of valid bytes in pending */
+};
+
 /*============================================================================
  * Function Declarations
  *===========================================================================*/
 
+/**
+ * @brief Start a streaming write session
+ *
+ * Unlocks flash and records the write window. Pages are not erased
+ * until a word in them has to change.
+ *
+ * @param writer        Writer state to initialize
+ * @param start_address First flash address to program (word aligned)
+ * @param limit_address One past the last address that may be programmed
+ *
+ * @return RESULT_OK, or FLASH_OUT_OF_RANGE if the window is invalid
+ */
+uint32_t flash_writer_begin(struct flash_writer *writer, uint32_t start_address, uint32_t limit_address);
+
+/**
+ * @brief Append a chunk of data to a streaming write session
+ *
+ * Compares the data with flash word by word: unchanged words are
+ * skipped and blank words are programmed directly. The first word of a
+ * page that needs an erase triggers it; the words already written to
+ * that page are saved and programmed back. Words are not read back;
+ * the caller verifies the finished write (e.g. by CRC). Partial words
+ * are held back until the next chunk or flash_writer_finish().
+ *
+ * @param writer Active writer from flash_writer_begin()
+ * @param data   Source bytes
+ * @param len    Number of bytes in this chunk (any length)
+ *
+ * @return RESULT_OK on success, otherwise the first (sticky) error
+ */
+uint32_t flash_writer_write(struct flash_writer *writer, const uint8_t *data, uint32_t len);
+
+/**
+ * @brief Finish a streaming write session
+ *
+ * Flushes a held-back partial word (zero padded) and locks the flash.
+ *
+ * @param writer Active writer from flash_writer_begin()
+ *
+ * @return RESULT_OK if the whole session succeeded, otherwise the first
+ *         error encountered
+ */
+uint32_t flash_writer_finish(struct flash_writer *writer);
+
 /**
  * @brief Program data to internal flash memory
  *
- * Erases the flash page containing start_address, then writes the
- * provided data. Each 32-bit word is verified after writing.
+ * Writes the provided data, erasing only the pages whose contents
+ * differ. The written range is compared with input_data at the end.
  *
  * Operation sequence:
- * 1. Calculate page-aligned address
- * 2. Unlock flash for writing
- * 3. Erase the target page
- * 4. Write data in 32-bit words
- * 5. Verify each word after writing
- * 6. Lock flash
+ * 1. Unlock flash for writing
+ * 2. Skip words that already hold the data
+ * 3. Write data in 32-bit words, erasing a page first when a non-blank
+ *    word in it must change
+ * 4. Lock flash
+ * 5. Compare the written range with input_data
  *
  * @param start_address Flash address to start writing (e.g., &user_data)
  *                      Should be within valid flash range
@@ -118,8 +217,8 @@
  * @return FLASH_WRONG_DATA_WRITTEN (0x80) if verification failed
  * @return Other values from flash_get_status_flags() on flash error
  *
- * @warning This function erases the entire page before writing!
- *          Any existing data in the page will be lost.
+ * @warning A page that has to change is erased as a whole: existing
+ *          data in it past the end of the write is lost.
  *
  * @note The function handles flash unlock/lock internally.
  * @note num_elements should be a multiple of 4 (word-aligned writes)
@@ -133,7 +232,35 @@
  * }
  * @endcode
  */
-uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_t num_elements);
+uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint32_t num_elements);
+
+/**
+ * @brief Program data into flash that is already erased
+ *
+ * Like flash_program_data() but without erasing any page, so data next
+ * to the destination is preserved. The destination bytes must still be
+ * erased (0xFF); programming over anything else fails.
+ *
+ * @param start_address Flash address to start writing (word aligned)
+ * @param input_data    Pointer to data buffer to write
+ * @param num_elements  Number of bytes to write
+ *
+ * @return RESULT_OK, FLASH_WRONG_DATA_WRITTEN or flash status flags
+ */
+uint32_t flash_program_erased(uint32_t start_address, const uint8_t *input_data, uint32_t num_elements);
+
+/**
+ * @brief Program a flash word to zero, whatever it holds
+ *
+ * Zero is the one value the STM32F1 programs over data that is not
+ * erased (a 0x0000 half-word sets no PGERR), so a record can be
+ * invalidated in place without erasing its page.
+ *
+ * @param address Flash address of the word (word aligned)
+ *
+ * @return RESULT_OK, FLASH_WRONG_DATA_WRITTEN or flash status flags
+ */
+uint32_t flash_clear_word(uint32_t address);
 
 /**
  * @brief Read data from internal flash memory
@@ -158,7 +285,7 @@ uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint16_
  * flash_read_data((uint32_t)&user_data, sizeof(buffer), buffer);
  * @endcode
  */
-void flash_read_data(uint32_t start_address, uint16_t num_elements, uint8_t *output_data);
+void flash_read_data(uint32_t start_address, uint32_t num_elements, uint8_t *output_data);
 
 #endif /* __FLASH_H */
 
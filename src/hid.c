@@ -3,29 +3,50 @@
  * @file hid.c
  * @brief USB HID (Human Interface Device) interface implementation
  *
- * This module implements the USB HID interface for the Pill Duck device,
+ * This module implements the USB HID interfaces for the Pill Duck device,
  * providing keyboard and mouse emulation capabilities. It handles:
  *
  * - USB HID descriptor configuration
- * - HID endpoint setup (Endpoint 0x81, Interrupt IN)
- * - HID control requests (GET_DESCRIPTOR for report descriptor)
+ * - HID endpoint setup (Endpoints 0x81 and 0x82, Interrupt IN)
+ * - HID control requests (GET_DESCRIPTOR for the report descriptors,
+ *   SET_REPORT for the keyboard LEDs)
+ * - Queued report transmission, drained by each endpoint's IN-complete callback
  *
- * The HID interface is part of a USB composite device that also includes
+ * The HID interfaces are part of a USB composite device that also includes
  * a CDC ACM (serial) interface for command and control.
  *
  * ## USB Configuration
  *
- * - **Interface Number**: 0
- * - **Endpoint**: 0x81 (Interrupt IN)
- * - **Max Packet Size**: 9 bytes (report ID + 8 bytes data)
- * - **Polling Interval**: 32ms (0x20)
- * - **Boot Protocol**: Mouse (allows BIOS compatibility)
+ * | Interface | Function | Endpoint | Max Packet | Boot Protocol |
+ * |-----------|----------|----------|------------|---------------|
+ * | 0         | Keyboard | 0x81     | 8 bytes    | Keyboard      |
+ * | 1         | Mouse    | 0x82     | 4 bytes    | Mouse         |
+ *
+ * Both endpoints are polled every HID_INTERVAL_MS (default 32ms, 1ms for
+ * fastest typing). The host polls each endpoint on its own, so keyboard
+ * and mouse reports no longer share one poll slot: twice as many input
+ * events per interval, and a key press never waits behind mouse motion.
  *
  * ## HID Reports
  *
- * The device sends composite reports with a report ID prefix:
- * - Report ID 1: Keyboard (9 bytes)
- * - Report ID 2: Mouse (5 bytes)
+ * Each interface has a single report type, so the reports on the wire
+ * carry no report ID; the layouts match the boot protocol and need no
+ * SET_PROTOCOL handling:
+ * - Keyboard: modifiers, reserved, keys_down[6] (8 bytes)
+ * - Mouse: buttons, x, y, wheel (4 bytes)
+ *
+ * The engine still hands over reports with a REPORT_ID_* prefix; it
+ * selects the interface and is dropped before queueing.
+ *
+ * ## Transmit Queues
+ *
+ * Reports are not written to the endpoints directly by the execution
+ * engine. hid_queue_report() appends them to a small RAM ring buffer per
+ * interface and returns immediately; each queue is drained one report
+ * at a time, each time the endpoint's IN-complete callback
+ * (hid_in_complete()) reports that the host has read the previous one.
+ * Nothing ever spins waiting for the host, so the report rate follows
+ * its real polling rate and USB/CDC servicing is never starved.
  *
  * @note This implementation uses libopencm3 USB stack.
  *
@@ -56,6 +77,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/rcc.h>
@@ -65,18 +87,120 @@
 
 #define INCLUDE_PACKET_DESCRIPTOR  /**< Enable HID report descriptor definition in hid.h */
 #include "hid.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+#ifndef HID_INTERVAL_MS
+/**
+ * @brief HID endpoint polling interval in milliseconds (bInterval)
+ *
+ * Full-speed interrupt endpoints accept 1-255 ms. The host reads at most
+ * one report per interval from each endpoint, so this caps the report
+ * rate: 32 ms gives about 31 keyboard plus 31 mouse reports/s, 1 ms up
+ * to 1000 each on hosts that honor it.
+ * Override at build time with `make HID_INTERVAL_MS=1`.
+ */
+#define HID_INTERVAL_MS 32
+#endif
 
+#if HID_INTERVAL_MS < 1 || HID_INTERVAL_MS > 255
+#error "HID_INTERVAL_MS must be between 1 and 255"
+#endif
+
+/**
+ * @defgroup HidInterfaces HID interface numbers
+ * @brief Also the index of the interface's transmit queue
+ * @{
+ */
+#define HID_KEYBOARD	0  /**< Keyboard interface */
+#define HID_MOUSE	1  /**< Mouse interface */
+#define HID_IFACES	2  /**< Number of HID interfaces */
+/** @} */
+
+/**
+ * @brief Report endpoint address of an interface (EP1 IN, EP2 IN)
+ */
+#define HID_ENDPOINT(iface) (0x81 + (iface))
+
+/**
+ * @brief Keyboard report size on the wire (boot keyboard layout, no report ID)
+ */
+#define HID_KEYBOARD_REPORT_SIZE 8
+
+/**
+ * @brief Mouse report size on the wire (buttons, x, y, wheel; no report ID)
+ */
+#define HID_MOUSE_REPORT_SIZE 4
+
+/**
+ * @brief Largest report sent on a HID endpoint
+ */
+#define HID_MAX_REPORT_SIZE HID_KEYBOARD_REPORT_SIZE
+
+/**
+ * @brief Number of reports each transmit queue can hold (power of two)
+ */
+#define HID_TX_QUEUE_LEN 8
 
 /*============================================================================
- * USB HID Function Descriptor
+ * Private State
  *===========================================================================*/
 
 /**
- * @brief Combined HID descriptor structure
+ * @brief One queued report
+ */
+struct hid_tx_slot {
+	uint8_t len;                        /**< Report length in bytes */
+	uint8_t data[HID_MAX_REPORT_SIZE];  /**< Report bytes, without report ID */
+};
+
+/**
+ * @brief Transmit ring buffer of one interface
  *
- * This structure contains the HID class descriptor and subordinate
- * report descriptor reference. It is included as "extra" data in
- * the interface descriptor and is sent to the host during enumeration.
+ * head and tail are free-running counters; (head - tail) is the number
+ * of queued reports and the slot index is taken modulo the queue size.
+ */
+struct hid_tx {
+	struct hid_tx_slot slot[HID_TX_QUEUE_LEN]; /**< Queued reports */
+	volatile uint8_t head;                     /**< Next slot to fill */
+	volatile uint8_t tail;                     /**< Next slot to send */
+	volatile bool busy;                        /**< A report is waiting in the endpoint buffer */
+};
+
+/**
+ * @brief Transmit queues, indexed by interface number
+ */
+static struct hid_tx hid_tx[HID_IFACES];
+
+/**
+ * @brief USB device the HID interfaces were configured on
+ *
+ * NULL until hid_set_config(); reports queued before then are held.
+ */
+static usbd_device *hid_dev;
+
+/**
+ * @brief Keyboard LEDs from the last output report, see hid_leds()
+ *
+ * Written by the USB interrupt, read by the engine in the main loop.
+ */
+static volatile uint8_t hid_led_state;
+
+/*============================================================================
+ * USB HID Function Descriptors
+ *===========================================================================*/
+
+/**
+ * @brief HID class descriptor structure
+ *
+ * Contains the HID class descriptor and subordinate report descriptor
+ * reference. It is included as "extra" data in the interface descriptor
+ * and is sent to the host during enumeration.
  *
  * Structure layout (9 bytes total):
  * @code
@@ -93,88 +217,126 @@
  *
  * @see USB HID Specification 1.11, Section 6.2.1
  */
-static const struct {
+struct hid_function {
 	struct usb_hid_descriptor hid_descriptor;   /**< Standard HID descriptor */
 	struct {
 		uint8_t bReportDescriptorType;      /**< Report descriptor type (0x22) */
 		uint16_t wDescriptorLength;         /**< Length of report descriptor */
 	} __attribute__((packed)) hid_report;       /**< Report descriptor reference */
-} __attribute__((packed)) hid_function = {
-	.hid_descriptor = {
-		.bLength = sizeof(hid_function),
-		.bDescriptorType = USB_DT_HID,
-		.bcdHID = 0x0100,    /* HID Class Specification 1.0 */
-		.bCountryCode = 0,   /* Not localized */
-		.bNumDescriptors = 1,
-	},
-	.hid_report = {
-		.bReportDescriptorType = USB_DT_REPORT,
-		.wDescriptorLength = sizeof(hid_report_descriptor),
-	}
-};
+} __attribute__((packed));
+
+/**
+ * @brief HID descriptor of an interface with the given report descriptor
+ */
+#define HID_FUNCTION(report_descriptor) {				\
+	.hid_descriptor = {						\
+		.bLength = sizeof(struct hid_function),			\
+		.bDescriptorType = USB_DT_HID,				\
+		.bcdHID = 0x0100,    /* HID Class Specification 1.0 */	\
+		.bCountryCode = 0,   /* Not localized */		\
+		.bNumDescriptors = 1,					\
+	},								\
+	.hid_report = {							\
+		.bReportDescriptorType = USB_DT_REPORT,			\
+		.wDescriptorLength = sizeof(report_descriptor),		\
+	}								\
+}
+
+/** @brief HID descriptor of the keyboard interface */
+static const struct hid_function hid_keyboard_function = HID_FUNCTION(hid_keyboard_report_descriptor);
 
+/** @brief HID descriptor of the mouse interface */
+static const struct hid_function hid_mouse_function = HID_FUNCTION(hid_mouse_report_descriptor);
 
 /*============================================================================
  * USB Endpoint and Interface Descriptors
  *===========================================================================*/
 
 /**
- * @brief HID endpoint descriptor for keyboard/mouse reports
- *
- * Defines the interrupt IN endpoint used to send HID reports to the host.
+ * @brief Keyboard endpoint descriptor
  *
  * Configuration:
  * - **Endpoint Address**: 0x81 (Endpoint 1, IN direction)
  * - **Type**: Interrupt (for HID devices)
- * - **Max Packet Size**: 9 bytes (1 report ID + 8 bytes max data)
- * - **Polling Interval**: 32ms (0x20) - how often host polls for data
+ * - **Max Packet Size**: 8 bytes (boot keyboard report)
+ * - **Polling Interval**: HID_INTERVAL_MS - how often host polls for data
  *
  * @note Interrupt endpoints guarantee bounded latency for input devices.
- *       The host will poll this endpoint every 32ms for new data.
+ *       The host will poll this endpoint every HID_INTERVAL_MS for new data.
  */
-const struct usb_endpoint_descriptor hid_endpoint = {
+static const struct usb_endpoint_descriptor hid_keyboard_endpoint = {
 	.bLength = USB_DT_ENDPOINT_SIZE,
 	.bDescriptorType = USB_DT_ENDPOINT,
-	.bEndpointAddress = 0x81,                    /* EP1 IN */
-	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT, /* Interrupt transfer type */
-	.wMaxPacketSize = 9,                         /* Report ID + 8 bytes */
-	.bInterval = 0x20,                           /* Poll every 32ms */
+	.bEndpointAddress = HID_ENDPOINT(HID_KEYBOARD), /* EP1 IN */
+	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,    /* Interrupt transfer type */
+	.wMaxPacketSize = HID_KEYBOARD_REPORT_SIZE,
+	.bInterval = HID_INTERVAL_MS,                   /* Poll every HID_INTERVAL_MS */
 };
 
 /**
- * @brief HID interface descriptor for composite keyboard/mouse device
+ * @brief Mouse endpoint descriptor
  *
- * Defines the HID interface (Interface 0) in the USB configuration.
- * This interface presents as a boot-compatible mouse for BIOS support,
- * but the report descriptor also includes keyboard functionality.
+ * Same as the keyboard endpoint, on 0x82 (Endpoint 2, IN) with 4-byte
+ * packets.
+ */
+static const struct usb_endpoint_descriptor hid_mouse_endpoint = {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = HID_ENDPOINT(HID_MOUSE),    /* EP2 IN */
+	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+	.wMaxPacketSize = HID_MOUSE_REPORT_SIZE,
+	.bInterval = HID_INTERVAL_MS,
+};
+
+/**
+ * @brief Keyboard interface descriptor (Interface 0)
  *
  * Configuration:
  * - **Interface Number**: 0 (first interface in composite device)
  * - **Class**: HID (Human Interface Device)
  * - **SubClass**: 1 (Boot Interface)
- * - **Protocol**: 2 (Mouse) - for BIOS/boot compatibility
+ * - **Protocol**: 1 (Keyboard) - for BIOS/boot compatibility
  *
  * @note Boot protocol support allows the device to work in BIOS setup
  *       menus before OS drivers are loaded.
- *
- * @see hid_endpoint for the associated endpoint
- * @see hid_function for the HID descriptor (extra data)
  */
-struct usb_interface_descriptor hid_iface = {
+const struct usb_interface_descriptor hid_keyboard_iface = {
 	.bLength = USB_DT_INTERFACE_SIZE,
 	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = 0,        /* First interface */
+	.bInterfaceNumber = HID_KEYBOARD,
 	.bAlternateSetting = 0,
 	.bNumEndpoints = 1,           /* One interrupt IN endpoint */
 	.bInterfaceClass = USB_CLASS_HID,
 	.bInterfaceSubClass = 1,      /* Boot interface subclass */
-	.bInterfaceProtocol = 2,      /* Mouse protocol (boot compatible) */
+	.bInterfaceProtocol = 1,      /* Keyboard protocol (boot compatible) */
 	.iInterface = 0,              /* No string descriptor */
 
-	.endpoint = &hid_endpoint,
+	.endpoint = &hid_keyboard_endpoint,
+
+	.extra = &hid_keyboard_function, /* HID descriptor */
+	.extralen = sizeof(hid_keyboard_function),
+};
+
+/**
+ * @brief Mouse interface descriptor (Interface 1)
+ *
+ * Boot interface subclass with the mouse protocol (2).
+ */
+const struct usb_interface_descriptor hid_mouse_iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = HID_MOUSE,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 1,
+	.bInterfaceClass = USB_CLASS_HID,
+	.bInterfaceSubClass = 1,      /* Boot interface subclass */
+	.bInterfaceProtocol = 2,      /* Mouse protocol (boot compatible) */
+	.iInterface = 0,
+
+	.endpoint = &hid_mouse_endpoint,
 
-	.extra = &hid_function,       /* HID descriptor */
-	.extralen = sizeof(hid_function),
+	.extra = &hid_mouse_function,
+	.extralen = sizeof(hid_mouse_function),
 };
 
 /*============================================================================
@@ -185,13 +347,14 @@ struct usb_interface_descriptor hid_iface = {
  * @brief Handle HID-specific USB control requests
  *
  * This callback handles GET_DESCRIPTOR requests for the HID report
- * descriptor. The host requests this descriptor after enumeration to
- * understand the format of HID reports the device will send.
+ * descriptors. The host requests them after enumeration to understand
+ * the format of HID reports each interface will send.
  *
  * Request handled:
  * - **bmRequestType**: 0x81 (Device-to-host, Standard, Interface)
  * - **bRequest**: GET_DESCRIPTOR (0x06)
  * - **wValue**: 0x2200 (HID Report Descriptor, Index 0)
+ * - **wIndex**: HID_KEYBOARD or HID_MOUSE
  *
  * @param dev      USB device instance (unused)
  * @param req      USB setup packet containing the request details:
@@ -209,7 +372,7 @@ struct usb_interface_descriptor hid_iface = {
  * @note This function is registered as a control callback in hid_set_config()
  *       and is called by the USB stack when control requests arrive.
  *
- * @see hid_report_descriptor for the descriptor returned
+ * @see hid_keyboard_report_descriptor and hid_mouse_report_descriptor
  * @see USB HID Specification 1.11, Section 7.1
  */
 static int hid_control_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
@@ -224,23 +387,199 @@ static int hid_control_request(usbd_device *dev, struct usb_setup_data *req, uin
 	   (req->wValue != 0x2200))  /* 0x22 = Report descriptor type, 0x00 = index */
 		return 0;
 
-	/* Return the HID report descriptor */
-	*buf = (uint8_t *)hid_report_descriptor;
-	*len = sizeof(hid_report_descriptor);
+	/* Return the report descriptor of the addressed interface */
+	switch (req->wIndex) {
+	case HID_KEYBOARD:
+		*buf = (uint8_t *)hid_keyboard_report_descriptor;
+		*len = sizeof(hid_keyboard_report_descriptor);
+		return 1;
+	case HID_MOUSE:
+		*buf = (uint8_t *)hid_mouse_report_descriptor;
+		*len = sizeof(hid_mouse_report_descriptor);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Handle HID class requests: keyboard LED output reports
+ *
+ * The keyboard interface has no interrupt OUT endpoint, so the host
+ * sends the LED output report as a SET_REPORT request on the control
+ * pipe. The data stage has been received when this callback runs:
+ *
+ * - **bmRequestType**: 0x21 (Host-to-device, Class, Interface)
+ * - **bRequest**: SET_REPORT (0x09)
+ * - **wValue**: 0x0200 (Output report, no report ID)
+ * - **wIndex**: HID_KEYBOARD
+ * - **Data**: LED bits (HID_LED_*)
+ *
+ * SET_IDLE and SET_PROTOCOL, which hosts send to boot devices, are
+ * accepted and ignored: reports only go out when something changed,
+ * and the report layouts already are the boot protocol ones. Other
+ * class requests stall.
+ *
+ * @param dev      USB device instance (unused)
+ * @param req      USB setup packet
+ * @param buf      [in] Data stage of the request
+ * @param len      [in] Number of data bytes received
+ * @param complete Completion callback (unused)
+ *
+ * @return 1 if the request was handled, 0 if not handled
+ */
+static int hid_class_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+			void (**complete)(usbd_device *, struct usb_setup_data *))
+{
+	(void)complete;
+	(void)dev;
+
+	if (req->wIndex >= HID_IFACES)
+		return 0;
+
+	switch (req->bRequest) {
+	case USB_HID_REQ_TYPE_SET_IDLE:
+	case USB_HID_REQ_TYPE_SET_PROTOCOL:
+		return 1;
+	case USB_HID_REQ_TYPE_SET_REPORT:
+		/* 0x02 = Output report */
+		if (req->wIndex != HID_KEYBOARD || req->wValue != 0x0200 || *len != 1)
+			return 0;
+		hid_led_state = (*buf)[0];
+		trace(TRACE_LED_REPORT, hid_led_state);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Move the oldest queued report of an interface into its
+ *        endpoint buffer
+ *
+ * Does nothing while a previous report has not been read by the host
+ * or when the queue is empty. Runs from RAM: it is called from the USB
+ * interrupt, which keeps running during flash writes.
+ *
+ * @param iface HID_KEYBOARD or HID_MOUSE
+ */
+static RAMFUNC void hid_tx_kick(uint8_t iface)
+{
+	struct hid_tx *tx = &hid_tx[iface];
+
+	if (tx->busy || tx->head == tx->tail || !hid_dev)
+		return;
+
+	struct hid_tx_slot *slot = &tx->slot[tx->tail % HID_TX_QUEUE_LEN];
+
+	if (usbd_ep_write_packet(hid_dev, HID_ENDPOINT(iface), slot->data, slot->len) == 0)
+		return;
+
+	tx->busy = true;
+	++tx->tail;
+	++stats.reports;
+}
+
+/**
+ * @brief HID endpoint IN-complete callback
+ *
+ * Called by the USB stack once the host has read the report that was
+ * placed in an endpoint buffer. Sends the next report queued for the
+ * same interface, if any. The first report read after boot is timed in
+ * stats.boot_report.
+ *
+ * @param dev USB device instance (unused)
+ * @param ep  Endpoint address (HID_ENDPOINT(HID_KEYBOARD) or HID_ENDPOINT(HID_MOUSE))
+ */
+static RAMFUNC void hid_in_complete(usbd_device *dev, uint8_t ep)
+{
+	uint8_t iface = (ep & 0x7F) - 1;
 
-	return 1;
+	(void)dev;
+
+	hid_tx[iface].busy = false;
+	if (!stats.boot_report)
+		stats.boot_report = stats_cycles();
+	trace(TRACE_REPORT_SENT, (uint8_t)(hid_tx[iface].head - hid_tx[iface].tail));
+	hid_tx_kick(iface);
+}
+
+/**
+ * @brief Interface a report goes out on, from its report ID
+ */
+static uint8_t hid_report_iface(uint8_t report_id)
+{
+	return report_id == REPORT_ID_MOUSE ? HID_MOUSE : HID_KEYBOARD;
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+bool hid_queue_full(uint8_t report_id)
+{
+	const struct hid_tx *tx = &hid_tx[hid_report_iface(report_id)];
+
+	return (uint8_t)(tx->head - tx->tail) >= HID_TX_QUEUE_LEN;
+}
+
+bool hid_tx_idle(uint8_t report_id)
+{
+	const struct hid_tx *tx = &hid_tx[hid_report_iface(report_id)];
+
+	return !tx->busy && tx->head == tx->tail;
+}
+
+uint8_t hid_leds(void)
+{
+	return hid_led_state;
+}
+
+bool hid_queue_report(const void *report, uint16_t len)
+{
+	const uint8_t *bytes = report;
+	uint8_t iface;
+
+	if (len < 2 || len - 1 > HID_MAX_REPORT_SIZE || hid_queue_full(bytes[0]))
+		return false;
+
+	iface = hid_report_iface(bytes[0]);
+
+	struct hid_tx *tx = &hid_tx[iface];
+	struct hid_tx_slot *slot = &tx->slot[tx->head % HID_TX_QUEUE_LEN];
+
+	/* The report ID only picked the interface, it is not sent */
+	memcpy(slot->data, &bytes[1], len - 1);
+	slot->len = len - 1;
+	++tx->head;
+
+	/* Keyboard: first key down; mouse: x movement */
+	trace(TRACE_REPORT_QUEUED, bytes[0] |
+		(bytes[iface == HID_KEYBOARD ? 3 : 2] << 8));
+
+	/*
+	 * Start transmission right away if the endpoint is idle. The USB
+	 * interrupt kicks the queue too (hid_in_complete()), so keep it out
+	 * while the endpoint and the busy flag are updated.
+	 */
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	hid_tx_kick(iface);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	return true;
 }
 
 /**
- * @brief Configure the HID interface after USB enumeration
+ * @brief Configure the HID interfaces after USB enumeration
  *
  * Called when the USB host sets the device configuration (SET_CONFIGURATION).
- * This function sets up the HID interrupt endpoint and registers the
- * control request callback for handling HID-specific requests.
+ * This function sets up the HID interrupt endpoints and registers the
+ * control request callbacks for handling HID-specific requests.
  *
  * Setup performed:
- * 1. Configure endpoint 0x81 as an interrupt IN endpoint
+ * 1. Configure endpoints 0x81 (keyboard) and 0x82 (mouse) as interrupt
+ *    IN endpoints with hid_in_complete() as their transfer-complete callback
  * 2. Register hid_control_request() for handling GET_DESCRIPTOR requests
+ * 3. Register hid_class_request() for the keyboard LED output report
  *
  * @param dev    Pointer to the USB device instance
  * @param wValue Configuration value selected by host (unused, always 1)
@@ -262,10 +601,19 @@ static int hid_control_request(usbd_device *dev, struct usb_setup_data *req, uin
 void hid_set_config(usbd_device *dev, uint16_t wValue)
 {
 	(void)wValue;
-	(void)dev;
 
-	/* Setup endpoint 0x81: Interrupt IN, 4 byte buffer, no callback */
-	usbd_ep_setup(dev, 0x81, USB_ENDPOINT_ATTR_INTERRUPT, 4, NULL);
+	/* Setup endpoints 0x81 and 0x82: Interrupt IN, sized for their reports */
+	usbd_ep_setup(dev, HID_ENDPOINT(HID_KEYBOARD), USB_ENDPOINT_ATTR_INTERRUPT,
+		      HID_KEYBOARD_REPORT_SIZE, hid_in_complete);
+	usbd_ep_setup(dev, HID_ENDPOINT(HID_MOUSE), USB_ENDPOINT_ATTR_INTERRUPT,
+		      HID_MOUSE_REPORT_SIZE, hid_in_complete);
+
+	/* Endpoint buffers start out empty; send anything already queued */
+	hid_dev = dev;
+	for (int i = 0; i < HID_IFACES; i++) {
+		hid_tx[i].busy = false;
+		hid_tx_kick(i);
+	}
 
 	/* Register control callback for HID class requests
 	 * Mask: Standard requests to interface recipient
@@ -276,6 +624,11 @@ void hid_set_config(usbd_device *dev, uint16_t wValue)
 				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
 				hid_control_request);
 
-}
-
+	/* Class requests to interface recipient: SET_REPORT (LEDs), SET_IDLE */
+	usbd_register_control_callback(
+				dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				hid_class_request);
 
+}
@@ -26,21 +26,28 @@
  *===========================================================================*/
 
 /**
- * @brief USB HID interface descriptor
+ * @brief USB HID keyboard interface descriptor
  *
- * Defines the HID interface configuration including endpoint setup,
- * interface class (USB_CLASS_HID), and boot protocol settings.
- * This is interface 0 in the composite USB device.
+ * Interface 0 in the composite USB device: boot keyboard on the
+ * interrupt IN endpoint 0x81.
  */
-extern struct usb_interface_descriptor hid_iface;
+extern const struct usb_interface_descriptor hid_keyboard_iface;
 
 /**
- * @brief Configure the HID interface after USB enumeration
+ * @brief USB HID mouse interface descriptor
+ *
+ * Interface 1 in the composite USB device: boot mouse on the interrupt
+ * IN endpoint 0x82.
+ */
+extern const struct usb_interface_descriptor hid_mouse_iface;
+
+/**
+ * @brief Configure the HID interfaces after USB enumeration
  *
  * This function is called when the USB host sets the device configuration.
- * It sets up the HID endpoint (0x81) and registers the control request
- * callback for handling HID-specific USB requests (e.g., GET_DESCRIPTOR
- * for the HID report descriptor).
+ * It sets up the HID endpoints (0x81 keyboard, 0x82 mouse) and registers
+ * the control request callbacks for handling HID-specific USB requests
+ * (e.g., GET_DESCRIPTOR for the HID report descriptors).
  *
  * @param dev    Pointer to the USB device instance
  * @param wValue Configuration value selected by the host (unused)
@@ -50,17 +57,81 @@ extern struct usb_interface_descriptor hid_iface;
  */
 extern void hid_set_config(usbd_device *dev, uint16_t wValue);
 
+/**
+ * @brief Append one report to the HID transmit queue without blocking
+ *
+ * The report is copied into the RAM ring buffer of the interface its
+ * report ID selects, and sent on that interface's endpoint as soon as
+ * the host has read all reports queued there before. The report ID is
+ * not sent.
+ *
+ * @param report Report bytes, starting with REPORT_ID_KEYBOARD or
+ *               REPORT_ID_MOUSE
+ * @param len    Report length (5 for mouse, 9 for keyboard)
+ *
+ * @return true if the report was queued, false if the queue is full
+ */
+extern bool hid_queue_report(const void *report, uint16_t len);
+
+/**
+ * @brief Check whether a transmit queue has no free slot
+ *
+ * @param report_id REPORT_ID_KEYBOARD or REPORT_ID_MOUSE
+ *
+ * @return true if hid_queue_report() would fail for such a report
+ */
+extern bool hid_queue_full(uint8_t report_id);
+
+/**
+ * @brief Check whether every report queued on an interface has been
+ *        read by the host
+ *
+ * @param report_id REPORT_ID_KEYBOARD or REPORT_ID_MOUSE
+ *
+ * @return true if that queue is empty and its endpoint buffer is free
+ */
+extern bool hid_tx_idle(uint8_t report_id);
+
+/**
+ * @brief Keyboard LED state last set by the host
+ *
+ * Updated from the keyboard LED output report the host sends with a
+ * SET_REPORT request whenever Num/Caps/Scroll Lock change on any of
+ * its keyboards.
+ *
+ * @return HID_LED_* bits, 0 until the host has sent a report
+ */
+extern uint8_t hid_leds(void);
+
+/*============================================================================
+ * Keyboard LED Bits
+ *===========================================================================*/
+
+/**
+ * @defgroup KeyboardLEDs Keyboard output report bits
+ * @brief Bits of hid_leds(), matching the LED usages in the report descriptor
+ * @{
+ */
+#define HID_LED_NUM_LOCK	0x01  /**< Num Lock */
+#define HID_LED_CAPS_LOCK	0x02  /**< Caps Lock */
+#define HID_LED_SCROLL_LOCK	0x04  /**< Scroll Lock */
+#define HID_LED_COMPOSE		0x08  /**< Compose */
+#define HID_LED_KANA		0x10  /**< Kana */
+/** @} */
+
 /*============================================================================
  * Report ID Constants
  *===========================================================================*/
 
 /**
- * @defgroup ReportIDs USB HID Report IDs
+ * @defgroup ReportIDs HID Report IDs
  * @brief Report IDs for composite HID device
  *
- * These report IDs prefix each HID report to distinguish between
- * keyboard and mouse data. The host uses these IDs to route data
- * to the appropriate input device driver.
+ * These report IDs prefix each report in a payload and each report
+ * passed to hid_queue_report(), to distinguish between keyboard and
+ * mouse data. They select the HID interface the report is sent on;
+ * the reports on the wire carry no ID, since each interface has only
+ * one report type.
  * @{
  */
 
@@ -108,7 +179,7 @@ extern void hid_set_config(usbd_device *dev, uint16_t wValue);
  *
  * Indicates a timing delay in the script execution. The delay duration
  * in milliseconds is stored in the first padding byte (padding[0]).
- * Execution pauses for the specified number of SysTick timer intervals.
+ * Execution pauses for the specified number of milliseconds.
  */
 #define REPORT_ID_DELAY		254
 
@@ -293,36 +364,29 @@ struct composite_report {
 #ifdef INCLUDE_PACKET_DESCRIPTOR /* Included only in hid.c to avoid duplicate symbols */
 
 /**
- * @brief USB HID Report Descriptor
+ * @brief Keyboard interface report descriptor
  *
  * This descriptor tells the USB host the format and capabilities of the
- * HID reports this device sends. It defines a composite device with:
- *
- * 1. **Keyboard (Report ID 1)**: Boot-compatible keyboard
+ * reports the keyboard interface sends: the boot keyboard layout, so
+ * the same reports work in report and boot protocol.
  *    - 8-bit modifier byte (Ctrl, Shift, Alt, GUI keys)
  *    - 1 reserved byte
  *    - 6-byte key array (6-key rollover)
- *    - 1-byte LED output for indicators
+ *    - 1-byte LED output for indicators (see hid_leds())
  *
- * 2. **Mouse (Report ID 2)**: 3-button mouse with scroll wheel
- *    - 3 button bits + 5 padding bits
- *    - 8-bit relative X movement (-127 to +127)
- *    - 8-bit relative Y movement (-127 to +127)
- *    - 8-bit scroll wheel
- *    - Motion wakeup feature for power management
+ * There is no report ID: the interface has a single input report.
  *
- * @note This descriptor MUST match the composite_report structure layout
- *       for correct operation.
+ * @note This descriptor MUST match the keyboard member of the
+ *       composite_report structure (after the report ID).
  *
  * @see http://eleccelerator.com/tutorial-about-usb-hid-report-descriptors/
  * @see http://eleccelerator.com/usbdescreqparser/
- * @see USB HID Specification 1.11
+ * @see USB HID Specification 1.11, Appendix B.1
  */
-static const uint8_t hid_report_descriptor[] = {
+static const uint8_t hid_keyboard_report_descriptor[] = {
 	0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
 	0x09, 0x06,        // Usage (Keyboard)
 	0xA1, 0x01,        // Collection (Application)
-	0x85, 0x01,        //   Report ID (1)
 	0x05, 0x07,        //   Usage Page (Kbrd/Keypad)
 	0x19, 0xE0,        //   Usage Minimum (0xE0)
 	0x29, 0xE7,        //   Usage Maximum (0xE7)
@@ -350,10 +414,30 @@ static const uint8_t hid_report_descriptor[] = {
 	0x95, 0x03,        //   Report Count (3)
 	0x91, 0x01,        //   Output (Const,Array,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
 	0xC0,              // End Collection
+};
+
+/**
+ * @brief Mouse interface report descriptor
+ *
+ * 3-button mouse with scroll wheel, starting with the boot mouse
+ * fields:
+ *    - 3 button bits + 5 padding bits
+ *    - 8-bit relative X movement (-127 to +127)
+ *    - 8-bit relative Y movement (-127 to +127)
+ *    - 8-bit scroll wheel
+ *    - Motion wakeup feature for power management
+ *
+ * There is no report ID: the interface has a single input report.
+ *
+ * @note This descriptor MUST match the mouse member of the
+ *       composite_report structure (after the report ID).
+ *
+ * @see USB HID Specification 1.11, Appendix B.2
+ */
+static const uint8_t hid_mouse_report_descriptor[] = {
 	0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
 	0x09, 0x02,        // Usage (Mouse)
 	0xA1, 0x01,        // Collection (Application)
-	0x85, 0x02,        //   Report ID (2)
 	0x09, 0x01,        //   Usage (Pointer)
 	0xA1, 0x00,        //   Collection (Physical)
 	0x05, 0x09,        //     Usage Page (Button)
@@ -0,0 +1,420 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file bench.c
+ * @brief Host micro-benchmarks for the converter and the engine
+ *
+ * Built and run with `make bench` in src/. Reports:
+ *
+ * - **Conversion**: convert_ducky_binary() records per second, and the
+ *   hexify() / unhexify() throughput of the serial protocol
+ * - **Playback**: the same text stored in each payload format, played
+ *   once through the real engine and HID queues against the simulated
+ *   host (host.h): payload bytes, flash erases to store it, reports sent,
+ *   simulated time, reports per simulated ms and host time per
+ *   engine_poll() call
+ * - **Rewrites**: two of those payloads stored again under their name,
+ *   once unchanged and once with one character edited. They go back
+ *   into their own extent, which already holds them, so the erases
+ *   column shows what the skip-unchanged writer saves
+ *
+ * The simulated host reads each endpoint every HID_INTERVAL_MS, so the
+ * playback numbers are the ones a firmware built with the same
+ * HID_INTERVAL_MS gets on a host that honours bInterval. Every pass is
+ * also checked to type every character of the text once; the program
+ * exits with status 1 if one does not.
+ *
+ * @see host.h for the simulated board
+ * @license LGPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ducky.h"
+#include "engine.h"
+#include "hex_utils.h"
+#include "hid.h"
+#include "host.h"
+#include "keymap.h"
+#include "payload.h"
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+/** @brief Text line typed by the playback benchmarks */
+#define BENCH_LINE "The quick brown fox jumps over the lazy dog 0123456789.\n"
+
+/** @brief Lines of text; at 32 bytes per character in legacy format it takes most of user_data */
+#define BENCH_LINES 40
+
+/** @brief Characters typed per pass */
+#define BENCH_TEXT_LEN ((sizeof(BENCH_LINE) - 1) * BENCH_LINES)
+
+/** @brief Give up on a pass after this much simulated time */
+#define BENCH_PASS_LIMIT_MS (10 * 60 * 1000)
+
+/** @brief Run each throughput loop for at least this long */
+#define BENCH_MIN_NS 200000000ull
+
+/** @brief DuckyScript words converted per call */
+#define BENCH_DUCKY_WORDS 4096
+
+/** @brief Bytes per hexify() / unhexify() call */
+#define BENCH_HEX_BYTES 4096
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+/** @brief Text typed by the playback benchmarks */
+static char bench_text[BENCH_TEXT_LEN + 1];
+
+/** @brief Payload being built */
+static uint8_t bench_payload[PAYLOAD_CAPACITY];
+
+/**
+ * @brief Counters of one playback pass, filled in by bench_reader()
+ */
+struct bench_run {
+	uint32_t bytes;       /**< Payload length */
+	uint32_t erases;      /**< Flash pages erased to store it */
+	uint32_t reports;     /**< Reports the host read */
+	uint32_t keys;        /**< Key presses the host saw */
+	uint32_t ms;          /**< Simulated time of the pass */
+	uint64_t polls;       /**< engine_poll() calls */
+	uint64_t poll_ns;     /**< Host time spent in them */
+};
+
+static struct bench_run bench_run;
+
+/** @brief Keys down in the last keyboard report the host read */
+static uint8_t bench_keys_down[6];
+
+/** @brief Keeps results alive so the compiler cannot drop the work */
+static volatile uint32_t bench_sink;
+
+/*============================================================================
+ * Helpers
+ *===========================================================================*/
+
+/**
+ * @brief Monotonic host time in ns
+ */
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Count the reports the host reads and the keys that go down
+ *
+ * A key counts as pressed when it is in a keyboard report but was not in
+ * the one before, which is how the host sees it too.
+ */
+static void bench_reader(uint8_t ep, const uint8_t *data, uint16_t len)
+{
+	++bench_run.reports;
+	if (ep != 0x81 || len < 8)
+		return;
+
+	for (int i = 2; i < 8; ++i)
+		if (data[i] && !memchr(bench_keys_down, data[i], sizeof(bench_keys_down)))
+			++bench_run.keys;
+	memcpy(bench_keys_down, &data[2], sizeof(bench_keys_down));
+}
+
+/**
+ * @brief Write a compact payload header
+ *
+ * @return Number of bytes written
+ */
+static uint32_t bench_header(uint8_t *out, uint8_t flags)
+{
+	out[0] = PAYLOAD_MAGIC0;
+	out[1] = PAYLOAD_MAGIC1;
+	out[2] = PAYLOAD_VERSION;
+	out[3] = flags;
+	return sizeof(struct payload_header);
+}
+
+/*============================================================================
+ * Payload Builders
+ *===========================================================================*/
+
+/**
+ * @brief Text as legacy 16-byte records: press and release per character
+ */
+static uint32_t bench_build_legacy(uint8_t *out)
+{
+	struct composite_report *r = (struct composite_report *)out;
+
+	for (const char *c = bench_text; *c; ++c) {
+		memset(r, 0, 2 * sizeof(*r));
+		r[0].report_id = REPORT_ID_KEYBOARD;
+		keymap_lookup(KEYMAP_LAYOUT_US, (uint8_t)*c,
+			      &r[0].keyboard.modifiers, &r[0].keyboard.keys_down[0]);
+		r[1].report_id = REPORT_ID_KEYBOARD;
+		r += 2;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->report_id = REPORT_ID_END;
+	return (uint8_t *)(r + 1) - out;
+}
+
+/**
+ * @brief Text as compiled DuckyScript, converted to OP_TAP records the
+ *        way the 'd' command does
+ */
+static uint32_t bench_build_ducky(uint8_t *out, uint8_t flags)
+{
+	static uint8_t words[2 * BENCH_TEXT_LEN];
+	int len = 0;
+
+	for (const char *c = bench_text; *c; ++c) {
+		uint8_t modifiers, keycode;
+
+		keymap_lookup(KEYMAP_LAYOUT_US, (uint8_t)*c, &modifiers, &keycode);
+		words[len++] = keycode;
+		words[len++] = modifiers;
+	}
+
+	uint32_t n = bench_header(out, flags);
+
+	return n + convert_ducky_binary(words, len, &out[n]);
+}
+
+/**
+ * @brief Text as OP_STRING records of up to 255 bytes
+ */
+static uint32_t bench_build_string(uint8_t *out)
+{
+	uint32_t n = bench_header(out, 0);
+
+	for (uint32_t i = 0; i < BENCH_TEXT_LEN; ) {
+		uint32_t len = BENCH_TEXT_LEN - i;
+
+		if (len > 255)
+			len = 255;
+		out[n++] = OP_STRING;
+		out[n++] = KEYMAP_LAYOUT_US;
+		out[n++] = len;
+		memcpy(&out[n], &bench_text[i], len);
+		n += len;
+		i += len;
+	}
+
+	out[n++] = OP_END;
+	return n;
+}
+
+/**
+ * @brief One OP_MOVE: 1000 px to the right over 500 ms, then 100 ms still
+ *
+ * The delay keeps the engine at the end of the pass for a moment;
+ * without it the restart would happen within the same engine_poll()
+ * and bench_play() could not see it.
+ */
+static uint32_t bench_build_move(uint8_t *out)
+{
+	static const uint8_t move[] = {
+		OP_MOVE, 0, 0xE8, 0x03, 0x00, 0x00, 0xF4, 0x01, MOVE_CURVE_LINEAR,
+		OP_DELAY, 100,
+		OP_END,
+	};
+	uint32_t n = bench_header(out, 0);
+
+	memcpy(&out[n], move, sizeof(move));
+	return n + sizeof(move);
+}
+
+/*============================================================================
+ * Benchmarks
+ *===========================================================================*/
+
+/**
+ * @brief Store a payload in flash and play it once
+ *
+ * The payload is stored under the name slot, so storing another one
+ * with the same name rewrites it.
+ * Runs the main loop the way the firmware does: engine_poll() until the
+ * engine waits, then one simulated millisecond, with the host reading
+ * the endpoints every HID_INTERVAL_MS. The pass ends when the engine
+ * starts over; the host then reads what is still queued.
+ *
+ * @return true if the pass completed within BENCH_PASS_LIMIT_MS
+ */
+static bool bench_play(const uint8_t *payload, uint32_t len, const char *slot)
+{
+	struct payload_writer writer;
+	uint32_t erases = host_flash_erases();
+
+	memset(&bench_run, 0, sizeof(bench_run));
+	memset(bench_keys_down, 0, sizeof(bench_keys_down));
+	bench_run.bytes = len;
+
+	payload_set_name(payload_name_hash(slot, strlen(slot)));
+	payload_begin(&writer, PAYLOAD_TARGET_FLASH, len);
+	payload_write(&writer, payload, len);
+	if (payload_commit(&writer) != RESULT_OK)
+		return false;
+	bench_run.erases = host_flash_erases() - erases;
+
+	engine_init();
+
+	uint32_t start = host_time();
+	uint32_t last = engine_index();
+	bool wrapped = false;
+
+	while (!wrapped) {
+		if (host_time() - start >= BENCH_PASS_LIMIT_MS)
+			return false;
+
+		while (!wrapped && !engine_idle()) {
+			uint64_t t0 = bench_ns();
+
+			engine_poll();
+			bench_run.poll_ns += bench_ns() - t0;
+			++bench_run.polls;
+			wrapped = engine_index() < last;
+			last = engine_index();
+		}
+
+		host_tick();
+		if (host_time() % HID_INTERVAL_MS == 0)
+			host_usb_poll();
+	}
+
+	/* Hold the next pass back while the host reads the rest of this one */
+	engine_set_paused(true);
+	while (!hid_tx_idle(REPORT_ID_KEYBOARD) || !hid_tx_idle(REPORT_ID_MOUSE)) {
+		host_tick();
+		if (host_time() % HID_INTERVAL_MS == 0)
+			host_usb_poll();
+	}
+
+	bench_run.ms = host_time() - start;
+	return true;
+}
+
+/**
+ * @brief Play one payload and print its table row
+ *
+ * @param name  Row label
+ * @param slot  Name the payload is stored under
+ * @param len   Payload length in bench_payload
+ * @param text  The payload types bench_text (checked, and bytes/char shown)
+ *
+ * @return true if the pass completed and typed the whole text
+ */
+static bool bench_playback(const char *name, const char *slot, uint32_t len, bool text)
+{
+	bool ok = bench_play(bench_payload, len, slot);
+
+	if (text && bench_run.keys != BENCH_TEXT_LEN)
+		ok = false;
+
+	printf("  %-14s %6u", name, bench_run.bytes);
+	if (text)
+		printf(" %10.2f", (double)bench_run.bytes / BENCH_TEXT_LEN);
+	else
+		printf(" %10s", "-");
+	printf(" %7u %8u %8u %10.3f %8.0f%s\n",
+	       bench_run.erases, bench_run.reports, bench_run.ms,
+	       bench_run.ms ? (double)bench_run.reports / bench_run.ms : 0.0,
+	       bench_run.polls ? (double)bench_run.poll_ns / bench_run.polls : 0.0,
+	       ok ? "" : "  FAIL");
+	return ok;
+}
+
+/**
+ * @brief Conversion and hex codec throughput
+ */
+static void bench_conversion(void)
+{
+	static uint8_t words[2 * BENCH_DUCKY_WORDS];
+	static uint8_t records[3 * BENCH_DUCKY_WORDS + 1];
+	static uint8_t bytes[BENCH_HEX_BYTES];
+	static char hex[2 * BENCH_HEX_BYTES + 1];
+	uint64_t start, elapsed, calls;
+
+	/* Mostly taps with and without Shift, a delay every 16 words */
+	for (int i = 0; i < BENCH_DUCKY_WORDS; ++i) {
+		words[2 * i] = (i % 16 == 15) ? 0 : 4 + i % 36;
+		words[2 * i + 1] = (i % 16 == 15) ? 100 : (i % 5 == 0) * KEYMAP_MOD_SHIFT;
+	}
+	for (int i = 0; i < BENCH_HEX_BYTES; ++i)
+		bytes[i] = i * 7;
+
+	printf("conversion\n");
+
+	start = bench_ns();
+	for (calls = 0; (elapsed = bench_ns() - start) < BENCH_MIN_NS; ++calls)
+		bench_sink += convert_ducky_binary(words, sizeof(words), records);
+	printf("  %-18s %12.0f records/s\n", "convert_ducky_binary",
+	       calls * BENCH_DUCKY_WORDS * 1e9 / elapsed);
+
+	start = bench_ns();
+	for (calls = 0; (elapsed = bench_ns() - start) < BENCH_MIN_NS; ++calls)
+		bench_sink += hexify(hex, bytes, sizeof(bytes))[0];
+	printf("  %-18s %12.0f bytes/s\n", "hexify",
+	       calls * BENCH_HEX_BYTES * 1e9 / elapsed);
+
+	start = bench_ns();
+	for (calls = 0; (elapsed = bench_ns() - start) < BENCH_MIN_NS; ++calls)
+		bench_sink += ((uint8_t *)unhexify(bytes, hex, sizeof(bytes)))[sizeof(bytes) - 1];
+	printf("  %-18s %12.0f bytes/s\n", "unhexify",
+	       calls * BENCH_HEX_BYTES * 1e9 / elapsed);
+}
+
+/*============================================================================
+ * Main
+ *===========================================================================*/
+
+int main(void)
+{
+	bool ok = true;
+
+	for (int i = 0; i < BENCH_LINES; ++i)
+		memcpy(&bench_text[i * (sizeof(BENCH_LINE) - 1)], BENCH_LINE, sizeof(BENCH_LINE) - 1);
+
+	printf("pill_duck host benchmark, HID_INTERVAL_MS=%d\n\n", HID_INTERVAL_MS);
+
+	bench_conversion();
+
+	/* Fresh device: erased flash, configured by the host */
+	host_flash_reset();
+	payload_init();
+	host_usb_set_reader(bench_reader);
+	hid_set_config(host_usbd(), 1);
+	engine_set_online(true);
+
+	printf("\nplayback, %u characters of text or one mouse move, one pass\n",
+	       (unsigned)BENCH_TEXT_LEN);
+	printf("  %-14s %6s %10s %7s %8s %8s %10s %8s\n", "format", "bytes",
+	       "bytes/char", "erases", "reports", "sim ms", "reports/ms", "ns/poll");
+
+	ok &= bench_playback("legacy", "legacy", bench_build_legacy(bench_payload), true);
+	ok &= bench_playback("tap", "tap", bench_build_ducky(bench_payload, 0), true);
+	ok &= bench_playback("tap, packed", "packed", bench_build_ducky(bench_payload, PAYLOAD_FLAG_PACK), true);
+	ok &= bench_playback("string", "string", bench_build_string(bench_payload), true);
+	ok &= bench_playback("move", "move", bench_build_move(bench_payload), false);
+
+	/*
+	 * Neither is the selected payload when it is rewritten, so both go
+	 * back into their own extent: besides the header page, only pages
+	 * that differ are erased
+	 */
+	printf("\nrewrite under the same name\n");
+	ok &= bench_playback("legacy, same", "legacy", bench_build_legacy(bench_payload), true);
+	bench_text[BENCH_TEXT_LEN - 2] = '!';
+	ok &= bench_playback("tap, 1 edit", "tap", bench_build_ducky(bench_payload, 0), true);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,44 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file board.c
+ * @brief GPIO, NVIC and DWT stand-ins for the host build
+ *
+ * @see host.h for the simulation interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/gpio.h>
+
+/*============================================================================
+ * Public State
+ *===========================================================================*/
+
+volatile uint32_t DWT_CYCCNT;
+
+/*============================================================================
+ * libopencm3 Functions
+ *===========================================================================*/
+
+bool dwt_enable_cycle_counter(void)
+{
+	return true;
+}
+
+/* No interrupts on the host: USB callbacks run from host_usb_poll() */
+void nvic_enable_irq(uint8_t irqn)
+{
+	(void)irqn;
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	(void)irqn;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+	(void)gpioport;
+	(void)gpios;
+}
@@ -0,0 +1,88 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file clock.c
+ * @brief Simulated playback clock for the host build
+ *
+ * Implements clock.h on a millisecond counter that only host_tick()
+ * advances. Alarms are deadlines on the playback clock, so pausing
+ * freezes them exactly like stopping TIM2 does.
+ *
+ * @see host.h for the simulation interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <libopencm3/cm3/dwt.h>
+
+#include "clock.h"
+#include "stats.h"
+#include "host.h"
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+static uint32_t host_ms;                      /**< Simulated time */
+static uint32_t clock_ms;                     /**< Playback clock, stops while paused */
+static bool clock_stopped;                    /**< clock_pause() in effect */
+static uint32_t clock_deadline[CLOCK_ALARMS]; /**< Expiry time of each alarm */
+static bool clock_armed[CLOCK_ALARMS];        /**< Alarm set and not yet expired */
+
+/*============================================================================
+ * clock.h Functions
+ *===========================================================================*/
+
+void clock_setup(void)
+{
+	clock_ms = 0;
+	clock_stopped = false;
+}
+
+uint32_t clock_now(void)
+{
+	return clock_ms;
+}
+
+void clock_alarm_start(uint8_t alarm, uint32_t ms)
+{
+	clock_deadline[alarm] = clock_ms + ms;
+	clock_armed[alarm] = ms != 0;
+}
+
+bool clock_alarm_pending(uint8_t alarm)
+{
+	if (clock_armed[alarm] && (int32_t)(clock_deadline[alarm] - clock_ms) <= 0)
+		clock_armed[alarm] = false;
+	return clock_armed[alarm];
+}
+
+void clock_alarm_cancel(uint8_t alarm)
+{
+	clock_armed[alarm] = false;
+}
+
+void clock_pause(void)
+{
+	clock_stopped = true;
+}
+
+void clock_resume(void)
+{
+	clock_stopped = false;
+}
+
+/*============================================================================
+ * Simulation Interface
+ *===========================================================================*/
+
+void host_tick(void)
+{
+	++host_ms;
+	if (!clock_stopped)
+		++clock_ms;
+	DWT_CYCCNT += STATS_CYCLES_PER_US * 1000;
+}
+
+uint32_t host_time(void)
+{
+	return host_ms;
+}
@@ -0,0 +1,227 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file flash.c
+ * @brief Simulated flash for the host build
+ *
+ * Implements flash.h on a RAM copy of user_data with the rules of NOR
+ * flash: erasing sets a whole page to 0xFF, programming can only clear
+ * bits, and programming a word that is not erased fails unless it is
+ * programmed to zero (flash_clear_word()). The streaming
+ * writer erases a page only when a word in it has to change, like the
+ * firmware's, so host_flash_erases() counts what the hardware would do.
+ *
+ * The firmware passes flash addresses around as uint32_t. The host
+ * binary is linked without PIE so user_data lies below 4 GB and its
+ * addresses survive the round trip.
+ *
+ * @see host.h for the simulation interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include "flash.h"
+#include "hid.h"
+#include "host.h"
+
+/*============================================================================
+ * Public State
+ *===========================================================================*/
+
+/**
+ * @brief The payload region, in RAM instead of flash
+ *
+ * Declared const by its users (payload.c), as the firmware's is; only
+ * this file writes to it.
+ */
+__attribute__((aligned(FLASH_PAGE_SIZE))) struct composite_report
+	user_data[USER_DATA_SIZE / sizeof(struct composite_report)];
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+static uint32_t host_erases;
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Pointer to a simulated flash word
+ */
+static uint32_t *flash_word(uint32_t address)
+{
+	return (uint32_t *)(uintptr_t)address;
+}
+
+/**
+ * @brief Check that a range lies inside user_data
+ */
+static bool flash_in_range(uint32_t address, uint32_t len)
+{
+	uint32_t base = (uint32_t)(uintptr_t)user_data;
+
+	return address >= base && address - base <= USER_DATA_SIZE &&
+	       len <= USER_DATA_SIZE - (address - base);
+}
+
+/**
+ * @brief Erase the page holding address
+ */
+static void flash_erase_page(uint32_t address)
+{
+	memset(flash_word(address & ~(FLASH_PAGE_SIZE - 1)), 0xFF, FLASH_PAGE_SIZE);
+	++host_erases;
+}
+
+/**
+ * @brief Program one word that must be erased
+ *
+ * @return RESULT_OK, or FLASH_WRONG_DATA_WRITTEN if it was not erased
+ */
+static uint32_t flash_program_word(uint32_t address, uint32_t word)
+{
+	uint32_t *p = flash_word(address);
+
+	if (*p != 0xFFFFFFFF && *p != word)
+		return FLASH_WRONG_DATA_WRITTEN;
+	*p = word;
+	return RESULT_OK;
+}
+
+/**
+ * @brief Write one word of a streaming session, erasing its page if needed
+ *
+ * The words already written to the page in this session are saved and
+ * programmed back after the erase, as in the firmware.
+ */
+static void flash_writer_word(struct flash_writer *writer, uint32_t word)
+{
+	uint32_t address = writer->cursor;
+	uint32_t current = *flash_word(address);
+
+	writer->cursor += 4;
+	if (writer->status != RESULT_OK || current == word)
+		return;
+
+	if (current != 0xFFFFFFFF && address >= writer->erased_end) {
+		uint32_t page = address & ~(FLASH_PAGE_SIZE - 1);
+		uint8_t saved[FLASH_PAGE_SIZE];
+		uint32_t keep = address - page;
+
+		memcpy(saved, flash_word(page), keep);
+		flash_erase_page(address);
+		memcpy(flash_word(page), saved, keep);
+		writer->erased_end = page + FLASH_PAGE_SIZE;
+	}
+
+	writer->status = flash_program_word(address, word);
+}
+
+/*============================================================================
+ * flash.h Functions
+ *===========================================================================*/
+
+uint32_t flash_writer_begin(struct flash_writer *writer, uint32_t start_address, uint32_t limit_address)
+{
+	writer->cursor = start_address;
+	writer->limit = limit_address;
+	writer->erased_end = start_address;
+	writer->pending_len = 0;
+	writer->status = RESULT_OK;
+
+	if (start_address % 4 || limit_address % 4 || limit_address < start_address ||
+	    !flash_in_range(start_address, limit_address - start_address))
+		writer->status = FLASH_OUT_OF_RANGE;
+	return writer->status;
+}
+
+uint32_t flash_writer_write(struct flash_writer *writer, const uint8_t *data, uint32_t len)
+{
+	while (len-- && writer->status == RESULT_OK) {
+		writer->pending[writer->pending_len++] = *data++;
+		if (writer->pending_len < 4)
+			continue;
+
+		writer->pending_len = 0;
+		if (writer->cursor >= writer->limit) {
+			writer->status = FLASH_OUT_OF_RANGE;
+			break;
+		}
+
+		uint32_t word;
+
+		memcpy(&word, writer->pending, 4);
+		flash_writer_word(writer, word);
+	}
+	return writer->status;
+}
+
+uint32_t flash_writer_finish(struct flash_writer *writer)
+{
+	if (writer->pending_len) {
+		static const uint8_t zero[3];
+
+		flash_writer_write(writer, zero, 4 - writer->pending_len);
+	}
+	return writer->status;
+}
+
+uint32_t flash_program_data(uint32_t start_address, uint8_t *input_data, uint32_t num_elements)
+{
+	struct flash_writer writer;
+
+	flash_writer_begin(&writer, start_address, start_address + ((num_elements + 3) & ~3u));
+	flash_writer_write(&writer, input_data, num_elements);
+	if (flash_writer_finish(&writer) != RESULT_OK)
+		return writer.status;
+
+	return memcmp(flash_word(start_address), input_data, num_elements) ?
+		FLASH_WRONG_DATA_WRITTEN : RESULT_OK;
+}
+
+uint32_t flash_program_erased(uint32_t start_address, const uint8_t *input_data, uint32_t num_elements)
+{
+	if (start_address % 4 || !flash_in_range(start_address, num_elements))
+		return FLASH_OUT_OF_RANGE;
+
+	for (uint32_t i = 0; i < num_elements; i += 4) {
+		uint32_t word = 0;
+
+		memcpy(&word, &input_data[i], num_elements - i < 4 ? num_elements - i : 4);
+		if (*flash_word(start_address + i) != 0xFFFFFFFF)
+			return FLASH_WRONG_DATA_WRITTEN;
+		flash_program_word(start_address + i, word);
+	}
+	return RESULT_OK;
+}
+
+uint32_t flash_clear_word(uint32_t address)
+{
+	if (address % 4 || !flash_in_range(address, 4))
+		return FLASH_OUT_OF_RANGE;
+
+	/* Clearing bits needs no erase: the hardware programs 0 over anything */
+	*flash_word(address) = 0;
+	return RESULT_OK;
+}
+
+void flash_read_data(uint32_t start_address, uint32_t num_elements, uint8_t *output_data)
+{
+	memcpy(output_data, flash_word(start_address), num_elements / 4 * 4);
+}
+
+/*============================================================================
+ * Simulation Interface
+ *===========================================================================*/
+
+void host_flash_reset(void)
+{
+	memset(user_data, 0xFF, sizeof(user_data));
+}
+
+uint32_t host_flash_erases(void)
+{
+	return host_erases;
+}
@@ -0,0 +1,97 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file host.h
+ * @brief Simulated board for the host build (`make host`)
+ *
+ * The host build compiles the engine, the payload library, the HID
+ * queues, the DuckyScript converter and the hex helpers unchanged, and
+ * replaces everything that touches hardware:
+ *
+ * | Firmware          | Host replacement                           |
+ * |-------------------|--------------------------------------------|
+ * | libopencm3 USB    | host/usbd.c: endpoint buffers read by host_usb_poll() |
+ * | flash.c           | host/flash.c: user_data in RAM, same writer API |
+ * | clock.c (TIM2)    | host/clock.c: time moves only in host_tick() |
+ * | GPIO, NVIC, DWT   | host/board.c                               |
+ *
+ * Nothing runs behind the caller's back: there are no interrupts. A
+ * simulation loop calls engine_poll() like the main loop does, and
+ * host_tick() and host_usb_poll() in place of the timer and the USB
+ * host.
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_H
+#define __HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/usb/usbd.h>
+
+/**
+ * @brief Called for every report the simulated host reads
+ *
+ * @param ep   Endpoint address (0x81 keyboard, 0x82 mouse)
+ * @param data Report bytes as sent on the wire
+ * @param len  Report length
+ */
+typedef void (*host_usb_reader)(uint8_t ep, const uint8_t *data, uint16_t len);
+
+/*============================================================================
+ * USB (host/usbd.c)
+ *===========================================================================*/
+
+/**
+ * @brief The simulated USB device, to pass to hid_set_config()
+ */
+usbd_device *host_usbd(void);
+
+/**
+ * @brief Let the host read every endpoint that holds a report
+ *
+ * Like one round of host polling: each full IN endpoint is emptied and
+ * its transfer-complete callback runs, which moves the next queued
+ * report into the endpoint buffer.
+ *
+ * @return Number of reports read
+ */
+uint32_t host_usb_poll(void);
+
+/**
+ * @brief Install the function that sees the reports read, NULL for none
+ */
+void host_usb_set_reader(host_usb_reader reader);
+
+/*============================================================================
+ * Clock (host/clock.c)
+ *===========================================================================*/
+
+/**
+ * @brief Advance simulated time by one millisecond
+ *
+ * Moves the playback clock (unless paused) and the DWT cycle counter.
+ */
+void host_tick(void);
+
+/**
+ * @brief Simulated milliseconds since start, paused or not
+ */
+uint32_t host_time(void);
+
+/*============================================================================
+ * Flash (host/flash.c)
+ *===========================================================================*/
+
+/**
+ * @brief Erase the whole simulated user_data region
+ */
+void host_flash_reset(void);
+
+/**
+ * @brief Number of page erases since start
+ */
+uint32_t host_flash_erases(void);
+
+#endif /* __HOST_H */
@@ -0,0 +1,22 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file dwt.h
+ * @brief Host build stand-in for libopencm3/cm3/dwt.h
+ *
+ * DWT_CYCCNT is a plain variable that the simulation advances by
+ * STATS_CYCLES_PER_US * 1000 per simulated millisecond (host/clock.c).
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_DWT_H
+#define __HOST_DWT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern volatile uint32_t DWT_CYCCNT;
+
+bool dwt_enable_cycle_counter(void);
+
+#endif /* __HOST_DWT_H */
@@ -0,0 +1,22 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file nvic.h
+ * @brief Host build stand-in for libopencm3/cm3/nvic.h
+ *
+ * The simulated USB device runs its callbacks from the main thread, so
+ * masking its interrupt does nothing (host/usbd.c).
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_NVIC_H
+#define __HOST_NVIC_H
+
+#include <stdint.h>
+
+#define NVIC_USB_LP_CAN_RX0_IRQ		20
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+
+#endif /* __HOST_NVIC_H */
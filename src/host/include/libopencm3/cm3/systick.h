@@ -0,0 +1,12 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file systick.h
+ * @brief Host build stand-in for libopencm3/cm3/systick.h (nothing used)
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_SYSTICK_H
+#define __HOST_SYSTICK_H
+
+#endif /* __HOST_SYSTICK_H */
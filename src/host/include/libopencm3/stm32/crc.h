@@ -0,0 +1,15 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file crc.h
+ * @brief Host build stand-in for libopencm3/stm32/crc.h
+ *
+ * There is no CRC unit on the host; crc.c falls back to its software
+ * CRC-32 when not built for ARM.
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_STM32_CRC_H
+#define __HOST_STM32_CRC_H
+
+#endif /* __HOST_STM32_CRC_H */
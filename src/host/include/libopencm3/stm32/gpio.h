@@ -0,0 +1,19 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file gpio.h
+ * @brief Host build stand-in for libopencm3/stm32/gpio.h
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_GPIO_H
+#define __HOST_GPIO_H
+
+#include <stdint.h>
+
+#define GPIOC				0x40011000
+#define GPIO13				(1 << 13)
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+
+#endif /* __HOST_GPIO_H */
@@ -0,0 +1,12 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file rcc.h
+ * @brief Host build stand-in for libopencm3/stm32/rcc.h (nothing used)
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_RCC_H
+#define __HOST_RCC_H
+
+#endif /* __HOST_RCC_H */
@@ -0,0 +1,31 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file hid.h
+ * @brief Host build stand-in for libopencm3/usb/hid.h
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_USB_HID_H
+#define __HOST_USB_HID_H
+
+#include <stdint.h>
+
+#define USB_CLASS_HID			3
+
+#define USB_DT_HID			0x21
+#define USB_DT_REPORT			0x22
+
+#define USB_HID_REQ_TYPE_SET_REPORT	0x09
+#define USB_HID_REQ_TYPE_SET_IDLE	0x0A
+#define USB_HID_REQ_TYPE_SET_PROTOCOL	0x0B
+
+struct usb_hid_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdHID;
+	uint8_t bCountryCode;
+	uint8_t bNumDescriptors;
+} __attribute__((packed));
+
+#endif /* __HOST_USB_HID_H */
@@ -0,0 +1,86 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file usbd.h
+ * @brief Host build stand-in for the libopencm3 USB device API
+ *
+ * Declares the subset of libopencm3/usb/usbd.h the host-built modules
+ * use, with the same names and layouts. The functions are implemented
+ * by the simulated USB device in host/usbd.c.
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __HOST_USBD_H
+#define __HOST_USBD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _usbd_device usbd_device;
+
+struct usb_setup_data {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+struct usb_endpoint_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bEndpointAddress;
+	uint8_t bmAttributes;
+	uint16_t wMaxPacketSize;
+	uint8_t bInterval;
+	const void *extra;
+	int extralen;
+};
+
+struct usb_interface_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bInterfaceNumber;
+	uint8_t bAlternateSetting;
+	uint8_t bNumEndpoints;
+	uint8_t bInterfaceClass;
+	uint8_t bInterfaceSubClass;
+	uint8_t bInterfaceProtocol;
+	uint8_t iInterface;
+	const struct usb_endpoint_descriptor *endpoint;
+	const void *extra;
+	int extralen;
+};
+
+#define USB_DT_INTERFACE		4
+#define USB_DT_ENDPOINT			5
+#define USB_DT_INTERFACE_SIZE		9
+#define USB_DT_ENDPOINT_SIZE		7
+
+#define USB_ENDPOINT_ATTR_INTERRUPT	3
+
+#define USB_REQ_GET_DESCRIPTOR		6
+
+#define USB_REQ_TYPE_STANDARD		0x00
+#define USB_REQ_TYPE_CLASS		0x20
+#define USB_REQ_TYPE_TYPE		0x60
+#define USB_REQ_TYPE_INTERFACE		0x01
+#define USB_REQ_TYPE_RECIPIENT		0x1F
+
+
+typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
+typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev,
+		struct usb_setup_data *req);
+typedef int (*usbd_control_callback)(usbd_device *usbd_dev,
+		struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+		usbd_control_complete_callback *complete);
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+		uint8_t type_mask, usbd_control_callback callback);
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+		uint16_t max_size, usbd_endpoint_callback callback);
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len);
+
+#endif /* __HOST_USBD_H */
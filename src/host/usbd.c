@@ -0,0 +1,117 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file usbd.c
+ * @brief Simulated USB device for the host build
+ *
+ * Each IN endpoint holds at most one packet, as in the USB peripheral:
+ * usbd_ep_write_packet() fails while the previous packet has not been
+ * read. host_usb_poll() plays the USB host and reads them.
+ *
+ * @see host.h for the simulation interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include "host.h"
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+/** @brief Number of endpoint addresses per direction */
+#define HOST_ENDPOINTS 8
+
+/** @brief Largest packet kept in an endpoint buffer */
+#define HOST_PACKET_SIZE 64
+
+/**
+ * @brief One IN endpoint
+ */
+struct host_endpoint {
+	usbd_endpoint_callback callback;  /**< Transfer-complete callback */
+	uint8_t data[HOST_PACKET_SIZE];   /**< Packet waiting to be read */
+	uint16_t len;                     /**< Its length */
+	bool full;                        /**< A packet is waiting */
+};
+
+struct _usbd_device {
+	struct host_endpoint in[HOST_ENDPOINTS];  /**< Indexed by endpoint number */
+};
+
+static usbd_device host_dev;
+static host_usb_reader host_reader;
+
+/*============================================================================
+ * libopencm3 Functions
+ *===========================================================================*/
+
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+		uint8_t type_mask, usbd_control_callback callback)
+{
+	(void)usbd_dev;
+	(void)type;
+	(void)type_mask;
+	(void)callback;
+	return 0;
+}
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
+		uint16_t max_size, usbd_endpoint_callback callback)
+{
+	struct host_endpoint *ep = &usbd_dev->in[addr & 0x7F];
+
+	(void)type;
+	(void)max_size;
+
+	ep->callback = callback;
+	ep->full = false;
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
+		const void *buf, uint16_t len)
+{
+	struct host_endpoint *ep = &usbd_dev->in[addr & 0x7F];
+
+	if (ep->full || len > HOST_PACKET_SIZE)
+		return 0;
+
+	memcpy(ep->data, buf, len);
+	ep->len = len;
+	ep->full = true;
+	return len;
+}
+
+/*============================================================================
+ * Simulation Interface
+ *===========================================================================*/
+
+usbd_device *host_usbd(void)
+{
+	return &host_dev;
+}
+
+uint32_t host_usb_poll(void)
+{
+	uint32_t reads = 0;
+
+	for (uint8_t i = 1; i < HOST_ENDPOINTS; ++i) {
+		struct host_endpoint *ep = &host_dev.in[i];
+
+		if (!ep->full)
+			continue;
+
+		ep->full = false;
+		++reads;
+		if (host_reader)
+			host_reader(0x80 | i, ep->data, ep->len);
+		if (ep->callback)
+			ep->callback(&host_dev, 0x80 | i);
+	}
+	return reads;
+}
+
+void host_usb_set_reader(host_usb_reader reader)
+{
+	host_reader = reader;
+}
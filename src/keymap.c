@@ -0,0 +1,233 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file keymap.c
+ * @brief Character to HID key tables for the supported keyboard layouts
+ *
+ * Each layout has a table for printable ASCII (0x20-0x7E), indexed by
+ * character, and a short list of non-ASCII characters that the layout
+ * has keys for. Characters a layout can only produce through dead keys
+ * (e.g. '^' and '`' on DE) are left out, since typing them would
+ * combine with the following character.
+ *
+ * @see keymap.h for the interface
+ * @license LGPL-3.0-or-later
+ */
+
+#include <stddef.h>
+
+#include "keymap.h"
+
+/*============================================================================
+ * Table Entries
+ *===========================================================================*/
+
+/**
+ * @brief One key: modifiers and usage ID
+ */
+struct keymap_key {
+	uint8_t modifiers;  /**< KEYMAP_MOD_* bits */
+	uint8_t keycode;    /**< HID usage ID, 0 if the character is not mapped */
+};
+
+/**
+ * @brief Non-ASCII character with a key on a layout
+ */
+struct keymap_extra {
+	uint16_t codepoint;     /**< Unicode code point */
+	struct keymap_key key;  /**< Key producing it */
+};
+
+/** @brief Key without modifiers */
+#define K(code) { 0, code }
+
+/** @brief Key with Shift */
+#define S(code) { KEYMAP_MOD_SHIFT, code }
+
+/** @brief Key with AltGr */
+#define G(code) { KEYMAP_MOD_ALTGR, code }
+
+/** @brief Character not available on the layout */
+#define NONE { 0, 0 }
+
+/** @brief First character in the ASCII tables */
+#define KEYMAP_ASCII_FIRST 0x20
+
+/** @brief Number of characters in the ASCII tables (0x20-0x7E) */
+#define KEYMAP_ASCII_COUNT 95
+
+/*============================================================================
+ * US
+ *===========================================================================*/
+
+static const struct keymap_key keymap_us[KEYMAP_ASCII_COUNT] = {
+	K(0x2C), S(0x1E), S(0x34), S(0x20), S(0x21), S(0x22), S(0x24), K(0x34),
+	S(0x26), S(0x27), S(0x25), S(0x2E), K(0x36), K(0x2D), K(0x37), K(0x38),
+	K(0x27), K(0x1E), K(0x1F), K(0x20), K(0x21), K(0x22), K(0x23), K(0x24),
+	K(0x25), K(0x26), S(0x33), K(0x33), S(0x36), K(0x2E), S(0x37), S(0x38),
+	S(0x1F), S(0x04), S(0x05), S(0x06), S(0x07), S(0x08), S(0x09), S(0x0A),
+	S(0x0B), S(0x0C), S(0x0D), S(0x0E), S(0x0F), S(0x10), S(0x11), S(0x12),
+	S(0x13), S(0x14), S(0x15), S(0x16), S(0x17), S(0x18), S(0x19), S(0x1A),
+	S(0x1B), S(0x1C), S(0x1D), K(0x2F), K(0x31), K(0x30), S(0x23), S(0x2D),
+	K(0x35), K(0x04), K(0x05), K(0x06), K(0x07), K(0x08), K(0x09), K(0x0A),
+	K(0x0B), K(0x0C), K(0x0D), K(0x0E), K(0x0F), K(0x10), K(0x11), K(0x12),
+	K(0x13), K(0x14), K(0x15), K(0x16), K(0x17), K(0x18), K(0x19), K(0x1A),
+	K(0x1B), K(0x1C), K(0x1D), S(0x2F), S(0x31), S(0x30), S(0x35),
+};
+
+/*============================================================================
+ * DE (QWERTZ)
+ *===========================================================================*/
+
+static const struct keymap_key keymap_de[KEYMAP_ASCII_COUNT] = {
+	K(0x2C), S(0x1E), S(0x1F), K(0x32), S(0x21), S(0x22), S(0x23), S(0x32),
+	S(0x25), S(0x26), S(0x30), K(0x30), K(0x36), K(0x38), K(0x37), S(0x24),
+	K(0x27), K(0x1E), K(0x1F), K(0x20), K(0x21), K(0x22), K(0x23), K(0x24),
+	K(0x25), K(0x26), S(0x37), S(0x36), K(0x64), S(0x27), S(0x64), S(0x2D),
+	G(0x14), S(0x04), S(0x05), S(0x06), S(0x07), S(0x08), S(0x09), S(0x0A),
+	S(0x0B), S(0x0C), S(0x0D), S(0x0E), S(0x0F), S(0x10), S(0x11), S(0x12),
+	S(0x13), S(0x14), S(0x15), S(0x16), S(0x17), S(0x18), S(0x19), S(0x1A),
+	S(0x1B), S(0x1D), S(0x1C), G(0x25), G(0x2D), G(0x26), NONE, S(0x38),
+	NONE, K(0x04), K(0x05), K(0x06), K(0x07), K(0x08), K(0x09), K(0x0A),
+	K(0x0B), K(0x0C), K(0x0D), K(0x0E), K(0x0F), K(0x10), K(0x11), K(0x12),
+	K(0x13), K(0x14), K(0x15), K(0x16), K(0x17), K(0x18), K(0x19), K(0x1A),
+	K(0x1B), K(0x1D), K(0x1C), G(0x24), G(0x64), G(0x27), G(0x30),
+};
+
+static const struct keymap_extra keymap_de_extra[] = {
+	{ 0x00A7, S(0x20) },  /* section sign */
+	{ 0x00B0, S(0x35) },  /* degree sign */
+	{ 0x00B2, G(0x1F) },  /* superscript two */
+	{ 0x00B3, G(0x20) },  /* superscript three */
+	{ 0x00B5, G(0x10) },  /* micro sign */
+	{ 0x00C4, S(0x34) },  /* A umlaut */
+	{ 0x00D6, S(0x33) },  /* O umlaut */
+	{ 0x00DC, S(0x2F) },  /* U umlaut */
+	{ 0x00DF, K(0x2D) },  /* sharp s */
+	{ 0x00E4, K(0x34) },  /* a umlaut */
+	{ 0x00F6, K(0x33) },  /* o umlaut */
+	{ 0x00FC, K(0x2F) },  /* u umlaut */
+	{ 0x20AC, G(0x08) },  /* euro sign */
+	{ 0, NONE },
+};
+
+/*============================================================================
+ * UK
+ *===========================================================================*/
+
+static const struct keymap_key keymap_uk[KEYMAP_ASCII_COUNT] = {
+	K(0x2C), S(0x1E), S(0x1F), K(0x32), S(0x21), S(0x22), S(0x24), K(0x34),
+	S(0x26), S(0x27), S(0x25), S(0x2E), K(0x36), K(0x2D), K(0x37), K(0x38),
+	K(0x27), K(0x1E), K(0x1F), K(0x20), K(0x21), K(0x22), K(0x23), K(0x24),
+	K(0x25), K(0x26), S(0x33), K(0x33), S(0x36), K(0x2E), S(0x37), S(0x38),
+	S(0x34), S(0x04), S(0x05), S(0x06), S(0x07), S(0x08), S(0x09), S(0x0A),
+	S(0x0B), S(0x0C), S(0x0D), S(0x0E), S(0x0F), S(0x10), S(0x11), S(0x12),
+	S(0x13), S(0x14), S(0x15), S(0x16), S(0x17), S(0x18), S(0x19), S(0x1A),
+	S(0x1B), S(0x1C), S(0x1D), K(0x2F), K(0x64), K(0x30), S(0x23), S(0x2D),
+	K(0x35), K(0x04), K(0x05), K(0x06), K(0x07), K(0x08), K(0x09), K(0x0A),
+	K(0x0B), K(0x0C), K(0x0D), K(0x0E), K(0x0F), K(0x10), K(0x11), K(0x12),
+	K(0x13), K(0x14), K(0x15), K(0x16), K(0x17), K(0x18), K(0x19), K(0x1A),
+	K(0x1B), K(0x1C), K(0x1D), S(0x2F), S(0x64), S(0x30), S(0x32),
+};
+
+static const struct keymap_extra keymap_uk_extra[] = {
+	{ 0x00A3, S(0x20) },  /* pound sign */
+	{ 0x00A6, G(0x35) },  /* broken bar */
+	{ 0x00AC, S(0x35) },  /* not sign */
+	{ 0x20AC, G(0x21) },  /* euro sign */
+	{ 0, NONE },
+};
+
+/*============================================================================
+ * Layout Table
+ *===========================================================================*/
+
+/**
+ * @brief Tables of one layout
+ */
+static const struct {
+	const struct keymap_key *ascii;     /**< Printable ASCII */
+	const struct keymap_extra *extra;   /**< Non-ASCII, terminated by codepoint 0 */
+} keymap_layouts[KEYMAP_LAYOUT_COUNT] = {
+	[KEYMAP_LAYOUT_US] = { keymap_us, NULL },
+	[KEYMAP_LAYOUT_DE] = { keymap_de, keymap_de_extra },
+	[KEYMAP_LAYOUT_UK] = { keymap_uk, keymap_uk_extra },
+};
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+int keymap_decode_utf8(const uint8_t *s, int len, uint32_t *codepoint)
+{
+	int n;
+
+	if (s[0] < 0x80) {
+		*codepoint = s[0];
+		return 1;
+	} else if ((s[0] & 0xE0) == 0xC0) {
+		*codepoint = s[0] & 0x1F;
+		n = 2;
+	} else if ((s[0] & 0xF0) == 0xE0) {
+		*codepoint = s[0] & 0x0F;
+		n = 3;
+	} else if ((s[0] & 0xF8) == 0xF0) {
+		*codepoint = s[0] & 0x07;
+		n = 4;
+	} else {
+		/* Stray continuation byte */
+		*codepoint = KEYMAP_INVALID;
+		return 1;
+	}
+
+	for (int i = 1; i < n; ++i) {
+		if (i >= len || (s[i] & 0xC0) != 0x80) {
+			/* Truncated sequence: skip the lead byte only */
+			*codepoint = KEYMAP_INVALID;
+			return 1;
+		}
+		*codepoint = (*codepoint << 6) | (s[i] & 0x3F);
+	}
+
+	return n;
+}
+
+bool keymap_lookup(uint8_t layout, uint32_t codepoint, uint8_t *modifiers, uint8_t *keycode)
+{
+	const struct keymap_key *key = NULL;
+
+	if (layout >= KEYMAP_LAYOUT_COUNT)
+		layout = KEYMAP_LAYOUT_US;
+
+	switch (codepoint) {
+	case '\b':
+		*modifiers = 0;
+		*keycode = 0x2A;  /* Backspace */
+		return true;
+	case '\t':
+		*modifiers = 0;
+		*keycode = 0x2B;  /* Tab */
+		return true;
+	case '\n':
+		*modifiers = 0;
+		*keycode = 0x28;  /* Enter */
+		return true;
+	}
+
+	if (codepoint >= KEYMAP_ASCII_FIRST && codepoint < KEYMAP_ASCII_FIRST + KEYMAP_ASCII_COUNT) {
+		key = &keymap_layouts[layout].ascii[codepoint - KEYMAP_ASCII_FIRST];
+	} else if (keymap_layouts[layout].extra) {
+		for (const struct keymap_extra *e = keymap_layouts[layout].extra; e->codepoint; ++e) {
+			if (e->codepoint == codepoint) {
+				key = &e->key;
+				break;
+			}
+		}
+	}
+
+	if (!key || key->keycode == 0)
+		return false;
+
+	*modifiers = key->modifiers;
+	*keycode = key->keycode;
+	return true;
+}
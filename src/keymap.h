@@ -0,0 +1,79 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file keymap.h
+ * @brief Character to HID key lookup for STRING records
+ *
+ * The host sees keystrokes, not characters, so the same text needs
+ * different keys depending on the keyboard layout the host is set to.
+ * STRING records carry plain text plus a layout ID and the engine maps
+ * each character through these tables when it types it.
+ *
+ * ## Layouts
+ *
+ * | ID | Layout           | Non-ASCII characters              |
+ * |----|------------------|-----------------------------------|
+ * | 0  | US               | -                                 |
+ * | 1  | DE (QWERTZ)      | ä ö ü Ä Ö Ü ß § ° € µ ² ³         |
+ * | 2  | UK               | £ ¬ ¦ €                           |
+ *
+ * All layouts also map '\\n' to Enter, '\\t' to Tab and '\\b' to
+ * Backspace. Characters without a key are skipped.
+ *
+ * @see keymap.c for the tables
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __KEYMAP_H
+#define __KEYMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** @brief Left Shift modifier bit */
+#define KEYMAP_MOD_SHIFT 0x02
+
+/** @brief Right Alt (AltGr) modifier bit */
+#define KEYMAP_MOD_ALTGR 0x40
+
+/** @brief Code point returned for malformed UTF-8 */
+#define KEYMAP_INVALID 0xFFFFFFFF
+
+/**
+ * @brief Layout IDs used in STRING records
+ */
+enum keymap_layout {
+	KEYMAP_LAYOUT_US = 0,  /**< US English */
+	KEYMAP_LAYOUT_DE = 1,  /**< German QWERTZ */
+	KEYMAP_LAYOUT_UK = 2,  /**< UK English */
+	KEYMAP_LAYOUT_COUNT,
+};
+
+/**
+ * @brief Decode one UTF-8 character
+ *
+ * Malformed or truncated sequences decode to KEYMAP_INVALID and consume
+ * a single byte, so decoding always makes progress.
+ *
+ * @param s         Text, at least one byte
+ * @param len       Bytes available at s
+ * @param codepoint Receives the code point
+ *
+ * @return Number of bytes consumed (1-4)
+ */
+int keymap_decode_utf8(const uint8_t *s, int len, uint32_t *codepoint);
+
+/**
+ * @brief Find the key that types a character
+ *
+ * Unknown layouts fall back to US.
+ *
+ * @param layout    Layout ID (enum keymap_layout)
+ * @param codepoint Unicode code point
+ * @param modifiers Receives the modifier byte
+ * @param keycode   Receives the HID usage ID
+ *
+ * @return true if the layout has a key for the character
+ */
+bool keymap_lookup(uint8_t layout, uint32_t codepoint, uint8_t *modifiers, uint8_t *keycode);
+
+#endif
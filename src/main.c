@@ -23,9 +23,12 @@
  * |   USB Host PC    |      |   Pill Duck      |
  * +------------------+      +------------------+
  * |                  |      |                  |
- * | HID Driver  <----+------+-> HID Interface  | (keyboard/mouse input)
+ * | HID Driver  <----+------+-> HID Keyboard   | (keyboard input)
  * |                  |      |   (Endpoint 0x81)|
  * |                  |      |                  |
+ * | HID Driver  <----+------+-> HID Mouse      | (mouse input)
+ * |                  |      |   (Endpoint 0x82)|
+ * |                  |      |                  |
  * | Serial Driver<---+------+-> CDC ACM        | (commands/responses)
  * |                  |      |   (Endpoint 0x03)|
  * |                  |      |                  |
@@ -40,16 +43,18 @@
  *
  * 1. System initialization (clock, GPIO, USB)
  * 2. Check if payload exists in flash (not REPORT_ID_END)
- * 3. If payload exists, start execution (paused=false)
- * 4. Main loop: Poll USB stack
- * 5. SysTick interrupt (1ms): Execute next HID report
+ * 3. If payload exists, start execution (engine_init())
+ * 4. USB interrupt: USB stack (usbd_poll()), enumeration, endpoints
+ * 5. Main loop: Run serial commands (cdcacm_poll()), queue HID reports
+ *    (engine_poll()), sleep in WFI while idle (idle_wait())
+ * 6. TIM2 compare interrupt: End of a payload delay (clock.c)
  *
  * ## Memory Map
  *
  * | Region      | Address          | Size   | Purpose            |
  * |-------------|------------------|--------|--------------------|
- * | Flash Code  | 0x08000000       | 8 KB   | Firmware           |
- * | Flash Data  | 0x08002000       | 120 KB | user_data (payload)|
+ * | Flash Code  | 0x08000000       | 32 KB  | Firmware           |
+ * | Flash Data  | 0x08008000       | 96 KB  | user_data (payload)|
  * | SRAM        | 0x20000000       | 20 KB  | Variables, stack   |
  *
  * @note Built using libopencm3 hardware abstraction library
@@ -83,8 +88,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
-#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/vector.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/usb/usbd.h>
@@ -92,10 +99,18 @@
 #include <libopencm3/usb/cdc.h>
 
 #include "cdcacm.h"
+#include "crc.h"
 #include "hid.h"
 #include "hex_utils.h"
 #include "version.h"
 #include "flash.h"
+#include "engine.h"
+#include "clock.h"
+#include "ducky.h"
+#include "payload.h"
+#include "ramfunc.h"
+#include "stats.h"
+#include "trace.h"
 
 /*============================================================================
  * Global Variables
@@ -151,24 +166,30 @@ const struct usb_device_descriptor dev_descr = {
  * @brief USB Interface array
  *
  * Defines all USB interfaces in the composite device:
- * - Interface 0: HID (keyboard/mouse)
- * - Interface 1: CDC ACM Communication (with IAD)
- * - Interface 2: CDC ACM Data
- *
- * The Interface Association Descriptor (uart_assoc) groups interfaces
- * 1 and 2 as a single CDC ACM function.
+ * - Interface 0: HID keyboard
+ * - Interface 1: HID mouse
+ * - Interface 2: CDC ACM Communication (with IAD)
+ * - Interface 3: CDC ACM Data
+ *
+ * Keyboard and mouse have an interface and endpoint each, so the host
+ * polls them independently. The Interface Association Descriptor
+ * (uart_assoc) groups interfaces 2 and 3 as a single CDC ACM function.
  */
 const struct usb_interface ifaces[] = {{
-	/* Interface 0: HID (keyboard/mouse) */
+	/* Interface 0: HID keyboard */
+	.num_altsetting = 1,
+	.altsetting = &hid_keyboard_iface,
+}, {
+	/* Interface 1: HID mouse */
 	.num_altsetting = 1,
-	.altsetting = &hid_iface,
+	.altsetting = &hid_mouse_iface,
 }, {
-	/* Interface 1: CDC Communication (with IAD for composite device) */
+	/* Interface 2: CDC Communication (with IAD for composite device) */
 	.num_altsetting = 1,
 	.iface_assoc = &uart_assoc,
 	.altsetting = uart_comm_iface,
 }, {
-	/* Interface 2: CDC Data */
+	/* Interface 3: CDC Data */
 	.num_altsetting = 1,
 	.altsetting = uart_data_iface,
 }};
@@ -189,7 +210,7 @@ const struct usb_config_descriptor config = {
 	.bLength = USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType = USB_DT_CONFIGURATION,
 	.wTotalLength = 0,                              /* Calculated by stack */
-	.bNumInterfaces = sizeof(ifaces)/sizeof(ifaces[0]), /* 3 interfaces */
+	.bNumInterfaces = sizeof(ifaces)/sizeof(ifaces[0]), /* 4 interfaces */
 	.bConfigurationValue = 1,                       /* Configuration 1 */
 	.iConfiguration = 0,                            /* No string descriptor */
 	.bmAttributes = 0xC0,                           /* Self-powered */
@@ -216,21 +237,6 @@ static const char *usb_strings[] = {
 	"Pill Duck UART Port", /* CDC interface (index 4) */
 };
 
-/*============================================================================
- * Execution State Variables
- *===========================================================================*/
-
-/**
- * @brief Current position in the HID report sequence
- *
- * Index into the user_data array, indicating which report will be
- * sent next by sys_tick_handler(). Incremented after each report
- * is transmitted, reset to 0 when REPORT_ID_END is encountered.
- *
- * This can be read via the '@' serial command and reset via 'z'.
- */
-static uint32_t report_index = 0;
-
 /*============================================================================
  * Flash Storage
  *===========================================================================*/
@@ -239,294 +245,275 @@ static uint32_t report_index = 0;
  * @brief Persistent storage for HID report payload in flash memory
  *
  * This array is placed in a dedicated flash section (.user_data) by
- * the linker script. It stores the sequence of HID reports that are
- * executed automatically on device startup.
+ * the linker script. It holds up to PAYLOAD_SLOT_COUNT payloads in
+ * extents of whole pages (see payload.h); the active slot holds the
+ * sequence of HID reports that is executed automatically on device
+ * startup.
  *
  * Memory characteristics:
- * - Located at 0x08002000 (after 8KB firmware area)
- * - Size: ~120KB (calculated from linker script)
+ * - Located at 0x08008000 (after 32KB firmware area)
+ * - Size: USER_DATA_SIZE (96KB, must match the linker script)
  * - Persists across power cycles
- * - Modified via 'w' or 'd' serial commands
+ * - Modified via 'w', 'd' or 'j' serial commands and binary uploads,
+ *   always into an extent other than the selected one
  *
  * @note The section attribute ensures this is placed in flash, not RAM.
- *       Reading is direct (memory-mapped), writing requires flash_program_data().
+ *       Reading is direct (memory-mapped), writing goes through
+ *       payload_begin() / payload_write() / payload_commit().
  *
- * @see flash_program_data() for writing
+ * @see payload_begin() for writing
  * @see bluepill.ld for memory layout
  */
 __attribute__((__section__(".user_data"))) const struct composite_report
-	user_data[sizeof(struct composite_report) / (128 - 8) * 1024];
+	user_data[USER_DATA_SIZE / sizeof(struct composite_report)];
 
 
 /**
- * @brief Temporary RAM buffer for report conversion
+ * @brief Temporary RAM buffer for payload generation
  *
- * Used to build HID reports in RAM before writing to flash.
- * Sized to fit one flash page (1KB) worth of reports.
+ * Used to build compact payload records (see payload.h) in RAM before
+ * writing to flash. Longer payloads are converted and streamed to flash
+ * one buffer at a time, so it only sets the batch size and is kept small:
+ * SRAM is shared with the RAM payload and the stack.
  *
  * Used by:
- * - convert_ducky_binary(): Converting DuckyScript to reports
+ * - convert_ducky_binary(): Converting DuckyScript to records
  * - add_mouse_jiggler(): Generating mouse movement pattern
  *
  * @note Must be in RAM since we can't write directly to flash.
  */
-static struct composite_report packet_buffer[1024 / sizeof(struct composite_report)] = {0};
+static uint8_t packet_buffer[256] = {0};
+
+/**
+ * @brief Write a compact payload header to the start of a buffer
+ *
+ * @param out   Destination, at least sizeof(struct payload_header) bytes
+ * @param flags PAYLOAD_FLAG_* bits
+ *
+ * @return Number of bytes written
+ */
+static int add_payload_header(uint8_t *out, uint8_t flags)
+{
+	struct payload_header *header = (struct payload_header *)out;
+
+	header->magic[0] = PAYLOAD_MAGIC0;
+	header->magic[1] = PAYLOAD_MAGIC1;
+	header->version = PAYLOAD_VERSION;
+	header->flags = flags;
+
+	return sizeof(*header);
+}
 
 /*============================================================================
  * DuckyScript Conversion
  *===========================================================================*/
 
 /**
- * @brief Convert compiled DuckyScript binary to USB HID reports
- *
- * Parses the binary format produced by the DuckyScript encoder and
- * generates corresponding USB HID keyboard reports. Each DuckyScript
- * instruction becomes one or two HID reports.
- *
- * ## DuckyScript Binary Format
- *
- * The compiled format consists of 16-bit little-endian words:
+ * @brief Most bytes write_ducky_binary() writes for an input length
  *
- * | Byte 0 (Low)    | Byte 1 (High) | Meaning                    |
- * |-----------------|---------------|----------------------------|
- * | 0x00            | delay_ms      | Delay for delay_ms ticks   |
- * | keycode         | modifiers     | Press key with modifiers   |
- *
- * ## Output Format
- *
- * For each keypress instruction, two reports are generated:
- * 1. Key press report (key down + modifiers)
- * 2. Key release report (all keys up)
- *
- * This ensures proper key event generation for the host OS.
- *
- * ## Modifier Byte Format
+ * The compact header, at most 3 bytes per 2-byte word and the end marker.
+ */
+static uint32_t ducky_binary_size(int len)
+{
+	return sizeof(struct payload_header) + (len + 1) / 2 * 3 + 1;
+}
+
+/**
+ * @brief Convert compiled DuckyScript and stream the result to flash
  *
- * | Bit | Modifier       |
- * |-----|----------------|
- * | 0   | Left Control   |
- * | 1   | Left Shift     |
- * | 2   | Left Alt       |
- * | 3   | Left GUI       |
- * | 4   | Right Control  |
- * | 5   | Right Shift    |
- * | 6   | Right Alt      |
- * | 7   | Right GUI      |
+ * Writes the compact payload header, then converts the input in
+ * packet_buffer-sized batches and appends each to the new payload, so
+ * a single 'd' upload may fill more than one page. The header sets
+ * PAYLOAD_FLAG_PACK so typed text goes out several keys per report.
  *
- * @param buf Input buffer containing compiled DuckyScript binary
- * @param len Length of input buffer in bytes
- * @param out Output buffer for composite_report structures
- *            Must have space for approximately len reports
+ * Each batch is converted with convert_ducky_binary(); the end marker it
+ * appends is dropped for every batch except the last one.
  *
- * @return Number of composite_report records written to out
+ * @param buf    Input buffer containing compiled DuckyScript binary
+ * @param len    Length of input buffer in bytes
+ * @param writer Payload write session from payload_begin(), sized with
+ *               ducky_binary_size()
  *
- * @note Input length is rounded down to even (16-bit boundary)
- * @note Output always ends with REPORT_ID_END marker
+ * @return RESULT_OK on success, otherwise a flash error code
  *
- * @see https://github.com/hak5darren/USB-Rubber-Ducky for DuckyScript
+ * @see convert_ducky_binary() for the conversion itself
  */
-int convert_ducky_binary(uint8_t *buf, int len, struct composite_report *out)
+static uint32_t write_ducky_binary(uint8_t *buf, int len, struct payload_writer *writer)
 {
-	int j = 0;
+	/* Each 2-byte word yields at most 3 bytes; keep room for the end marker */
+	const int batch_len = ((sizeof(packet_buffer) - 1) / 3) * 2;
+	int i = 0;
 
-	/* DuckyScript uses 16-bit words, ensure even length */
-	if ((len % 2) != 0) len -= 1;
+	int header_len = add_payload_header(packet_buffer, PAYLOAD_FLAG_PACK);
+	payload_write(writer, packet_buffer, header_len);
 
-	for (int i = 0; i < len; i += 2) {
-		/* Read 16-bit word (little-endian) */
-		uint16_t word = buf[i] | (buf[i + 1] << 8);
+	do {
+		int this_len = len - i;
+		if (this_len > batch_len) this_len = batch_len;
 
-		if ((word & 0xff) == 0) {
-			/* Special case: delay command (low byte = 0) */
-			/* High byte contains delay duration in ms */
-			out[j].report_id = REPORT_ID_DELAY;
-			out[j].padding[0] = word >> 8;
-			++j;
-			continue;
-		}
+		int bytes = convert_ducky_binary(&buf[i], this_len, packet_buffer);
+		i += this_len;
 
-		/* Key press report: press key with modifiers */
-		out[j].report_id = REPORT_ID_KEYBOARD;
-		out[j].keyboard.modifiers = word >> 8;    /* High byte: modifiers */
-		out[j].keyboard.reserved = 1;             /* Mark as converted */
-		out[j].keyboard.keys_down[0] = word & 0xff; /* Low byte: keycode */
-		out[j].keyboard.keys_down[1] = 0;
-		out[j].keyboard.keys_down[2] = 0;
-		out[j].keyboard.keys_down[3] = 0;
-		out[j].keyboard.keys_down[4] = 0;
-		out[j].keyboard.keys_down[5] = 0;
-		out[j].keyboard.leds = 0;
-		++j;
-
-		/* Key release report: all keys up */
-		out[j].report_id = REPORT_ID_KEYBOARD;
-		out[j].keyboard.modifiers = 0;
-		out[j].keyboard.reserved = 1;
-		out[j].keyboard.keys_down[0] = 0;
-		out[j].keyboard.keys_down[1] = 0;
-		out[j].keyboard.keys_down[2] = 0;
-		out[j].keyboard.keys_down[3] = 0;
-		out[j].keyboard.keys_down[4] = 0;
-		out[j].keyboard.keys_down[5] = 0;
-		out[j].keyboard.leds = 0;
-		++j;
-	}
+		/* Only the final batch keeps its OP_END marker */
+		if (i < len) --bytes;
 
-	/* Add end marker */
-	out[j].report_id = REPORT_ID_END;
-	++j;
+		payload_write(writer, packet_buffer, bytes);
+	} while (i < len);
 
-	return j;
+	return writer->flash.status;
 }
 
-/*============================================================================
- * Execution Control Variables
- *===========================================================================*/
-
 /**
- * @brief Execution paused flag
+ * @brief Store a payload held in a buffer
  *
- * When true, the sys_tick_handler() will not advance through reports.
- * Toggled via the 'p' serial command.
+ * Writes the buffer into a free slot, or the RAM payload, and
+ * selects it.
  *
- * Default: true (paused) unless user_data contains a payload
+ * @param data   Payload bytes
+ * @param len    Payload length
+ * @param target Destination
+ *
+ * @return RESULT_OK on success, otherwise a flash error code
  */
-static bool paused = true;
+static uint32_t write_payload(const uint8_t *data, uint32_t len, enum payload_target target)
+{
+	struct payload_writer writer;
+
+	payload_begin(&writer, target, len);
+	payload_write(&writer, data, len);
+	return payload_commit(&writer);
+}
 
 /**
- * @brief Single-step mode flag
+ * @brief Turn a flash result into a serial command response
+ *
+ * @param result Result from write_payload() or payload_commit()
  *
- * When true, execute exactly one report then pause.
- * Set via the 's' serial command, cleared after execution.
+ * @return Response string
  */
-static bool single_step = false;
+static char *flash_result_message(uint32_t result)
+{
+	if (result == RESULT_OK) {
+		return "wrote flash";
+	} else if (result == FLASH_WRONG_DATA_WRITTEN) {
+		return "wrong data written";
+	} else {
+		return "error writing flash";
+	}
+}
 
 /**
- * @brief Currently processing a delay
+ * @brief Append a 32-bit value as 8 big-endian hex digits
  *
- * When true, we're counting down delay_ticks_remaining.
- * No HID reports are sent during delays.
+ * @return Position after the digits
  */
-static bool delaying = false;
+static char *put_hex32(char *out, uint32_t value)
+{
+	uint8_t be[4] = { value >> 24, value >> 16, value >> 8, value };
+
+	hexify(out, be, sizeof(be));
+	return out + 8;
+}
 
 /**
- * @brief Remaining SysTick counts for current delay
+ * @brief Format the payload slot directory ('l' command)
+ *
+ * One line per valid slot: number, '*' if it is the one playing, then
+ * name hash, length, CRC-32 and the offset of its extent in user_data
+ * as big-endian hex.
  *
- * Decremented each SysTick interrupt. When reaches 0,
- * delay is complete and execution continues.
+ * @return Static NUL terminated string
  */
-static int delay_ticks_remaining = 0;
+static char *format_slot_list(void)
+{
+	static char text[PAYLOAD_SLOT_COUNT * sizeof("0* 00000000 00000000 00000000 00000000\r\n")];
+	struct payload_slot_header header;
+	char *out = text;
 
-/*============================================================================
- * Interrupt Handlers
- *===========================================================================*/
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot) {
+		if (!payload_slot_info(slot, &header))
+			continue;
+
+		*out++ = '0' + slot;
+		*out++ = (slot == payload_selected() && !payload_in_ram()) ? '*' : ' ';
+		*out++ = ' ';
+		out = put_hex32(out, header.name);
+		*out++ = ' ';
+		out = put_hex32(out, header.length);
+		*out++ = ' ';
+		out = put_hex32(out, header.crc);
+		*out++ = ' ';
+		out = put_hex32(out, header.offset);
+		*out++ = '\r';
+		*out++ = '\n';
+	}
+
+	if (out == text)
+		return "no payloads";
+
+	/* Drop the final line break, the console adds its own before the prompt */
+	out[-2] = '\0';
+	return text;
+}
 
 /**
- * @brief SysTick interrupt handler - HID report execution engine
- *
- * Called every 1ms by the SysTick timer. This is the core execution
- * engine that sends HID reports from flash memory to the USB host.
- *
- * ## State Machine
- *
- * ```
- * +--------+     start      +----------+    delay      +---------+
- * | PAUSED |--------------->| RUNNING  |-------------->| DELAY   |
- * +--------+                +----------+               +---------+
- *     ^                          |                          |
- *     |       'p' or 's'         v                          |
- *     +<--------------------send report                     |
- *     |                          |                          |
- *     |                    REPORT_ID_END                    |
- *     +<-----------------------reset                        |
- *                                ^                          |
- *                                |      count==0            |
- *                                +--------------------------+
- * ```
+ * @brief Start of a range read ('r' with an offset and length)
  *
- * ## Report Processing
- *
- * | Report ID          | Action                              |
- * |--------------------|-------------------------------------|
- * | REPORT_ID_NOP (0)  | Skip, don't advance index           |
- * | REPORT_ID_DELAY    | Start/continue delay countdown      |
- * | REPORT_ID_KEYBOARD | Send 9-byte keyboard report         |
- * | REPORT_ID_MOUSE    | Send 5-byte mouse report            |
- * | REPORT_ID_END      | Reset index to 0 (loop or stop)     |
+ * Followed by `length` raw bytes of user_data, then the CRC-32 of those
+ * bytes. All fields are little-endian, as in the trace dump.
+ */
+struct read_header {
+	uint8_t magic[2];   /**< 'R', 'D' */
+	uint16_t reserved;  /**< 0 */
+	uint32_t offset;    /**< Offset of the first byte in user_data */
+	uint32_t length;    /**< Data bytes that follow */
+} __attribute__((packed));
+
+/**
+ * @brief Stream part of user_data to the host ('r' command)
  *
- * ## Timing
+ * The bytes go straight from flash into the CDC transmit ring, which
+ * waits only while the host has not yet read the packets before them,
+ * so whole slots or the entire region can be backed up without hex
+ * encoding. The main loop, and with it playback, waits as well.
  *
- * - SysTick fires every 1ms (configured in setup_clock)
- * - Each keystroke takes 2 ticks (press + release reports)
- * - Delays are in milliseconds (1 tick = 1ms)
+ * The CRC is the zlib CRC-32 of the data bytes, computed by the CRC
+ * unit: for the payload bytes of a slot, the value 'l' lists. No prompt
+ * follows the CRC (see cdcacm_end_binary()).
  *
- * @note This function runs in interrupt context. Keep it fast!
- * @note The LED (PC13) toggles on each HID report sent.
+ * @param hex 16 hex digits: offset and length, each big-endian
  *
- * @see setup_clock() for SysTick configuration
- * @see user_data for the report source
+ * @return Response for the console: empty after the dump, or an error
+ *         message if the argument is not hex or the range does not lie
+ *         within user_data
  */
-void sys_tick_handler(void)
+static char *read_region(const char *hex)
 {
-	/* Check if execution is paused (and not single-stepping) */
-	if (paused && !single_step) return;
-
-	/* Read current report from flash */
-	struct composite_report report = user_data[report_index];
-	uint16_t len = 0;
-	uint8_t id = report.report_id;
-
-	/* Process based on report type */
-	if (id == REPORT_ID_NOP) {
-		/* No operation - skip without advancing index */
-		return;
-	} else if (id == REPORT_ID_DELAY) {
-		/* Handle delay command */
-		if (!delaying) {
-			/* Start new delay: load tick count from report */
-			delay_ticks_remaining = report.padding[0];
-			delaying = true;
-			return;
-		} else {
-			/* Continue existing delay: decrement counter */
-			--delay_ticks_remaining;
-			if (delay_ticks_remaining <= 0) {
-				/* Delay complete: advance to next report */
-				delaying = false;
-				++report_index;
-			}
-		}
-		return;
-	} else if (id == REPORT_ID_KEYBOARD) {
-		/* Keyboard report: 1 byte ID + 8 bytes data */
-		len = 9;
-	} else if (id == REPORT_ID_MOUSE) {
-		/* Mouse report: 1 byte ID + 4 bytes data */
-		len = 5;
-	} else {
-		/* Unknown ID (including REPORT_ID_END): reset to start */
-		report_index = 0;
-		return;
+	uint8_t be[8];
+
+	/* unhexify() does not validate, garbage must not become an offset */
+	for (int i = 0; i < 16; ++i) {
+		char c = hex[i];
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')))
+			return "bad range";
 	}
+	unhexify(be, hex, sizeof(be));
 
-	/* Send HID report to host via endpoint 0x81 */
-	/* Retry until endpoint buffer accepts the data */
-	uint16_t bytes_written = 0;
-	do {
-		bytes_written = usbd_ep_write_packet(usbd_dev, 0x81, &report, len);
-	} while (bytes_written == 0);
+	uint32_t offset = (uint32_t)be[0] << 24 | be[1] << 16 | be[2] << 8 | be[3];
+	uint32_t length = (uint32_t)be[4] << 24 | be[5] << 16 | be[6] << 8 | be[7];
 
-	/* Toggle LED to indicate activity */
-	gpio_toggle(GPIOC, GPIO13);
+	if (offset > USER_DATA_SIZE || length > USER_DATA_SIZE - offset)
+		return "bad range";
 
-	/* Handle single-step mode: pause after one report */
-	if (single_step) {
-		single_step = false;
-		paused = true;
-	}
+	const uint8_t *data = (const uint8_t *)user_data + offset;
+	struct read_header header = { { 'R', 'D' }, 0, offset, length };
+	uint32_t crc = crc32_hw(data, length);
 
-	/* Advance to next report */
-	++report_index;
+	cdcacm_write(&header, sizeof(header));
+	cdcacm_write(data, length);
+	cdcacm_write(&crc, sizeof(crc));
+	cdcacm_end_binary();
+	return "";
 }
 
 /*============================================================================
@@ -537,7 +524,8 @@ void sys_tick_handler(void)
  * @brief USB set configuration callback
  *
  * Called by the USB stack when the host sends SET_CONFIGURATION.
- * Initializes both the HID and CDC ACM interfaces.
+ * Initializes both the HID and CDC ACM interfaces and lets playback
+ * start (see engine_set_online()).
  *
  * @param dev    USB device instance
  * @param wValue Configuration number (always 1 for this device)
@@ -549,6 +537,21 @@ static void usb_set_config(usbd_device *dev, uint16_t wValue)
 {
 	hid_set_config(dev, wValue);
 	cdcacm_set_config(dev, wValue);
+
+	if (!stats.boot_config)
+		stats.boot_config = stats_cycles();
+	engine_set_online(true);
+}
+
+/**
+ * @brief USB bus reset callback
+ *
+ * The host drops the configuration on a bus reset, so playback holds
+ * until the next SET_CONFIGURATION.
+ */
+static void usb_reset(void)
+{
+	engine_set_online(false);
 }
 
 /*============================================================================
@@ -563,53 +566,51 @@ static void usb_set_config(usbd_device *dev, uint16_t wValue)
  * auto-lock from activating while maintaining cursor position.
  *
  * Pattern generated:
- * 1. Move right by 1 pixel, `width` times
- * 2. Move left by 1 pixel, `width` times
+ * 1. Move right by 1 pixel, looped `width` times
+ * 2. Move left by 1 pixel, looped `width` times
  * 3. End marker
  *
- * Net movement is zero, so cursor returns to original position.
+ * Net movement is zero, so cursor returns to original position. The
+ * payload is 25 bytes whatever the width.
  *
- * @param width Number of 1-pixel movements in each direction
- *              Total reports generated: (width * 2) + 1
+ * @param width Number of 1-pixel movements in each direction (1-65535)
  *
- * @return Number of composite_report records written to packet_buffer
+ * @return Number of bytes (compact header and records) written to
+ *         packet_buffer
  *
  * @note Output is written to the global packet_buffer array
  * @note The 'j' serial command uses width=30
  *
  * @code
  * // Generate jiggler and write to flash
- * int records = add_mouse_jiggler(30);
- * flash_program_data(&user_data, packet_buffer, records * sizeof(*packet_buffer));
+ * int len = add_mouse_jiggler(30);
+ * write_payload(packet_buffer, len, PAYLOAD_TARGET_FLASH);
  * @endcode
  */
 int add_mouse_jiggler(int width)
 {
-	int j = 0;
-
-	/* Generate rightward movements */
-	for (int i = 0; i < width; ++i) {
-		packet_buffer[j].report_id = REPORT_ID_MOUSE;
-		packet_buffer[j].mouse.buttons = 0;   /* No buttons pressed */
-		packet_buffer[j].mouse.x = 1;         /* Move right 1 pixel */
-		packet_buffer[j].mouse.y = 0;
-		packet_buffer[j].mouse.wheel = 0;
-		++j;
-	}
-
-	/* Generate leftward movements (return to start) */
-	for (int i = 0; i < width; ++i) {
-		packet_buffer[j].report_id = REPORT_ID_MOUSE;
-		packet_buffer[j].mouse.buttons = 0;
-		packet_buffer[j].mouse.x = -1;        /* Move left 1 pixel */
-		packet_buffer[j].mouse.y = 0;
-		packet_buffer[j].mouse.wheel = 0;
-		++j;
+	int j = add_payload_header(packet_buffer, 0);
+	int start;
+
+	/* Rightward movement, then leftward movement (return to start) */
+	for (int dx = 1; dx >= -1; dx -= 2) {
+		start = j;
+		packet_buffer[j++] = OP_MOUSE;
+		packet_buffer[j++] = 0;          /* No buttons pressed */
+		packet_buffer[j++] = (uint8_t)dx; /* Move 1 pixel */
+		packet_buffer[j++] = 0;          /* y */
+		packet_buffer[j++] = 0;          /* wheel */
+
+		/* Repeat the movement record width times */
+		packet_buffer[j++] = OP_LOOP;
+		packet_buffer[j++] = start & 0xff;
+		packet_buffer[j++] = start >> 8;
+		packet_buffer[j++] = width & 0xff;
+		packet_buffer[j++] = width >> 8;
 	}
 
 	/* Add end marker */
-	packet_buffer[j].report_id = REPORT_ID_END;
-	++j;
+	packet_buffer[j++] = OP_END;
 
 	return j;
 }
@@ -618,6 +619,9 @@ int add_mouse_jiggler(int width)
  * Serial Command Processing
  *===========================================================================*/
 
+/** @brief Largest payload taken as hex by 'w', 'd' and 'm' (bytes) */
+#define HEX_PAYLOAD_MAX	1024
+
 /**
  * @brief Process commands received over the serial interface
  *
@@ -630,14 +634,38 @@ int add_mouse_jiggler(int width)
  * |-----|--------------|------------------------------------------|
  * | v   | (none)       | Show firmware version                    |
  * | ?   | (none)       | Show help reference                      |
- * | w   | <hex_data>   | Write raw hex data directly to flash     |
+ * | w   | <hex_data>   | Write raw hex data (up to 1 KB) to flash |
  * | d   | <hex_data>   | Convert DuckyScript binary and store     |
  * | j   | (none)       | Generate and store mouse jiggler pattern |
- * | r   | (none)       | Read first 16 bytes of flash (hex)       |
+ * | m   | <hex_data>   | Load raw hex data into RAM and run it    |
+ * | c   | (none)       | Commit the RAM payload to flash          |
+ * | n   | <name>       | Name the next payload written to flash   |
+ * | l   | (none)       | List the payload slots and extents       |
+ * | x   | <slot>       | Select a payload slot and rewind         |
+ * | g   | <slot>       | Select a payload slot and run it         |
+ * | r   | (none)       | Read first 16 bytes of payload (hex)     |
+ * | r   | <off><len>   | Binary user_data range + CRC, no prompt  |
+ * | k   | (none)       | CRC-32 and length of the active payload  |
  * | @   | (none)       | Show current report execution index      |
  * | p   | (none)       | Toggle pause/resume execution            |
  * | s   | (none)       | Single-step one report                   |
  * | z   | (none)       | Reset report index to beginning          |
+ * | i   | (none)       | Show runtime counters                    |
+ * | ib  | (none)       | Runtime counters as hex (struct stats)   |
+ * | iz  | (none)       | Clear runtime counters                   |
+ * | t   | (none)       | Dump and clear the event trace (binary)  |
+ * | t0  | (none)       | Stop recording trace events              |
+ * | t1  | (none)       | Resume recording trace events            |
+ * | q1  | (none)       | Quiet mode: no echo or prompt            |
+ * | q0  | (none)       | Back to the interactive console          |
+ *
+ * A flash payload may be up to PAYLOAD_CAPACITY (97252) bytes, all of
+ * user_data but one page kept for the selected payload. Hex lines carry
+ * at most HEX_PAYLOAD_MAX bytes; larger payloads go through a binary
+ * upload (upload.h).
+ *
+ * Several commands may share a line, separated by ';' (see
+ * cdcacm_run_line() in cdcacm.c).
  *
  * ## Examples
  *
@@ -650,12 +678,14 @@ int add_mouse_jiggler(int width)
  * resumed
  * ```
  *
- * @param buf Command string buffer (first char is command)
- * @param len Length of command string (used for hex data length calculation)
+ * @param buf Command string buffer (first char is command); 'w', 'd' and
+ *            'm' decode their hex argument into it in place
+ * @param len Length of command string, including the line terminator
+ *            (used for hex data length calculation)
  *
  * @return Response string to display to user
  *
- * @warning The 'w' and 'd' commands erase the flash page before writing!
+ * @warning The 'w' and 'd' commands erase the flash pages they write to!
  *
  * @see convert_ducky_binary() for 'd' command processing
  * @see add_mouse_jiggler() for 'j' command
@@ -664,6 +694,8 @@ int add_mouse_jiggler(int width)
 char *process_serial_command(char *buf, int len) {
 	(void) len;
 
+	trace(TRACE_COMMAND, (uint8_t)buf[0]);
+
 	if (buf[0] == 'v') {
 		/* Version command: return firmware version string */
 		return "Pill Duck version " FIRMWARE_VERSION;
@@ -694,75 +726,162 @@ char *process_serial_command(char *buf, int len) {
 		 * 'w' - Write raw hex data directly to flash
 		 * 'd' - Convert DuckyScript binary format, then write
 		 */
-		char binary[1024] = {0};
-		int binary_len = len / 2;  /* 2 hex chars per byte */
-		uint8_t *to_write = (uint8_t *)&binary;
+		/* Decoded in place: byte i overwrites buf[i], hex is read from buf[1 + 2i] */
+		uint8_t *binary = (uint8_t *)buf;
+		/* Strip the command letter and the line terminator; 2 hex chars per byte */
+		int binary_len = (len - 2) / 2;
+		uint32_t result;
+
+		if (binary_len < 0) binary_len = 0;
+		if (binary_len > HEX_PAYLOAD_MAX) binary_len = HEX_PAYLOAD_MAX;
 
 		/* Decode hex string to binary */
-		unhexify(binary, &buf[1], len);
+		unhexify(binary, &buf[1], binary_len);
 
 		if (buf[0] == 'd') {
-			/* DuckyScript mode: convert to HID reports first */
-			int records = convert_ducky_binary((uint8_t *)binary, binary_len, packet_buffer);
-			binary_len = records * sizeof(struct composite_report);
-			to_write = (uint8_t *)&packet_buffer;
-		}
+			/* DuckyScript mode: convert to HID reports, streamed across pages */
+			struct payload_writer writer;
 
-		/* Write to flash and return status */
-		int result = flash_program_data((uint32_t)&user_data, to_write, binary_len);
-		if (result == RESULT_OK) {
-			return "wrote flash";
-		} else if (result == FLASH_WRONG_DATA_WRITTEN) {
-			return "wrong data written";
+			payload_begin(&writer, PAYLOAD_TARGET_FLASH, ducky_binary_size(binary_len));
+			write_ducky_binary(binary, binary_len, &writer);
+			result = payload_commit(&writer);
 		} else {
-			return "error writing flash";
+			result = write_payload(binary, binary_len, PAYLOAD_TARGET_FLASH);
 		}
 
+		/* Return write status */
+		return flash_result_message(result);
+
 	} else if (buf[0] == 'j') {
 		/* Jiggler command: generate and store mouse jiggler pattern */
-		int records = add_mouse_jiggler(30);  /* 30 pixels each direction */
-		int binary_len = records * sizeof(struct composite_report);
-
-		int result = flash_program_data((uint32_t)&user_data, (uint8_t *)&packet_buffer, binary_len);
-		if (result == RESULT_OK) {
-			return "wrote flash";
-		} else if (result == FLASH_WRONG_DATA_WRITTEN) {
-			return "wrong data written";
-		} else {
-			return "error writing flash";
+		int binary_len = add_mouse_jiggler(30);  /* 30 pixels each direction */
+
+		return flash_result_message(write_payload(packet_buffer, binary_len, PAYLOAD_TARGET_FLASH));
+
+	} else if (buf[0] == 'm') {
+		/* Memory command: load raw hex data as the RAM payload and run it */
+		uint8_t *binary = (uint8_t *)buf;  /* In place, as for 'w' */
+		int binary_len = (len - 2) / 2;
+
+		if (binary_len < 0) binary_len = 0;
+		if (binary_len > HEX_PAYLOAD_MAX) binary_len = HEX_PAYLOAD_MAX;
+
+		unhexify(binary, &buf[1], binary_len);
+
+		if (write_payload(binary, binary_len, PAYLOAD_TARGET_RAM) != RESULT_OK)
+			return "payload too large";
+		return "loaded ram";
+
+	} else if (buf[0] == 'c') {
+		/* Commit command: copy the RAM payload into a flash slot */
+		if (!payload_in_ram()) return "no ram payload";
+
+		return flash_result_message(write_payload(payload_data(), payload_length(), PAYLOAD_TARGET_FLASH));
+
+	} else if (buf[0] == 'n') {
+		/* Name command: hash of the name for the next flash write */
+		static char text[sizeof("name 00000000")] = "name ";
+		/* Strip the command letter and the line terminator */
+		uint32_t name = payload_name_hash(&buf[1], len > 2 ? len - 2 : 0);
+
+		payload_set_name(name);
+		put_hex32(&text[5], name);
+		return text;
+
+	} else if (buf[0] == 'l') {
+		/* List command: the payload slot directory */
+		return format_slot_list();
+
+	} else if (buf[0] == 'x' || buf[0] == 'g') {
+		/* Select command: play another slot, 'g' also resumes */
+		if (!payload_select(buf[1] - '0')) return "no payload in slot";
+
+		if (buf[0] == 'g') {
+			engine_set_paused(false);
+			return "running";
 		}
+		return "selected";
 
 	} else if (buf[0] == 'r') {
-		/* Read command: return first 16 bytes of flash as hex */
+		/* Read command: binary range of user_data, see read_region() */
+		if (len == 2 + 16)
+			return read_region(&buf[1]);
+		if (len != 2)
+			return "bad range";
+
+		/* No range: first 16 bytes of the active payload as hex */
 		char binary[16] = {0};
 		memset(binary, 0, sizeof(binary));
-		flash_read_data((uint32_t)&user_data, sizeof(binary), (uint8_t *)&binary);
+		flash_read_data((uint32_t)payload_data(), sizeof(binary), (uint8_t *)&binary);
 
-		static char hex[32] = {0};  /* Static: must outlive function */
+		static char hex[sizeof(binary) * 2 + 1] = {0};  /* Static: must outlive function */
 		hexify(hex, (const char *)binary, sizeof(binary));
 		return hex;
 
+	} else if (buf[0] == 'k') {
+		/* Checksum command: "crc <crc32> len <length> ok|bad", big-endian hex */
+		static char text[sizeof("crc 00000000 len 00000000 bad")];
+		uint32_t crc;
+		bool ok = payload_verify(&crc);
+		uint32_t length = payload_length();
+		uint8_t be[8] = {
+			crc >> 24, crc >> 16, crc >> 8, crc,
+			length >> 24, length >> 16, length >> 8, length,
+		};
+
+		memcpy(text, "crc ", 4);
+		hexify(&text[4], be, 4);
+		memcpy(&text[12], " len ", 5);
+		hexify(&text[17], &be[4], 4);
+		strcpy(&text[25], ok ? " ok" : " bad");
+		return text;
+
 	} else if (buf[0] == '@') {
 		/* Index command: show current execution position */
 		static char hex[16] = {0};
+		uint32_t report_index = engine_index();
 		/* TODO: Display in decimal with proper endianness */
 		hexify(hex, (const char *)&report_index, sizeof(report_index));
 		return hex;
 
 	} else if (buf[0] == 'p') {
 		/* Pause command: toggle pause state */
-		paused = !paused;
-		if (paused) return "paused";
+		if (engine_toggle_pause()) return "paused";
 		else return "resumed";
 
 	} else if (buf[0] == 's') {
 		/* Step command: execute single report */
-		single_step = true;
+		engine_step();
 		return "step";
 
 	} else if (buf[0] == 'z') {
 		/* Zero command: reset execution index */
-		report_index = 0;
+		engine_rewind();
+
+	} else if (buf[0] == 'i') {
+		/* Info command: runtime counters, see stats.h */
+		if (buf[1] == 'b') {
+			static char hex[sizeof(struct stats) * 2 + 1];
+			struct stats snapshot = stats;
+
+			hexify(hex, (const char *)&snapshot, sizeof(snapshot));
+			return hex;
+		} else if (buf[1] == 'z') {
+			stats_reset();
+			return "stats cleared";
+		}
+		return stats_format();
+
+	} else if (buf[0] == 'q') {
+		/* Quiet command: batch mode for scripted hosts, see cdcacm.h */
+		cdcacm_set_quiet(buf[1] == '1');
+		return buf[1] == '1' ? "quiet" : "verbose";
+
+	} else if (buf[0] == 't') {
+		/* Trace command: binary event dump, see trace.h */
+		if (buf[1] == '0' || buf[1] == '1')
+			return (char *)trace_enable(buf[1] == '1');
+		return (char *)trace_dump();
 
 	} else {
 		/* Unknown command */
@@ -772,36 +891,118 @@ char *process_serial_command(char *buf, int len) {
 	return "";
 }
 
+/*============================================================================
+ * Interrupt Handlers
+ *===========================================================================*/
+
+/**
+ * @brief Interrupt priorities (lower value = more urgent)
+ *
+ * USB control transfers have host-side timeouts, so the USB interrupt
+ * preempts everything else. The TIM2 playback clock handler is a few
+ * instructions long and only needs to run within one counter wrap.
+ * Command processing and flash writes run in the main loop at thread
+ * level, below both.
+ *
+ * @{
+ */
+#define IRQ_PRIORITY_USB	(1 << 4)
+#define IRQ_PRIORITY_CLOCK	(2 << 4)
+/** @} */
+
+/**
+ * @brief USB low-priority interrupt handler: service the USB stack
+ *
+ * Enumeration, control requests and endpoint callbacks are all handled
+ * here, so USB stays responsive while the main loop is busy, e.g.
+ * writing flash. Endpoint callbacks only move data in and out of
+ * buffers; serial commands are run later by cdcacm_poll().
+ *
+ * Runs from RAM together with the driver and the endpoint callbacks,
+ * so it keeps servicing the host while flash is erased or programmed.
+ */
+RAMFUNC void usb_lp_can_rx0_isr(void)
+{
+	uint32_t start = stats_cycles();
+
+	usbd_poll(usbd_dev);
+
+	stats_time(&stats.usb_isr, start);
+}
+
+/*============================================================================
+ * Low-Power Idle
+ *===========================================================================*/
+
+/**
+ * @brief Sleep until the next interrupt if there is nothing to do
+ *
+ * The idle check runs with interrupts masked: an interrupt that arrives
+ * after the check stays pending and makes WFI return immediately, so
+ * an alarm, serial packet or HID completion can never be slept
+ * through. The handlers run once interrupts are unmasked again.
+ *
+ * Wakeup sources are the USB interrupt (enumeration, serial data, HID
+ * IN completions) and TIM2 (delay alarm, counter overflow every
+ * 65.5 s, stopped entirely while paused).
+ */
+static void idle_wait(void)
+{
+	cm_disable_interrupts();
+
+	if (engine_idle() && !cdcacm_pending())
+		__asm__ volatile ("wfi");
+
+	cm_enable_interrupts();
+}
+
 /*============================================================================
  * System Initialization Functions
  *===========================================================================*/
 
 /**
- * @brief Configure system clock and SysTick timer
+ * @brief Copy of the vector table in RAM
+ *
+ * VTOR needs the table aligned to its size rounded up to a power of two
+ * (84 words: 512 bytes). The linker script puts it at the start of RAM,
+ * so the alignment costs no padding.
+ */
+static vector_table_t ram_vector_table
+	__attribute__((section(".ram_vectors"), aligned(512)));
+
+/**
+ * @brief Take exception vectors from RAM
  *
- * Sets up the STM32F103 clock system and configures the SysTick timer
- * for 1ms periodic interrupts.
+ * The core reads the handler address from the vector table on every
+ * exception entry. With the table in flash, an interrupt during a page
+ * erase would stall on that read even though the handler itself is in
+ * RAM (see ramfunc.h).
+ */
+static void setup_vectors(void)
+{
+	memcpy(&ram_vector_table, &vector_table, sizeof(ram_vector_table));
+	SCB_VTOR = (uint32_t)&ram_vector_table;
+	__asm__ volatile ("dsb");
+}
+
+/**
+ * @brief Configure system clock and the playback clock
+ *
+ * Sets up the STM32F103 clock system and starts the TIM2 playback clock
+ * used for payload delays.
  *
  * ## Clock Configuration
  *
  * Uses the internal 8MHz HSI oscillator with PLL to generate 48MHz
  * system clock (required for USB operation).
  *
- * ## SysTick Timer
- *
- * The SysTick timer drives the HID report execution engine. Configuration:
- * - Clock source: AHB/8 = 48MHz / 8 = 6MHz
- * - Reload value: 5999 = 6000 cycles = 1ms period
- *
- * Alternative reload values (commented out):
- * - 899999: 100ms period
- * - 89999: 10ms period
- * - 8999: 1ms period (current)
+ * ## Playback Clock
  *
- * @note The SysTick interrupt (sys_tick_handler) is the heart of the
- *       execution engine, sending one HID report per tick.
+ * Delays are one-shot TIM2 compare alarms on a free-running 1 kHz
+ * counter (see clock.h), so no periodic tick interrupt runs while the
+ * device waits.
  *
- * @see sys_tick_handler() for the interrupt routine
+ * @see clock_setup() for the timer configuration
  */
 static void setup_clock(void) {
 	/* Configure 48MHz from internal 8MHz HSI */
@@ -810,23 +1011,8 @@ static void setup_clock(void) {
 	/* Enable GPIO port C clock (for LED) */
 	rcc_periph_clock_enable(RCC_GPIOC);
 
-	/*
-	 * Configure SysTick timer
-	 * Clock source: AHB/8 = 48MHz / 8 = 6MHz
-	 * Reload value formula: Period_ms = (reload + 1) / 6000
-	 */
-	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB_DIV8);
-
-	/* SysTick interrupt every N clock pulses: set reload to N-1
-	 * Period: N / (48 MHz / 8) = N / 6MHz
-	 */
-	/* systick_set_reload(899999); */  /* 100 ms period */
-	/* systick_set_reload(89999); */   /* 10 ms period */
-	systick_set_reload(8999);          /* 1 ms period (current) */
-
-	/* Enable SysTick interrupt and counter */
-	systick_interrupt_enable();
-	systick_counter_enable();
+	/* Start the 1 kHz playback clock on TIM2 */
+	clock_setup();
 }
 
 /**
@@ -841,8 +1027,8 @@ static void setup_clock(void) {
  * - Active: LOW (LED on when pin is low)
  * - Initial state: HIGH (LED off)
  *
- * The LED is toggled by sys_tick_handler() each time a HID report
- * is successfully transmitted.
+ * The LED is toggled by engine_poll() each time a HID report
+ * is queued for transmission.
  */
 static void setup_gpio(void) {
 	/* Configure PC13 (built-in LED on Blue Pill) as push-pull output */
@@ -878,16 +1064,18 @@ uint8_t usbd_control_buffer[128];
  * ## Initialization Sequence
  *
  * 1. Configure system clock (48MHz for USB)
- * 2. Configure GPIO (LED on PC13)
- * 3. Check for stored payload in flash
- * 4. Initialize USB stack
- * 5. Register USB configuration callback
- * 6. Enter infinite USB polling loop
+ * 2. Configure GPIO (LED on PC13) and the cycle counter (boot time 0)
+ * 3. Initialize USB stack
+ * 4. Register USB configuration and reset callbacks
+ * 5. Enable the USB interrupt and set interrupt priorities
+ * 6. Check for stored payload in flash, while the host enumerates
+ * 7. Enter the main loop, sleeping while idle
  *
  * ## Auto-Start Behavior
  *
  * If user_data contains a valid payload (first report is not
- * REPORT_ID_END), execution starts automatically (paused=false).
+ * REPORT_ID_END), execution starts automatically (see engine_init())
+ * as soon as the host has configured the device, plus SETTLE_MS.
  * Otherwise, the device waits for commands via serial.
  *
  * ## Development Notes
@@ -902,8 +1090,33 @@ uint8_t usbd_control_buffer[128];
 int main(void)
 {
 	/* Initialize system peripherals */
+	setup_vectors();
 	setup_clock();
 	setup_gpio();
+	stats_init();
+
+	/*
+	 * Start USB before anything else that takes time: the host begins
+	 * enumerating as soon as it sees the D+ pull-up, and the stack
+	 * answers it from its interrupt while the payload is located.
+	 * Playback waits for SET_CONFIGURATION (engine_set_online()).
+	 */
+	usbd_dev = usbd_init(&st_usbfs_v1_usb_driver,   /* STM32F103 USB driver */
+		&dev_descr,                                  /* Device descriptor */
+		&config,                                     /* Configuration descriptor */
+		usb_strings,                                 /* String descriptors */
+		sizeof(usb_strings)/sizeof(char *),         /* Number of strings */
+		usbd_control_buffer,                         /* Control transfer buffer */
+		sizeof(usbd_control_buffer));               /* Buffer size */
+
+	/* Register callbacks for SET_CONFIGURATION and bus reset */
+	usbd_register_set_config_callback(usbd_dev, usb_set_config);
+	usbd_register_reset_callback(usbd_dev, usb_reset);
+
+	/* From here on the USB stack runs in its interrupt */
+	nvic_set_priority(NVIC_USB_LP_CAN_RX0_IRQ, IRQ_PRIORITY_USB);
+	nvic_set_priority(NVIC_TIM2_IRQ, IRQ_PRIORITY_CLOCK);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
 
 	/*
 	 * Development test payloads (commented out):
@@ -921,35 +1134,26 @@ int main(void)
 	 *     "\x1e\x02\x00\xff\x00\xf5\x28\x00", 36);
 	 */
 
-	/* Check if payload exists in flash; if so, start execution */
-	if (user_data[0].report_id != REPORT_ID_END) {
-		paused = false;  /* Auto-start execution */
-	}
-
-	/* Initialize USB stack as composite HID + CDC ACM device */
-	usbd_dev = usbd_init(&st_usbfs_v1_usb_driver,   /* STM32F103 USB driver */
-		&dev_descr,                                  /* Device descriptor */
-		&config,                                     /* Configuration descriptor */
-		usb_strings,                                 /* String descriptors */
-		sizeof(usb_strings)/sizeof(char *),         /* Number of strings */
-		usbd_control_buffer,                         /* Control transfer buffer */
-		sizeof(usbd_control_buffer));               /* Buffer size */
-
-	/* Register callback for SET_CONFIGURATION */
-	usbd_register_set_config_callback(usbd_dev, usb_set_config);
+	/* Find the active payload slot; if it holds a payload, start execution */
+	payload_init();
+	engine_init();
 
 	/*
-	 * Main loop: poll USB stack forever
+	 * Main loop: run serial commands and feed the execution engine
 	 *
-	 * The USB stack handles:
+	 * The USB interrupt (usb_lp_can_rx0_isr()) handles:
 	 * - Enumeration and descriptor requests
-	 * - HID report transmission (via sys_tick_handler)
-	 * - Serial command reception (via cdcacm callbacks)
+	 * - HID report transmission (draining the HID transmit queue)
+	 * - Serial packet reception (handed to cdcacm_poll())
 	 *
-	 * This is a busy-wait loop; all real work happens in
-	 * interrupts and USB callbacks.
+	 * cdcacm_poll() runs received commands, including flash writes.
+	 * engine_poll() reads the payload and queues HID reports; delays
+	 * are TIM2 alarms (clock.c). When neither has anything to do, the
+	 * CPU sleeps until the next interrupt.
 	 */
-	while (1)
-		usbd_poll(usbd_dev);
+	while (1) {
+		cdcacm_poll();
+		engine_poll();
+		idle_wait();
+	}
 }
-
@@ -0,0 +1,539 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file payload.c
+ * @brief Payload slot library management
+ *
+ * Keeps the directory of the user_data slots: where each valid slot's
+ * extent is and which one is selected for playback, and writes new
+ * payloads into another extent. A RAM payload, if loaded, overrides
+ * the selected slot.
+ *
+ * ## Write Sequence
+ *
+ * ```
+ * payload_begin()   pick a slot number and an extent, drop the slots it
+ *                   overlaps, erase its first page (header -> 0xFF)
+ * payload_write()   stream payload after the header, CRC on the fly
+ * payload_commit()  program header {generation+1, offset, length, crc,
+ *                   name, slot, magic} -> the slot becomes the selected one,
+ *                   then clear the magic of the dropped slots' old headers
+ * ```
+ *
+ * The header is reserved as erased bytes at the start of the write
+ * session, so programming it at the end needs no further erase.
+ * Further pages are only erased where the new payload differs from what
+ * the flash held before (see flash_writer_write()). A rewrite of a slot
+ * goes back to the slot's own extent when it fits, so alternating
+ * between two versions of a script rewrites little more than the
+ * header page. The price is that the old version is gone from the
+ * first erase on (see the power loss notes in payload.h).
+ *
+ * @see payload.h for the slot layout
+ * @license LGPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include "payload.h"
+#include "crc.h"
+#include "engine.h"
+#include "flash.h"
+#include "hid.h"
+
+/*============================================================================
+ * Private State
+ *===========================================================================*/
+
+/**
+ * @brief Persistent flash payload region, defined in main.c
+ */
+extern const struct composite_report user_data[USER_DATA_SIZE / sizeof(struct composite_report)];
+
+/**
+ * @brief Index of the selected slot
+ */
+static uint8_t payload_active;
+
+/**
+ * @brief Valid slots, bit n for slot n
+ */
+static uint8_t payload_valid_slots;
+
+/**
+ * @brief Directory: offset of each slot's extent in user_data
+ *
+ * Only meaningful for the slots in payload_valid_slots, and for the
+ * slot being written between payload_begin() and payload_commit().
+ */
+static uint32_t payload_offset[PAYLOAD_SLOT_COUNT];
+
+/**
+ * @brief Name for the next flash payload, see payload_set_name()
+ */
+static uint32_t payload_next_name = PAYLOAD_NAME_NONE;
+
+/**
+ * @brief RAM payload
+ */
+static struct {
+	uint8_t data[PAYLOAD_RAM_SIZE];  /**< Payload bytes */
+	uint32_t length;                 /**< Payload length */
+	bool active;                     /**< Overrides the flash slots */
+} payload_ram;
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Header at an offset in user_data
+ */
+static const struct payload_slot_header *payload_header_at(uint32_t offset)
+{
+	return (const struct payload_slot_header *)((const uint8_t *)user_data + offset);
+}
+
+/**
+ * @brief Header of a slot
+ */
+static const struct payload_slot_header *payload_slot(uint8_t slot)
+{
+	return payload_header_at(payload_offset[slot]);
+}
+
+/**
+ * @brief Payload bytes of a slot
+ */
+static const uint8_t *payload_slot_data(uint8_t slot)
+{
+	return (const uint8_t *)(payload_slot(slot) + 1);
+}
+
+/**
+ * @brief Bytes of flash an extent takes: header and payload, whole pages
+ */
+static uint32_t payload_extent_size(uint32_t length)
+{
+	uint32_t size = sizeof(struct payload_slot_header) + length;
+
+	return (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+}
+
+/**
+ * @brief Check the header at a page start and its payload CRC
+ */
+static bool payload_header_valid(uint32_t offset)
+{
+	const struct payload_slot_header *header = payload_header_at(offset);
+
+	if (header->magic != PAYLOAD_SLOT_MAGIC || header->offset != offset ||
+	    header->slot >= PAYLOAD_SLOT_COUNT ||
+	    header->length > USER_DATA_SIZE - offset - sizeof(*header))
+		return false;
+
+	return crc32_hw(header + 1, header->length) == header->crc;
+}
+
+/**
+ * @brief Check whether a slot was found valid
+ */
+static bool payload_is_valid(uint8_t slot)
+{
+	return payload_valid_slots & (1 << slot);
+}
+
+/**
+ * @brief Check whether header a was written after header b
+ */
+static bool payload_newer(const struct payload_slot_header *a, const struct payload_slot_header *b)
+{
+	/* Generations wrap: compare as a signed difference */
+	return (int32_t)(a->generation - b->generation) > 0;
+}
+
+/**
+ * @brief Find the slots among mask whose extent overlaps a range
+ *
+ * @param mask   Slots to check, bit n for slot n
+ * @param offset Start of the range in user_data
+ * @param size   Length of the range
+ *
+ * @return The overlapping slots of mask
+ */
+static uint8_t payload_overlapping(uint8_t mask, uint32_t offset, uint32_t size)
+{
+	uint8_t found = 0;
+
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot) {
+		if (!(mask & (1 << slot)))
+			continue;
+
+		uint32_t start = payload_offset[slot];
+		uint32_t end = start + payload_extent_size(payload_slot(slot)->length);
+
+		if (start < offset + size && offset < end)
+			found |= 1 << slot;
+	}
+	return found;
+}
+
+/**
+ * @brief Oldest slot among mask
+ *
+ * @return Slot number, or PAYLOAD_SLOT_COUNT if mask is empty
+ */
+static uint8_t payload_oldest(uint8_t mask)
+{
+	uint8_t oldest = PAYLOAD_SLOT_COUNT;
+
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot)
+		if ((mask & (1 << slot)) &&
+		    (oldest == PAYLOAD_SLOT_COUNT || payload_newer(payload_slot(oldest), payload_slot(slot))))
+			oldest = slot;
+	return oldest;
+}
+
+/**
+ * @brief Generation for the next payload written
+ */
+static uint32_t payload_next_generation(void)
+{
+	uint32_t generation = 0;
+
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot)
+		if (payload_is_valid(slot) &&
+		    (int32_t)(payload_slot(slot)->generation - generation) > 0)
+			generation = payload_slot(slot)->generation;
+	return generation + 1;
+}
+
+/**
+ * @brief Pick the slot number a new flash payload gets
+ *
+ * Never the selected slot while it is valid. Prefers the slot holding
+ * the same name, so rewriting a payload replaces it, then a free slot,
+ * then the one written longest ago.
+ */
+static uint8_t payload_pick_slot(uint32_t name)
+{
+	uint8_t others = payload_valid_slots & ~(1 << payload_active);
+
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot)
+		if ((others & (1 << slot)) && name != PAYLOAD_NAME_NONE &&
+		    payload_slot(slot)->name == name)
+			return slot;
+
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot)
+		if (!payload_is_valid(slot))
+			return slot;
+
+	return payload_oldest(others);
+}
+
+/**
+ * @brief Find room for the extent of a new payload
+ *
+ * Tries the old extent of the slot being rewritten first, then the
+ * first run of pages clear of every other valid slot. If there is none,
+ * gives up the oldest slot, never the selected one, and tries again.
+ *
+ * @param slot Slot number the payload gets (payload_pick_slot())
+ * @param size Extent size (payload_extent_size())
+ *
+ * @return Offset in user_data, or USER_DATA_SIZE if the payload does
+ *         not fit even with every other slot given up
+ */
+static uint32_t payload_place(uint8_t slot, uint32_t size)
+{
+	/* Slots that have to stay clear of the new extent */
+	uint8_t keep = payload_valid_slots & ~(1 << slot);
+
+	if (size > USER_DATA_SIZE)
+		return USER_DATA_SIZE;
+
+	for (;;) {
+		if (payload_is_valid(slot) && payload_offset[slot] <= USER_DATA_SIZE - size &&
+		    !payload_overlapping(keep, payload_offset[slot], size))
+			return payload_offset[slot];
+
+		for (uint32_t offset = 0; offset <= USER_DATA_SIZE - size; offset += FLASH_PAGE_SIZE)
+			if (!payload_overlapping(keep, offset, size))
+				return offset;
+
+		uint8_t oldest = payload_oldest(keep & ~(1 << payload_active));
+		if (oldest == PAYLOAD_SLOT_COUNT)
+			return USER_DATA_SIZE;
+		keep &= ~(1 << oldest);
+	}
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+void payload_init(void)
+{
+	uint8_t found = 0;
+
+	payload_valid_slots = 0;
+	payload_active = 0;
+
+	/* The newest valid extent of each slot */
+	for (uint32_t offset = 0; offset < USER_DATA_SIZE; offset += FLASH_PAGE_SIZE) {
+		if (!payload_header_valid(offset))
+			continue;
+
+		uint8_t slot = payload_header_at(offset)->slot;
+		if ((found & (1 << slot)) && !payload_newer(payload_header_at(offset), payload_slot(slot)))
+			continue;
+
+		payload_offset[slot] = offset;
+		found |= 1 << slot;
+	}
+
+	/* Newest first: an extent that a newer one was written over is dropped */
+	while (found) {
+		uint8_t slot = PAYLOAD_SLOT_COUNT;
+
+		for (uint8_t s = 0; s < PAYLOAD_SLOT_COUNT; ++s)
+			if ((found & (1 << s)) &&
+			    (slot == PAYLOAD_SLOT_COUNT || payload_newer(payload_slot(s), payload_slot(slot))))
+				slot = s;
+		found &= ~(1 << slot);
+
+		if (payload_overlapping(payload_valid_slots, payload_offset[slot],
+					payload_extent_size(payload_slot(slot)->length)))
+			continue;
+
+		/* The first one kept is the newest */
+		if (!payload_valid_slots)
+			payload_active = slot;
+		payload_valid_slots |= 1 << slot;
+	}
+}
+
+uint32_t payload_name_hash(const char *name, uint32_t len)
+{
+	uint32_t hash = 0x811C9DC5;
+
+	if (len == 0)
+		return PAYLOAD_NAME_NONE;
+
+	while (len--) {
+		hash ^= (uint8_t)*name++;
+		hash *= 0x01000193;
+	}
+
+	/* Keep PAYLOAD_NAME_NONE for unnamed payloads */
+	return hash == PAYLOAD_NAME_NONE ? 1 : hash;
+}
+
+void payload_set_name(uint32_t name)
+{
+	payload_next_name = name;
+}
+
+bool payload_select(uint8_t slot)
+{
+	if (slot >= PAYLOAD_SLOT_COUNT || !payload_is_valid(slot))
+		return false;
+
+	payload_active = slot;
+	payload_ram.active = false;
+	engine_rewind();
+	return true;
+}
+
+uint8_t payload_selected(void)
+{
+	return payload_active;
+}
+
+bool payload_slot_info(uint8_t slot, struct payload_slot_header *header)
+{
+	if (slot >= PAYLOAD_SLOT_COUNT || !payload_is_valid(slot))
+		return false;
+
+	*header = *payload_slot(slot);
+	return true;
+}
+
+const uint8_t *payload_data(void)
+{
+	if (payload_ram.active)
+		return payload_ram.data;
+	return payload_slot_data(payload_active);
+}
+
+uint32_t payload_length(void)
+{
+	if (payload_ram.active)
+		return payload_ram.length;
+	return payload_is_valid(payload_active) ? payload_slot(payload_active)->length : 0;
+}
+
+uint32_t payload_capacity(void)
+{
+	if (payload_ram.active)
+		return PAYLOAD_RAM_SIZE;
+	return USER_DATA_SIZE - payload_offset[payload_active] - sizeof(struct payload_slot_header);
+}
+
+bool payload_in_ram(void)
+{
+	return payload_ram.active;
+}
+
+bool payload_verify(uint32_t *crc)
+{
+	*crc = crc32_hw(payload_data(), payload_length());
+
+	if (payload_ram.active)
+		return true;
+	return payload_is_valid(payload_active) && *crc == payload_slot(payload_active)->crc;
+}
+
+uint32_t payload_begin(struct payload_writer *writer, enum payload_target target, uint32_t size)
+{
+	static const uint8_t erased[sizeof(struct payload_slot_header)] = {
+		[0 ... sizeof(struct payload_slot_header) - 1] = 0xFF,
+	};
+	uint32_t extent;
+	uint32_t base;
+
+	writer->target = target;
+	writer->length = 0;
+	writer->crc = 0;
+	writer->name = PAYLOAD_NAME_NONE;
+
+	if (target == PAYLOAD_TARGET_RAM) {
+		/* The buffer is overwritten in place: move playback off it */
+		payload_ram.active = false;
+		if (engine_reading(payload_ram.data))
+			engine_rewind();
+
+		writer->flash.status = RESULT_OK;
+		return RESULT_OK;
+	}
+
+	writer->name = payload_next_name;
+	payload_next_name = PAYLOAD_NAME_NONE;
+	writer->slot = payload_pick_slot(writer->name);
+
+	extent = payload_extent_size(size);
+	writer->offset = size > PAYLOAD_CAPACITY ? USER_DATA_SIZE : payload_place(writer->slot, extent);
+	writer->dropped = 0;
+	if (writer->offset == USER_DATA_SIZE) {
+		/* Nothing is dropped; payload_write() and payload_commit() fail */
+		flash_writer_begin(&writer->flash, 0, 0);
+		writer->flash.status = FLASH_OUT_OF_RANGE;
+		return FLASH_OUT_OF_RANGE;
+	}
+
+	/* The directory entries go away with the erases to come */
+	writer->dropped = payload_valid_slots &
+		((1 << writer->slot) | payload_overlapping(payload_valid_slots, writer->offset, extent));
+	payload_valid_slots &= ~writer->dropped;
+
+	/* Playback may still be finishing a pass over a slot about to be erased */
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot)
+		if ((writer->dropped & (1 << slot)) && engine_reading(payload_slot_data(slot)))
+			engine_rewind();
+
+	base = (uint32_t)payload_header_at(writer->offset);
+	flash_writer_begin(&writer->flash, base, base + extent);
+
+	/* Erases the first page and leaves the header erased for payload_commit() */
+	return flash_writer_write(&writer->flash, erased, sizeof(erased));
+}
+
+uint32_t payload_write(struct payload_writer *writer, const uint8_t *data, uint32_t len)
+{
+	if (writer->target == PAYLOAD_TARGET_RAM) {
+		if (writer->flash.status == RESULT_OK && len > PAYLOAD_RAM_SIZE - writer->length)
+			writer->flash.status = FLASH_OUT_OF_RANGE;
+
+		if (writer->flash.status == RESULT_OK) {
+			memcpy(&payload_ram.data[writer->length], data, len);
+			writer->length += len;
+		}
+		return writer->flash.status;
+	}
+
+	if (writer->flash.status == RESULT_OK) {
+		writer->crc = crc32(writer->crc, data, len);
+		writer->length += len;
+	}
+
+	return flash_writer_write(&writer->flash, data, len);
+}
+
+uint32_t payload_commit(struct payload_writer *writer)
+{
+	struct payload_slot_header header;
+	uint32_t result;
+
+	if (writer->target == PAYLOAD_TARGET_RAM) {
+		if (writer->flash.status != RESULT_OK)
+			return writer->flash.status;
+
+		/* One-shot runs start right away */
+		payload_ram.length = writer->length;
+		payload_ram.active = true;
+		engine_rewind();
+		return RESULT_OK;
+	}
+
+	result = flash_writer_finish(&writer->flash);
+	if (result != RESULT_OK)
+		return result;
+
+	/* Words are not read back while writing: check the extent as a whole */
+	if (crc32_hw(payload_header_at(writer->offset) + 1, writer->length) != writer->crc)
+		return FLASH_WRONG_DATA_WRITTEN;
+
+	header.generation = payload_next_generation();
+	header.offset = writer->offset;
+	header.length = writer->length;
+	header.crc = writer->crc;
+	header.name = writer->name;
+	header.slot = writer->slot;
+	header.magic = PAYLOAD_SLOT_MAGIC;
+
+	result = flash_program_erased((uint32_t)payload_header_at(writer->offset),
+		(const uint8_t *)&header, sizeof(header));
+	if (result != RESULT_OK)
+		return result;
+
+	/*
+	 * The new payload is valid from here on. Old headers the new extent
+	 * did not overwrite would bring their slot back at boot. If clearing
+	 * one fails, payload_init() still ranks it below newer extents.
+	 */
+	for (uint8_t slot = 0; slot < PAYLOAD_SLOT_COUNT; ++slot) {
+		const struct payload_slot_header *old = payload_slot(slot);
+		uint32_t offset = payload_offset[slot];
+
+		if (!(writer->dropped & (1 << slot)))
+			continue;
+
+		/* Within the new payload the bytes are its own, whatever they look like */
+		if (offset >= writer->offset && offset - writer->offset < sizeof(header) + writer->length)
+			continue;
+
+		if (old->magic == PAYLOAD_SLOT_MAGIC && old->offset == offset)
+			flash_clear_word((uint32_t)&old->magic);
+	}
+
+	payload_offset[writer->slot] = writer->offset;
+	payload_active = writer->slot;
+	payload_valid_slots |= 1 << writer->slot;
+	payload_ram.active = false;
+	return RESULT_OK;
+}
+
+void payload_abort(struct payload_writer *writer)
+{
+	if (writer->target == PAYLOAD_TARGET_FLASH)
+		flash_writer_finish(&writer->flash);
+}
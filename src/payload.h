@@ -0,0 +1,538 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file payload.h
+ * @brief On-flash payload formats and the payload slot library
+ *
+ * ## Slots
+ *
+ * The user_data region holds up to PAYLOAD_SLOT_COUNT payloads, known
+ * by their slot number from 0. A slot is an entry of the directory
+ * that points at an extent: a run of whole flash pages anywhere in
+ * user_data, as long as the payload needs. Each extent starts with a
+ * struct payload_slot_header followed by the payload:
+ *
+ * ```
+ * user_data (pages of FLASH_PAGE_SIZE)
+ * +--------+-----------+--------+--------------------+---------+--------+---
+ * | header | slot 2    | header | slot 0             | (free)  | header |
+ * +--------+-----------+--------+--------------------+---------+--------+---
+ * ^ offset 0            ^ offset 0x0C00                         ^ offset ...
+ * ```
+ *
+ * The header records its own offset, the slot number, length, CRC and
+ * name hash, so the directory is rebuilt at boot by reading the header
+ * at every page start: an extent is valid when its magic and offset are
+ * right and the CRC-32 of its payload matches. Of several extents for
+ * one slot, or extents that overlap, the one with the highest
+ * generation wins; the others are left-overs of writes over them. The
+ * directory itself is a table of offsets in RAM, so listing and
+ * selecting slots reads no payload data.
+ *
+ * One slot is selected; playback only ever reads the selected slot.
+ * Selecting another (payload_select()) only moves the engine's data
+ * pointer to it: nothing is copied or erased. At boot the valid slot
+ * with the highest generation, the one written last, is selected.
+ *
+ * A new payload is never written over the selected slot. It gets the
+ * slot number holding a payload of the same name if there is one, else
+ * a free number, else the one written longest ago, and is placed at the
+ * old extent of that slot if it fits there, else in the first free run
+ * of pages that is long enough. If there is none, the oldest slots are
+ * given up one by one until there is. Slots whose extent the new one
+ * overlaps are dropped; erasing a page of theirs invalidates them. The
+ * payload is streamed in and the header is programmed last. That single
+ * header write is what makes the new payload valid and selected.
+ *
+ * Only a rewrite placed in a new extent is power-safe: until the header
+ * write the old payload of the slot stays valid, so a power loss leaves
+ * either the old or the new one, never a mix. A rewrite in place erases
+ * the old header page at payload_begin(), and a power loss before
+ * payload_commit() loses the slot's payload altogether. So do dropped
+ * slots, in either case. The selected slot is never touched.
+ *
+ * A payload can be up to PAYLOAD_CAPACITY bytes, all of user_data but
+ * one page for the selected payload and the new header. The selected
+ * payload is kept, so the largest possible write is the longest run of
+ * pages around it.
+ *
+ * ## RAM Payload
+ *
+ * For one-shot runs a payload can instead be loaded into a RAM buffer
+ * (PAYLOAD_TARGET_RAM). Loading takes no erase or program cycles and
+ * causes no flash wear; playback restarts on it as soon as it is
+ * complete. It takes precedence over the flash slots until the next
+ * flash write or reset, and can be copied into a flash slot afterwards
+ * ('c' command).
+ *
+ * ## Payload Formats
+ *
+ * A slot holds a payload in one of two formats:
+ *
+ * 1. **Legacy**: an array of fixed 16-byte struct composite_report
+ *    records (see hid.h). Still accepted so existing `w` uploads and
+ *    host tools keep working.
+ *
+ * 2. **Compact**: a 4-byte header followed by variable-length,
+ *    opcode-tagged records. A key press/release pair takes 3 bytes
+ *    instead of 32, a mouse move 5 instead of 16.
+ *
+ * The format is detected from the first two bytes: "DU" (0x44 0x55)
+ * selects compact. 0x44 is not a valid legacy report ID, so a legacy
+ * payload can never be mistaken for a compact one.
+ *
+ * ## Compact Header
+ *
+ * | Offset | Size | Field   | Value                         |
+ * |--------|------|---------|-------------------------------|
+ * | 0      | 2    | magic   | 'D', 'U'                      |
+ * | 2      | 1    | version | PAYLOAD_VERSION               |
+ * | 3      | 1    | flags   | PAYLOAD_FLAG_* bits           |
+ *
+ * ## Compact Records
+ *
+ * Each record is one opcode byte followed by its operands:
+ *
+ * | Opcode          | Operands                          | Size | Action                         |
+ * |-----------------|-----------------------------------|------|--------------------------------|
+ * | OP_NOP      0x00| -                                 | 1    | Nothing                        |
+ * | OP_KEYBOARD 0x01| modifiers, reserved, keys_down[6] | 9    | Raw keyboard report            |
+ * | OP_MOUSE    0x02| buttons, x, y, wheel              | 5    | Raw mouse report               |
+ * | OP_KEY      0x03| modifiers, keycode                | 3    | Press one key                  |
+ * | OP_RELEASE  0x04| -                                 | 1    | Release all keys               |
+ * | OP_DELAY    0x05| ms                                | 2    | Wait ms milliseconds           |
+ * | OP_TAP      0x06| modifiers, keycode                | 3    | Press and release one key      |
+ * | OP_DELAY16  0x07| ms (16-bit)                       | 3    | Wait up to 65.5 s              |
+ * | OP_DELAY32  0x08| ms (32-bit)                       | 5    | Wait up to ~24.8 days          |
+ * | OP_STRING   0x09| layout, len, text[len]            | 3+len| Type UTF-8 text                |
+ * | OP_REPEAT   0x0A| count (16-bit)                    | 3    | Run previous record count more |
+ * | OP_LOOP     0x0B| target (16-bit), count (16-bit)   | 5    | Run target..here count times   |
+ * | OP_CALL     0x0C| target (16-bit)                   | 3    | Call subroutine at target      |
+ * | OP_RET      0x0D| -                                 | 1    | Return from subroutine         |
+ * | OP_MOVE     0x0E| buttons, dx, dy, ms, curve        | 9    | Move the mouse over ms         |
+ * | OP_WAIT_LED 0x0F| mask, value, timeout ms (16-bit)  | 5    | Wait for the host's LED report |
+ * | OP_TRACK    0x10| target (16-bit)                   | 3    | Play target.. on another track |
+ * | OP_END      0xFF| -                                 | 1    | End of payload, restart        |
+ *
+ * Multi-byte operands are little-endian. Unknown opcodes are treated
+ * like OP_END.
+ *
+ * ## Tap Release
+ *
+ * OP_TAP stores only the key press; the engine synthesizes the release
+ * report. The release is skipped when the very next record is another
+ * OP_TAP with the same modifiers and a different keycode: the host sees
+ * the old key go up and the new key go down in a single report, so a
+ * run of distinct keys costs one report per key instead of two.
+ * Repeated keys ("ll") still get a release in between, because the host
+ * would otherwise see the key held rather than pressed twice.
+ *
+ * ## Mouse Motion
+ *
+ * OP_MOVE moves the pointer by dx, dy (signed 16-bit) over ms
+ * milliseconds (16-bit) with buttons held, following one of the
+ * MOVE_CURVE_* easing curves. The engine sends one mouse report each
+ * time the host polls, carrying the distance due by then, so the speed
+ * does not depend on the HID polling interval. With ms 0 the distance
+ * goes out in steps of up to 127 as fast as the host polls.
+ *
+ * ## LED Wait
+ *
+ * OP_WAIT_LED waits until the keyboard LED bits the host last reported
+ * (HID_LED_* in hid.h), masked with mask, equal value, or until the
+ * timeout expires (0: wait for ever). The wait starts once the host has
+ * read every report before it. Hosts set the LEDs of all keyboards when
+ * a lock key is pressed on any of them, so tapping Caps Lock and
+ * waiting for the Caps Lock bit to flip tells the script that the host
+ * has processed all input so far:
+ *
+ * ```
+ *  4: OP_TAP      0 0x39          Caps Lock on
+ *  7: OP_WAIT_LED 0x02 0x02 1000  ... host has seen it
+ * 12: OP_TAP      0 0x39          Caps Lock off again
+ * 15: OP_WAIT_LED 0x02 0x00 1000
+ * ```
+ *
+ * ## Flow Control
+ *
+ * Targets are byte offsets from the start of the payload (the header is
+ * at 0, so the first record is at 4). They are 16-bit, so only the first
+ * 64 KB of a longer payload can be jumped to. OP_LOOP jumps back to target
+ * until the records from target up to the OP_LOOP have run count times
+ * in total; count 0 loops forever. OP_REPEAT is the DuckyScript REPEAT:
+ * the record before it (the whole OP_STRING, tap or report) runs count
+ * more times. Loops nest, and a subroutine reached with OP_CALL may
+ * loop and call again, up to 8 levels in all. Going deeper, jumping
+ * outside the payload or OP_RET without OP_CALL is treated like OP_END.
+ *
+ * ```
+ *  4: OP_MOUSE 0 1 0 0        move right
+ *  9: OP_LOOP  4 30           ... 30 times
+ * 14: OP_MOUSE 0 -1 0 0       move left
+ * 19: OP_LOOP  14 30          ... 30 times
+ * 24: OP_END
+ * ```
+ *
+ * ## Tracks
+ *
+ * OP_TRACK starts a second read position at target and carries on with
+ * the next record, so both timelines play at the same time: each track
+ * has its own delays, loops, calls and LED waits, and a delay on one
+ * does not hold up the other. Up to 4 tracks play at once (the first
+ * one included); OP_TRACK with all of them playing, or with a target
+ * outside the payload, is treated like OP_END. OP_END and OP_RET
+ * without OP_CALL end only the track that reaches them; the payload
+ * restarts once every track has ended.
+ *
+ * A delay or LED wait on a track waits only for the reports that track
+ * queued to be read, so tracks should keep to one device each. Holding
+ * Shift while dragging the mouse:
+ *
+ * ```
+ *  4: OP_TRACK   15           mouse track at 15
+ *  7: OP_KEY     0x02 0       Shift down
+ * 10: OP_DELAY16 600          ... for 0.6 s
+ * 13: OP_RELEASE
+ * 14: OP_END                  end of the keyboard track
+ * 15: OP_DELAY   50
+ * 17: OP_MOVE    1 200 0 500 0    drag 200 px right over 0.5 s
+ * 26: OP_MOUSE   0 0 0 0      release the button
+ * 31: OP_END
+ * ```
+ *
+ * ## Key Packing
+ *
+ * With PAYLOAD_FLAG_PACK set in the header, a run of OP_TAP records (or
+ * characters of one OP_STRING) with the same modifiers and no repeated
+ * key is sent as a single report with up to 6 keys down, followed by
+ * one release. "abc" becomes {a,b,c} then {}, instead of {a} {b} {c} {}.
+ * The release is skipped only if none of the keys of the next report is
+ * down, so "abcdefgha" gives {a,b,c,d,e,f} {} {g,h,a}, not {g,h,a}
+ * straight after the first report, where a would stay held.
+ * Hosts register the keys of one report in array order, so the text
+ * comes out the same with fewer reports. The flag is opt-in because a
+ * host that sorts or debounces simultaneous keys could reorder them.
+ *
+ * ## Strings
+ *
+ * OP_STRING types its text as a series of taps, using the keymap of the
+ * layout ID (see keymap.h) to pick the key and modifiers for each
+ * character. The same release rule applies between consecutive
+ * characters. Characters the layout has no key for are skipped. A
+ * record whose text would run past the end of the payload is treated
+ * like OP_END.
+ *
+ * @see engine.c for the decoder
+ * @see convert_ducky_binary() in ducky.c for the encoder
+ */
+
+#ifndef __PAYLOAD_H
+#define __PAYLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "flash.h"
+
+/*============================================================================
+ * Slots
+ *===========================================================================*/
+
+/** @brief Slot header magic, "PDSL" little-endian */
+#define PAYLOAD_SLOT_MAGIC	0x4C534450
+
+/** @brief Number of payload slots (directory entries) in user_data */
+#define PAYLOAD_SLOT_COUNT	8
+
+/** @brief Largest payload a flash write can take: user_data less one page for the selected payload */
+#define PAYLOAD_CAPACITY	(USER_DATA_SIZE - FLASH_PAGE_SIZE - sizeof(struct payload_slot_header))
+
+/** @brief Size of the RAM payload buffer */
+#define PAYLOAD_RAM_SIZE	8192
+
+/** @brief Name hash of a payload written without a name */
+#define PAYLOAD_NAME_NONE	0
+
+/**
+ * @brief Where a new payload is written
+ *
+ * Values match the upload header's target field (see upload.h).
+ */
+enum payload_target {
+	PAYLOAD_TARGET_FLASH = 0,  /**< Flash extent other than the selected one */
+	PAYLOAD_TARGET_RAM = 1,    /**< RAM payload buffer */
+};
+
+/**
+ * @brief Header at the start of each extent
+ *
+ * The magic comes last: the header is programmed in address order, so
+ * the extent only becomes valid once every other field is in place.
+ */
+struct payload_slot_header {
+	uint32_t generation;  /**< Incremented on every write; highest is selected at boot */
+	uint32_t offset;      /**< Offset of this header in user_data, a multiple of FLASH_PAGE_SIZE */
+	uint32_t length;      /**< Payload length in bytes */
+	uint32_t crc;         /**< crc32() of the payload bytes */
+	uint32_t name;        /**< payload_name_hash() of the name, or PAYLOAD_NAME_NONE */
+	uint32_t slot;        /**< Slot number, below PAYLOAD_SLOT_COUNT */
+	uint32_t magic;       /**< PAYLOAD_SLOT_MAGIC */
+};
+
+/**
+ * @brief Write session for a new payload
+ *
+ * Streams into an extent other than the selected one (or the RAM
+ * buffer) and tracks the length and CRC that go into the slot header on
+ * payload_commit().
+ */
+struct payload_writer {
+	enum payload_target target; /**< Destination kind */
+	struct flash_writer flash;  /**< Destination in the slot */
+	uint32_t length;            /**< Bytes written so far */
+	uint32_t crc;               /**< Running CRC-32 of those bytes */
+	uint32_t name;              /**< Name hash for the slot header */
+	uint32_t offset;            /**< Offset of the new extent in user_data */
+	uint8_t slot;               /**< Slot being written */
+	uint8_t dropped;            /**< Slots given up for it, bit n for slot n */
+};
+
+/*============================================================================
+ * Compact Header
+ *===========================================================================*/
+
+/** @brief First magic byte of a compact payload */
+#define PAYLOAD_MAGIC0		'D'
+
+/** @brief Second magic byte of a compact payload */
+#define PAYLOAD_MAGIC1		'U'
+
+/** @brief Compact format version understood by this firmware */
+#define PAYLOAD_VERSION		1
+
+/** @brief Header flag: pack runs of taps into multi-key reports */
+#define PAYLOAD_FLAG_PACK	0x01
+
+/**
+ * @brief Compact payload header
+ */
+struct payload_header {
+	uint8_t magic[2];  /**< PAYLOAD_MAGIC0, PAYLOAD_MAGIC1 */
+	uint8_t version;   /**< PAYLOAD_VERSION */
+	uint8_t flags;     /**< PAYLOAD_FLAG_* bits, others 0 */
+} __attribute__((packed));
+
+/*============================================================================
+ * Compact Opcodes
+ *===========================================================================*/
+
+/**
+ * @defgroup PayloadOpcodes Compact payload opcodes
+ * @{
+ */
+#define OP_NOP		0x00  /**< No operation */
+#define OP_KEYBOARD	0x01  /**< Raw keyboard report: 8 operand bytes */
+#define OP_MOUSE	0x02  /**< Raw mouse report: 4 operand bytes */
+#define OP_KEY		0x03  /**< Press: modifiers, keycode */
+#define OP_RELEASE	0x04  /**< Release all keys */
+#define OP_DELAY	0x05  /**< Delay: 8-bit milliseconds */
+#define OP_TAP		0x06  /**< Press and auto-release: modifiers, keycode */
+#define OP_DELAY16	0x07  /**< Delay: 16-bit milliseconds */
+#define OP_DELAY32	0x08  /**< Delay: 32-bit milliseconds */
+#define OP_STRING	0x09  /**< Text: layout, length, UTF-8 bytes */
+#define OP_REPEAT	0x0A  /**< Repeat previous record: 16-bit count */
+#define OP_LOOP		0x0B  /**< Loop back: 16-bit target, 16-bit count */
+#define OP_CALL		0x0C  /**< Call: 16-bit target */
+#define OP_RET		0x0D  /**< Return to after the last OP_CALL */
+#define OP_MOVE		0x0E  /**< Mouse motion: buttons, dx, dy, ms, curve */
+#define OP_WAIT_LED	0x0F  /**< Wait for LEDs: mask, value, 16-bit timeout */
+#define OP_TRACK	0x10  /**< Start a track: 16-bit target */
+#define OP_END		0xFF  /**< End of payload */
+/** @} */
+
+/**
+ * @defgroup MoveCurves OP_MOVE easing curves
+ * @{
+ */
+#define MOVE_CURVE_LINEAR	0  /**< Constant speed */
+#define MOVE_CURVE_IN		1  /**< Accelerate (quadratic) */
+#define MOVE_CURVE_OUT		2  /**< Decelerate (quadratic) */
+#define MOVE_CURVE_IN_OUT	3  /**< Accelerate, then decelerate (smoothstep) */
+/** @} */
+
+/*============================================================================
+ * Slot Functions
+ *===========================================================================*/
+
+/**
+ * @brief Rebuild the slot directory at boot
+ *
+ * Validates the header at every page start of user_data (magic, offset
+ * and payload CRC), keeps the newest extent of each slot that no newer
+ * extent overlaps, and selects the valid slot with the highest
+ * generation. Call before engine_init(), which only starts playback if
+ * a slot passed this check. The CRCs are computed by the hardware CRC
+ * unit (crc32_hw()).
+ */
+void payload_init(void);
+
+/**
+ * @brief Hash a payload name (FNV-1a, 32 bits)
+ *
+ * @param name Name bytes
+ * @param len  Name length, 0 for PAYLOAD_NAME_NONE
+ *
+ * @return Name hash, never PAYLOAD_NAME_NONE for a non-empty name
+ */
+uint32_t payload_name_hash(const char *name, uint32_t len);
+
+/**
+ * @brief Name the next payload written to flash
+ *
+ * Applies to the next payload_begin() with PAYLOAD_TARGET_FLASH only,
+ * which resets it to PAYLOAD_NAME_NONE.
+ *
+ * @param name payload_name_hash() of the name
+ */
+void payload_set_name(uint32_t name);
+
+/**
+ * @brief Play a stored payload
+ *
+ * Makes a valid slot the active payload (ending a RAM payload
+ * override) and restarts playback on it. Only the engine's data
+ * pointer moves: the payload stays where it is in flash. The selection
+ * lasts until the next flash write or reset.
+ *
+ * @param slot Slot number, below PAYLOAD_SLOT_COUNT
+ *
+ * @return false if the slot holds no valid payload
+ */
+bool payload_select(uint8_t slot);
+
+/**
+ * @brief Slot selected for playback
+ *
+ * @return Slot number; meaningful if payload_slot_info() accepts it
+ */
+uint8_t payload_selected(void);
+
+/**
+ * @brief Read a directory entry
+ *
+ * @param slot   Slot number, below PAYLOAD_SLOT_COUNT
+ * @param header Receives the slot header if the slot is valid
+ *
+ * @return true if the slot holds a valid payload
+ */
+bool payload_slot_info(uint8_t slot, struct payload_slot_header *header);
+
+/**
+ * @brief First byte of the active payload
+ *
+ * The active payload is the RAM payload while one is loaded, otherwise
+ * the selected slot.
+ *
+ * @return Payload start, valid even if no payload is stored
+ */
+const uint8_t *payload_data(void);
+
+/**
+ * @brief Length of the active payload
+ *
+ * @return Payload length in bytes, 0 if no payload is stored
+ */
+uint32_t payload_length(void);
+
+/**
+ * @brief Bytes that may be read from payload_data()
+ *
+ * At least payload_length(); records near the end of a payload may be
+ * read past its length as long as they stay within this bound.
+ *
+ * @return PAYLOAD_RAM_SIZE, or the bytes from payload_data() to the end
+ *         of user_data
+ */
+uint32_t payload_capacity(void);
+
+/**
+ * @brief Check whether the active payload is the RAM payload
+ */
+bool payload_in_ram(void);
+
+/**
+ * @brief Recompute the CRC-32 of the active payload
+ *
+ * Reads the whole payload with the hardware CRC unit, so a host can
+ * confirm what is stored without reading it back.
+ *
+ * @param crc Receives crc32() of the payload_length() bytes at
+ *            payload_data()
+ *
+ * @return true if it matches the CRC stored in the slot header (always
+ *         true for the RAM payload, which has no header), false if
+ *         the flash contents changed or no payload is stored
+ */
+bool payload_verify(uint32_t *crc);
+
+/**
+ * @brief Start writing a new payload
+ *
+ * For PAYLOAD_TARGET_FLASH, picks the slot number and the extent for a
+ * payload of up to size bytes (see Slots above), named by the last
+ * payload_set_name(), and drops the slots that extent overlaps,
+ * leaving the selected payload untouched. If playback is still
+ * finishing a pass over one of them, it is restarted on the selected
+ * one first. The first page of the extent is erased here.
+ *
+ * For PAYLOAD_TARGET_RAM, discards the current RAM payload; playback of
+ * it, if any, restarts on the flash payload. size is not used.
+ *
+ * @param writer Write session to initialize
+ * @param target Destination
+ * @param size   Most bytes that will be written; writing more fails
+ *
+ * @return RESULT_OK, FLASH_OUT_OF_RANGE if no extent of that size can be
+ *         had, or a flash error code
+ */
+uint32_t payload_begin(struct payload_writer *writer, enum payload_target target, uint32_t size);
+
+/**
+ * @brief Append payload bytes
+ *
+ * @param writer Session from payload_begin()
+ * @param data   Source bytes
+ * @param len    Number of bytes (any length)
+ *
+ * @return RESULT_OK, FLASH_OUT_OF_RANGE past the size given to
+ *         payload_begin() or PAYLOAD_RAM_SIZE, or the first (sticky)
+ *         flash error
+ */
+uint32_t payload_write(struct payload_writer *writer, const uint8_t *data, uint32_t len);
+
+/**
+ * @brief Finish the payload and make it the active one
+ *
+ * Programs the slot header if every write succeeded, then clears the
+ * magic of the headers of the slots payload_begin() dropped, so no old
+ * extent comes back at the next boot. Playback switches
+ * to a new flash payload the next time it restarts from the beginning
+ * (end of payload or 'z'), so the pass in progress is not cut short.
+ * A RAM payload is started right away.
+ *
+ * @param writer Session from payload_begin()
+ *
+ * @return RESULT_OK if the new payload is active, otherwise the first
+ *         error (the previous payload stays active)
+ */
+uint32_t payload_commit(struct payload_writer *writer);
+
+/**
+ * @brief Abandon a write session
+ *
+ * Locks flash. The slot that was being written is left invalid.
+ *
+ * @param writer Session from payload_begin()
+ */
+void payload_abort(struct payload_writer *writer);
+
+#endif /* __PAYLOAD_H */
@@ -0,0 +1,44 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file ramfunc.h
+ * @brief Placement of code that must run while flash is busy
+ *
+ * The STM32F103 cannot read flash while a page erase (about 20 ms) or a
+ * half-word program is in progress: any instruction fetch from flash
+ * stalls the CPU until the operation ends. Code marked RAMFUNC is
+ * linked into the .ramfunc input section, which bluepill.ld places in
+ * .data, so the reset handler copies it to RAM together with the
+ * initialised variables.
+ *
+ * Everything on the USB and TIM2 interrupt paths is in RAM, as are the
+ * flash wait loops in flash.c, so reports keep flowing and delays keep
+ * expiring on time while a payload is written. The vector table is
+ * moved to RAM by main() for the same reason. The control-request and
+ * descriptor code still runs from flash: enumeration waits out a flash
+ * operation, but never happens during one in practice.
+ *
+ * Functions called from RAM must not call back into flash code on the
+ * fast path: use registers directly instead of libopencm3 helpers
+ * (except the USB driver, which bluepill.ld also places in RAM).
+ *
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __RAMFUNC_H
+#define __RAMFUNC_H
+
+/**
+ * @brief Run a function from RAM
+ *
+ * RAM (0x20000000) is out of BL range of flash (0x08000000): long_call
+ * makes callers that see the definition branch through a register, the
+ * linker inserts veneers for calls from other files. noinline so the
+ * code really ends up in the section.
+ */
+#if defined(__arm__)
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline, long_call))
+#else
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline))
+#endif
+
+#endif /* __RAMFUNC_H */
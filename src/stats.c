@@ -0,0 +1,138 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file stats.c
+ * @brief Runtime counters implementation
+ *
+ * @see stats.h for the counters and their binary layout
+ * @license LGPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include "ramfunc.h"
+#include "stats.h"
+
+/*============================================================================
+ * Public State
+ *===========================================================================*/
+
+struct stats stats;
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Append a string
+ *
+ * @return Position after the appended text
+ */
+static char *stats_put_str(char *out, const char *str)
+{
+	while (*str)
+		*out++ = *str++;
+	return out;
+}
+
+/**
+ * @brief Append an unsigned decimal number
+ *
+ * @return Position after the appended digits
+ */
+static char *stats_put_u32(char *out, uint32_t value)
+{
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (n)
+		*out++ = digits[--n];
+	return out;
+}
+
+/**
+ * @brief Append "name value\r\n"
+ */
+static char *stats_put_counter(char *out, const char *name, uint32_t value)
+{
+	out = stats_put_str(out, name);
+	*out++ = ' ';
+	out = stats_put_u32(out, value);
+	return stats_put_str(out, "\r\n");
+}
+
+/**
+ * @brief Append "name count avg cycles max cycles\r\n"
+ */
+static char *stats_put_timing(char *out, const char *name, const struct stats_timing *timing)
+{
+	out = stats_put_str(out, name);
+	*out++ = ' ';
+	out = stats_put_u32(out, timing->count);
+	out = stats_put_str(out, " avg ");
+	out = stats_put_u32(out, timing->count ? timing->total / timing->count : 0);
+	out = stats_put_str(out, " max ");
+	out = stats_put_u32(out, timing->max);
+	return stats_put_str(out, "\r\n");
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+void stats_init(void)
+{
+	DWT_CYCCNT = 0;
+	dwt_enable_cycle_counter();
+	memset(&stats, 0, sizeof(stats));
+}
+
+RAMFUNC void stats_time(struct stats_timing *timing, uint32_t start)
+{
+	/* Unsigned subtraction handles counter wrap (every 89 s at 48 MHz) */
+	uint32_t cycles = stats_cycles() - start;
+
+	++timing->count;
+	timing->total += cycles;
+	if (cycles > timing->max)
+		timing->max = cycles;
+}
+
+void stats_reset(void)
+{
+	uint32_t boot_config = stats.boot_config;
+	uint32_t boot_report = stats.boot_report;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.boot_config = boot_config;
+	stats.boot_report = boot_report;
+}
+
+char *stats_format(void)
+{
+	/* Longest line is a timing: 4 numbers of up to 10 digits plus labels */
+	static char text[512];
+	char *out = text;
+
+	out = stats_put_counter(out, "reports", stats.reports);
+	out = stats_put_counter(out, "queue_full", stats.queue_full);
+	out = stats_put_counter(out, "cdc_in", stats.cdc_in);
+	out = stats_put_counter(out, "cdc_out", stats.cdc_out);
+	out = stats_put_counter(out, "cdc_spins", stats.cdc_spins);
+	out = stats_put_counter(out, "cdc_dropped", stats.cdc_dropped);
+	out = stats_put_counter(out, "missed_ms", stats.missed_ms);
+	out = stats_put_counter(out, "boot_config_us", stats.boot_config / STATS_CYCLES_PER_US);
+	out = stats_put_counter(out, "boot_report_us", stats.boot_report / STATS_CYCLES_PER_US);
+	out = stats_put_timing(out, "usb_isr", &stats.usb_isr);
+	out = stats_put_timing(out, "clock_isr", &stats.clock_isr);
+	out = stats_put_timing(out, "flash_erase", &stats.flash_erase);
+	out = stats_put_timing(out, "flash_program", &stats.flash_program);
+
+	/* Drop the final line break, the console adds its own before the prompt */
+	out[-2] = '\0';
+	return text;
+}
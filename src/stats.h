@@ -0,0 +1,126 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file stats.h
+ * @brief Runtime counters for diagnosing throughput problems
+ *
+ * Counts what the firmware does (reports sent, serial bytes, stalls)
+ * and how long it takes (interrupt handlers, flash operations) so a
+ * drop in typing speed can be pinned on either the host's polling or a
+ * firmware stall. Times are in CPU cycles from the Cortex-M3 DWT cycle
+ * counter (48 MHz: 48 cycles per microsecond).
+ *
+ * Counters are updated in place by the modules that own the events and
+ * read or cleared with the 'i' serial commands.
+ *
+ * ## Binary Layout
+ *
+ * 'ib' returns struct stats as hex. Fields are little-endian, in
+ * declaration order, without padding:
+ *
+ * | Offset | Field             | Offset | Field          |
+ * |--------|-------------------|--------|----------------|
+ * | 0      | usb_isr (16)      | 64     | reports        |
+ * | 16     | clock_isr (16)    | 68     | queue_full     |
+ * | 32     | flash_erase (16)  | 72     | cdc_in         |
+ * | 48     | flash_program (16)| 76     | cdc_out        |
+ * |        |                   | 80     | cdc_spins      |
+ * |        |                   | 84     | missed_ms      |
+ * |        |                   | 88     | boot_config    |
+ * |        |                   | 92     | boot_report    |
+ * |        |                   | 96     | cdc_dropped    |
+ *
+ * Each timing is {uint32 count, uint32 max, uint64 total} in cycles.
+ *
+ * ## Boot Latency
+ *
+ * boot_config and boot_report are the cycle counts, from stats_init()
+ * right after the system clock is up, at which the host configured the
+ * device and read the first HID report. 0 means not yet. They describe
+ * this boot, so clearing the counters keeps them.
+ *
+ * @see stats.c for implementation
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+
+#include <libopencm3/cm3/dwt.h>
+
+/**
+ * @brief CPU cycles per microsecond (48 MHz system clock)
+ */
+#define STATS_CYCLES_PER_US 48
+
+/**
+ * @brief Duration statistics of one kind of operation
+ */
+struct stats_timing {
+	uint32_t count;  /**< Number of operations */
+	uint32_t max;    /**< Longest, in cycles */
+	uint64_t total;  /**< Sum of all, in cycles */
+};
+
+/**
+ * @brief All runtime counters
+ */
+struct stats {
+	struct stats_timing usb_isr;        /**< usb_lp_can_rx0_isr() */
+	struct stats_timing clock_isr;      /**< tim2_isr() */
+	struct stats_timing flash_erase;    /**< One page erase */
+	struct stats_timing flash_program;  /**< One word program */
+	uint32_t reports;                   /**< HID reports handed to the endpoint */
+	uint32_t queue_full;                /**< Engine found the HID queue full */
+	uint32_t cdc_in;                    /**< Serial bytes received */
+	uint32_t cdc_out;                   /**< Serial bytes sent */
+	uint32_t cdc_spins;                 /**< Serial writes that waited, transmit ring full */
+	uint32_t missed_ms;                 /**< Total lateness of expired delay alarms */
+	uint32_t boot_config;               /**< Cycles from boot to SET_CONFIGURATION */
+	uint32_t boot_report;               /**< Cycles from boot to the first report read */
+	uint32_t cdc_dropped;               /**< Serial bytes dropped, host stopped reading */
+};
+
+/**
+ * @brief The counters, updated directly by their owners
+ */
+extern struct stats stats;
+
+/**
+ * @brief Start the DWT cycle counter from 0, the boot time reference
+ */
+void stats_init(void);
+
+/**
+ * @brief Read the cycle counter, to pass to stats_time() later
+ */
+static inline uint32_t stats_cycles(void)
+{
+	/* Register read rather than dwt_read_cycle_counter(), which runs from flash */
+	return DWT_CYCCNT;
+}
+
+/**
+ * @brief Record an operation that started at cycle count start
+ *
+ * @param timing Statistics to update
+ * @param start  stats_cycles() at the start of the operation
+ */
+void stats_time(struct stats_timing *timing, uint32_t start);
+
+/**
+ * @brief Clear all counters except the boot latencies
+ */
+void stats_reset(void);
+
+/**
+ * @brief Format the counters as text, one per line
+ *
+ * Timings are shown as count, average and maximum cycles.
+ *
+ * @return Static NUL terminated string
+ */
+char *stats_format(void);
+
+#endif /* __STATS_H */
@@ -0,0 +1,81 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file trace.c
+ * @brief Event trace storage and dump
+ *
+ * @see trace.h for the event types and dump format
+ * @license LGPL-3.0-or-later
+ */
+
+#include <libopencm3/usb/usbd.h>
+
+#include "cdcacm.h"
+#include "trace.h"
+
+#if TRACE_ENABLED
+
+/*============================================================================
+ * Public State
+ *===========================================================================*/
+
+struct trace_event trace_buf[TRACE_LEN];
+uint32_t trace_head;
+volatile bool trace_on = true;
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+const char *trace_dump(void)
+{
+	bool was_on = trace_on;
+	uint32_t head, start;
+	struct trace_header header = { { 'T', 'R' }, 0, 0 };
+
+	/* Stop recording so the buffer holds still while it is sent */
+	trace_on = false;
+	head = trace_head;
+
+	if (head > TRACE_LEN) {
+		header.count = TRACE_LEN;
+		header.lost = head - TRACE_LEN;
+	} else {
+		header.count = head;
+	}
+	start = (head - header.count) % TRACE_LEN;
+
+	cdcacm_write(&header, sizeof(header));
+
+	/* Oldest first: from start to the end of the array, then the wrapped part */
+	if (start + header.count > TRACE_LEN) {
+		cdcacm_write(&trace_buf[start], (TRACE_LEN - start) * sizeof(struct trace_event));
+		cdcacm_write(&trace_buf[0], (start + header.count - TRACE_LEN) * sizeof(struct trace_event));
+	} else {
+		cdcacm_write(&trace_buf[start], header.count * sizeof(struct trace_event));
+	}
+
+	trace_head = 0;
+	trace_on = was_on;
+	return "";
+}
+
+const char *trace_enable(bool on)
+{
+	trace_on = on;
+	return on ? "trace on" : "trace off";
+}
+
+#else
+
+const char *trace_dump(void)
+{
+	return "trace not built in (make TRACE=1)";
+}
+
+const char *trace_enable(bool on)
+{
+	(void)on;
+	return trace_dump();
+}
+
+#endif
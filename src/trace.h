@@ -0,0 +1,150 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file trace.h
+ * @brief Timestamped event trace in a RAM ring buffer
+ *
+ * Records what happened when, so the keystroke timeline the host saw
+ * can be rebuilt from a 't' dump without a USB analyzer. Each event is
+ * eight bytes: a DWT cycle count, an event type and a 16-bit argument.
+ * The buffer keeps the most recent TRACE_LEN events.
+ *
+ * Tracing is compiled in with `make TRACE=1`. trace() is then a handful
+ * of instructions (an atomic index increment and one store) and can be
+ * switched off at run time with 't0'. Without TRACE it is an empty
+ * inline function and the buffer does not exist.
+ *
+ * ## Events
+ *
+ * | Type                     | Value | Argument                          |
+ * |--------------------------|-------|-----------------------------------|
+ * | TRACE_REPORT_QUEUED      | 1     | report ID, first key / x << 8     |
+ * | TRACE_REPORT_SENT        | 2     | reports still queued (same iface) |
+ * | TRACE_DELAY_START        | 3     | ms (saturated to 65535)           |
+ * | TRACE_DELAY_END          | 4     | ms late                           |
+ * | TRACE_PAUSE              | 5     | 1 paused, 0 resumed               |
+ * | TRACE_STEP               | 6     | -                                 |
+ * | TRACE_COMMAND            | 7     | command character                 |
+ * | TRACE_FLASH_ERASE_BEGIN  | 8     | page number                       |
+ * | TRACE_FLASH_ERASE_END    | 9     | page number                       |
+ * | TRACE_LED_REPORT         | 10    | LED bits from the host            |
+ * | TRACE_LED_WAIT           | 11    | 1 matched, 0 timed out            |
+ *
+ * TRACE_REPORT_SENT is logged when the host has read a report from EP
+ * 0x81 (keyboard) or 0x82 (mouse), so the time between QUEUED and SENT
+ * is the queueing latency.
+ *
+ * ## Dump Format
+ *
+ * 't' writes a binary block to the serial port, followed by the usual
+ * prompt: a struct trace_header, then `count` struct trace_event
+ * records, oldest first. All fields are little-endian. The buffer is
+ * cleared afterwards.
+ *
+ * @see trace.c for implementation
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 0
+#endif
+
+/** @brief Number of events kept (power of two) */
+#define TRACE_LEN 128
+
+/**
+ * @brief Event types
+ */
+enum trace_type {
+	TRACE_REPORT_QUEUED = 1,      /**< Engine queued a HID report */
+	TRACE_REPORT_SENT = 2,        /**< Host read a HID report */
+	TRACE_DELAY_START = 3,        /**< Delay alarm armed */
+	TRACE_DELAY_END = 4,          /**< Delay alarm expired */
+	TRACE_PAUSE = 5,              /**< Playback paused or resumed */
+	TRACE_STEP = 6,               /**< Single step requested */
+	TRACE_COMMAND = 7,            /**< Serial command received */
+	TRACE_FLASH_ERASE_BEGIN = 8,  /**< Flash page erase started */
+	TRACE_FLASH_ERASE_END = 9,    /**< Flash page erase finished */
+	TRACE_LED_REPORT = 10,        /**< Host set the keyboard LEDs */
+	TRACE_LED_WAIT = 11,          /**< OP_WAIT_LED finished */
+};
+
+/**
+ * @brief One recorded event
+ */
+struct trace_event {
+	uint32_t time;     /**< DWT cycle count (48 MHz, wraps every 89 s) */
+	uint16_t arg;      /**< Event argument, see table above */
+	uint8_t type;      /**< enum trace_type */
+	uint8_t reserved;  /**< 0 */
+};
+
+/**
+ * @brief Start of a 't' dump
+ */
+struct trace_header {
+	uint8_t magic[2];  /**< 'T', 'R' */
+	uint16_t count;    /**< Events that follow */
+	uint32_t lost;     /**< Older events overwritten since the last dump */
+};
+
+#if TRACE_ENABLED
+
+#include <libopencm3/cm3/dwt.h>
+
+/** @brief Event storage */
+extern struct trace_event trace_buf[TRACE_LEN];
+
+/** @brief Number of events recorded since the last dump */
+extern uint32_t trace_head;
+
+/** @brief Recording switched on ('t1', the default) */
+extern volatile bool trace_on;
+
+/**
+ * @brief Record an event
+ *
+ * Safe from any context: the slot is claimed with an atomic increment,
+ * so an interrupt tracing in between gets a slot of its own.
+ */
+static inline void trace(enum trace_type type, uint16_t arg)
+{
+	if (!trace_on)
+		return;
+
+	uint32_t i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) % TRACE_LEN;
+
+	trace_buf[i] = (struct trace_event){ DWT_CYCCNT, arg, type, 0 };
+}
+
+#else
+
+static inline void trace(enum trace_type type, uint16_t arg)
+{
+	(void)type;
+	(void)arg;
+}
+
+#endif
+
+/**
+ * @brief Write the buffered events to the serial port and clear them
+ *
+ * @return Response for the console: empty after a dump, or a message if
+ *         tracing is not compiled in
+ */
+const char *trace_dump(void);
+
+/**
+ * @brief Switch recording on or off
+ *
+ * @return Response for the console
+ */
+const char *trace_enable(bool on);
+
+#endif /* __TRACE_H */
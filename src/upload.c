@@ -0,0 +1,288 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file upload.c
+ * @brief Framed binary payload upload implementation
+ *
+ * Incremental parser for the upload protocol described in upload.h.
+ * Bytes arrive from the CDC OUT callback in USB packet sized pieces
+ * that need not line up with frame boundaries, so each frame is
+ * collected in a RAM buffer until complete, verified, and only then
+ * written to a free payload slot (payload_write()). The slot
+ * is selected only once the whole payload has arrived.
+ *
+ * ## Parser States
+ *
+ * ```
+ *              magic            header ok          len bytes + crc
+ * +------+  ----------> +--------+ ------> +------------+ ------> +------------+
+ * | IDLE |              | HEADER |         | CHUNK_HEAD |         | CHUNK_BODY |
+ * +------+ <----------  +--------+         +------------+ <------ +------------+
+ *     ^     bad header                        ^      |     ACK/NAK       |
+ *     |                                       |      | len == 0 (abort)  |
+ *     +---------------------------------------+------+-------------------+
+ *                      DONE / ERROR
+ * ```
+ *
+ * @see upload.h for the wire format
+ * @license LGPL-3.0-or-later
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "upload.h"
+#include "cdcacm.h"
+#include "crc.h"
+#include "flash.h"
+#include "hid.h"
+#include "payload.h"
+
+/*============================================================================
+ * Private Types and State
+ *===========================================================================*/
+
+/**
+ * @brief Upload parser states
+ */
+enum upload_state {
+	UPLOAD_STATE_IDLE,        /**< Not uploading, bytes belong to line mode */
+	UPLOAD_STATE_HEADER,      /**< Collecting struct upload_header */
+	UPLOAD_STATE_CHUNK_HEAD,  /**< Collecting seq, flags, len */
+	UPLOAD_STATE_CHUNK_BODY,  /**< Collecting data and crc */
+};
+
+/**
+ * @brief Size of the chunk header (seq, flags, len)
+ */
+#define CHUNK_HEAD_SIZE 4
+
+/**
+ * @brief Size of the trailing chunk CRC
+ */
+#define CHUNK_CRC_SIZE 4
+
+/**
+ * @brief Upload session state
+ */
+static struct {
+	enum upload_state state;   /**< Current parser state */
+	uint32_t remaining;        /**< Payload bytes still expected */
+	uint16_t frame_len;        /**< Bytes collected in frame so far */
+	uint16_t frame_need;       /**< Bytes needed to complete the frame */
+	uint8_t expected_seq;      /**< Sequence number of the next new chunk */
+	bool any_acked;            /**< At least one chunk has been accepted */
+	struct payload_writer writer; /**< Destination of the payload bytes */
+	uint8_t frame[CHUNK_HEAD_SIZE + UPLOAD_CHUNK_MAX + CHUNK_CRC_SIZE]; /**< Frame assembly buffer */
+} upload;
+
+/*============================================================================
+ * Private Functions
+ *===========================================================================*/
+
+/**
+ * @brief Send one reply frame to the host
+ */
+static void upload_reply(uint8_t code, uint8_t seq, uint8_t status)
+{
+	struct upload_reply reply = {
+		.magic = UPLOAD_MAGIC,
+		.code = code,
+		.seq = seq,
+		.status = status,
+	};
+
+	cdcacm_write_reply(&reply, sizeof(reply));
+}
+
+/**
+ * @brief Start collecting a new frame of the given size
+ */
+static void upload_expect(enum upload_state state, uint16_t need)
+{
+	upload.state = state;
+	upload.frame_len = 0;
+	upload.frame_need = need;
+}
+
+/**
+ * @brief Terminate the upload, activating the payload or discarding it
+ */
+static void upload_end(uint8_t code, uint8_t seq, uint8_t status)
+{
+	if (code == UPLOAD_DONE)
+		status = payload_commit(&upload.writer);
+	else
+		payload_abort(&upload.writer);
+
+	upload_reply(code, seq, status);
+	upload.state = UPLOAD_STATE_IDLE;
+}
+
+/**
+ * @brief Validate a complete header and open the flash writer
+ */
+static void upload_handle_header(void)
+{
+	struct upload_header header;
+
+	memcpy(&header, upload.frame, sizeof(header));
+
+	if (crc32(0, upload.frame, offsetof(struct upload_header, crc)) != header.crc ||
+	    (header.target != UPLOAD_TARGET_FLASH && header.target != UPLOAD_TARGET_RAM) ||
+	    header.reserved != 0) {
+		upload_reply(UPLOAD_ERROR, 0, UPLOAD_ERR_HEADER);
+		upload.state = UPLOAD_STATE_IDLE;
+		return;
+	}
+
+	if (header.length > (header.target == UPLOAD_TARGET_RAM ? PAYLOAD_RAM_SIZE : PAYLOAD_CAPACITY)) {
+		upload_reply(UPLOAD_ERROR, 0, UPLOAD_ERR_LENGTH);
+		upload.state = UPLOAD_STATE_IDLE;
+		return;
+	}
+
+	upload.remaining = header.length;
+	upload.expected_seq = 0;
+	upload.any_acked = false;
+
+	/* Flash: drops only the slots the new extent overlaps; playback continues meanwhile */
+	uint32_t result = payload_begin(&upload.writer, header.target, header.length);
+	if (result != RESULT_OK) {
+		payload_abort(&upload.writer);
+		upload_reply(UPLOAD_ERROR, 0, result);
+		upload.state = UPLOAD_STATE_IDLE;
+		return;
+	}
+
+	upload_reply(UPLOAD_READY, 0, RESULT_OK);
+
+	if (upload.remaining == 0)
+		upload_end(UPLOAD_DONE, 0, RESULT_OK);
+	else
+		upload_expect(UPLOAD_STATE_CHUNK_HEAD, CHUNK_HEAD_SIZE);
+}
+
+/**
+ * @brief Validate the chunk header and size the rest of the frame
+ */
+static void upload_handle_chunk_head(void)
+{
+	uint16_t len = upload.frame[2] | (upload.frame[3] << 8);
+
+	if (len == 0) {
+		upload_end(UPLOAD_ERROR, upload.frame[0], UPLOAD_ERR_ABORTED);
+		return;
+	}
+
+	if (len > UPLOAD_CHUNK_MAX) {
+		/* Cannot resynchronize on a bogus length: give up */
+		upload_end(UPLOAD_ERROR, upload.frame[0], UPLOAD_ERR_LENGTH);
+		return;
+	}
+
+	/* Keep the chunk header in the frame buffer, it is covered by the CRC */
+	upload.state = UPLOAD_STATE_CHUNK_BODY;
+	upload.frame_need = CHUNK_HEAD_SIZE + len + CHUNK_CRC_SIZE;
+}
+
+/**
+ * @brief Verify a complete chunk and write it to flash
+ */
+static void upload_handle_chunk_body(void)
+{
+	uint8_t seq = upload.frame[0];
+	uint16_t len = upload.frame[2] | (upload.frame[3] << 8);
+	const uint8_t *data = &upload.frame[CHUNK_HEAD_SIZE];
+	uint32_t crc;
+
+	memcpy(&crc, &data[len], sizeof(crc));
+
+	if (crc32(0, upload.frame, CHUNK_HEAD_SIZE + len) != crc) {
+		/* Corrupted: ask for a resend starting at the chunk we still need */
+		upload_reply(UPLOAD_NAK, upload.expected_seq, RESULT_OK);
+	} else if (upload.any_acked && seq == (uint8_t)(upload.expected_seq - 1)) {
+		/* Resend of a chunk whose ACK was lost: already written */
+		upload_reply(UPLOAD_ACK, seq, RESULT_OK);
+	} else if (seq != upload.expected_seq) {
+		/* Follows a rejected chunk in a pipelined stream */
+		upload_reply(UPLOAD_NAK, upload.expected_seq, RESULT_OK);
+	} else if (len > upload.remaining) {
+		upload_end(UPLOAD_ERROR, seq, UPLOAD_ERR_LENGTH);
+		return;
+	} else {
+		uint32_t result = payload_write(&upload.writer, data, len);
+		if (result != RESULT_OK) {
+			upload_end(UPLOAD_ERROR, seq, result);
+			return;
+		}
+
+		upload.remaining -= len;
+		upload.expected_seq++;
+		upload.any_acked = true;
+
+		if (upload.remaining == 0) {
+			upload_end(UPLOAD_DONE, seq, RESULT_OK);
+			return;
+		}
+		upload_reply(UPLOAD_ACK, seq, RESULT_OK);
+	}
+
+	upload_expect(UPLOAD_STATE_CHUNK_HEAD, CHUNK_HEAD_SIZE);
+}
+
+/*============================================================================
+ * Public Functions
+ *===========================================================================*/
+
+bool upload_active(void)
+{
+	return upload.state != UPLOAD_STATE_IDLE;
+}
+
+void upload_reset(void)
+{
+	if (upload.state != UPLOAD_STATE_IDLE && upload.state != UPLOAD_STATE_HEADER)
+		payload_abort(&upload.writer);
+	upload.state = UPLOAD_STATE_IDLE;
+}
+
+int upload_receive(const uint8_t *buf, int len)
+{
+	int i = 0;
+
+	if (upload.state == UPLOAD_STATE_IDLE) {
+		if (len == 0 || buf[0] != UPLOAD_MAGIC)
+			return 0;
+		upload_expect(UPLOAD_STATE_HEADER, sizeof(struct upload_header));
+	}
+
+	while (i < len && upload.state != UPLOAD_STATE_IDLE) {
+		/* Copy as much of the current frame as this packet holds */
+		uint16_t take = upload.frame_need - upload.frame_len;
+		if (take > len - i) take = len - i;
+
+		memcpy(&upload.frame[upload.frame_len], &buf[i], take);
+		upload.frame_len += take;
+		i += take;
+
+		if (upload.frame_len < upload.frame_need)
+			break;
+
+		switch (upload.state) {
+		case UPLOAD_STATE_HEADER:
+			upload_handle_header();
+			break;
+		case UPLOAD_STATE_CHUNK_HEAD:
+			upload_handle_chunk_head();
+			break;
+		case UPLOAD_STATE_CHUNK_BODY:
+			upload_handle_chunk_body();
+			break;
+		default:
+			break;
+		}
+	}
+
+	return i;
+}
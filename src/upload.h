@@ -0,0 +1,178 @@
+// vim: tabstop=8 softtabstop=8 shiftwidth=8 noexpandtab
+/**
+ * @file upload.h
+ * @brief Framed binary payload upload over the CDC data endpoint
+ *
+ * The hex line commands (`w`, `d`) echo every character, are capped by
+ * the line buffer at ~1KB of payload and double the bytes on the wire.
+ * The binary upload protocol streams raw payload bytes straight into the
+ * flash writer instead, in CRC-protected, individually acknowledged
+ * chunks, with no echo and no prompt.
+ *
+ * ## Framing
+ *
+ * An upload starts when UPLOAD_MAGIC is received at the start of a
+ * command line (it is not a printable character, so it cannot collide
+ * with a typed command). All multi-byte fields are little-endian.
+ *
+ * Header (host to device, 12 bytes):
+ *
+ * | Offset | Size | Field    | Description                          |
+ * |--------|------|----------|--------------------------------------|
+ * | 0      | 1    | magic    | UPLOAD_MAGIC (0xB5)                  |
+ * | 1      | 1    | target   | UPLOAD_TARGET_FLASH or _RAM          |
+ * | 2      | 2    | reserved | 0 (anything else: UPLOAD_ERR_HEADER) |
+ * | 4      | 4    | length   | Total payload bytes that will follow |
+ * | 8      | 4    | crc      | CRC-32 of header bytes 0-7           |
+ *
+ * Chunk (host to device, 8 + len bytes):
+ *
+ * | Offset  | Size | Field | Description                          |
+ * |---------|------|-------|--------------------------------------|
+ * | 0       | 1    | seq   | Chunk sequence number (0, 1, ... mod 256) |
+ * | 1       | 1    | flags | 0                                    |
+ * | 2       | 2    | len   | Data bytes, 1..UPLOAD_CHUNK_MAX (0 aborts) |
+ * | 4       | len  | data  | Payload bytes                        |
+ * | 4 + len | 4    | crc   | CRC-32 of bytes 0..3+len             |
+ *
+ * Reply (device to host, 4 bytes), see struct upload_reply:
+ *
+ * | Code         | seq field             | Meaning                     |
+ * |--------------|-----------------------|-----------------------------|
+ * | UPLOAD_READY | 0                     | Header accepted             |
+ * | UPLOAD_ACK   | seq of the chunk      | Chunk verified and written  |
+ * | UPLOAD_NAK   | next expected seq     | Bad CRC or out-of-order chunk, resend from seq |
+ * | UPLOAD_DONE  | seq of the last chunk | All bytes written and activated, status = flash result |
+ * | UPLOAD_ERROR | seq of failing chunk  | Upload aborted, status = reason |
+ *
+ * A chunk whose seq equals the last acknowledged one is re-acknowledged
+ * without being written again, so a lost ACK can be recovered by simply
+ * resending. Hosts may keep several chunks in flight and go back to the
+ * sequence number carried by a NAK.
+ *
+ * Chunks go into a payload slot other than the selected one (see
+ * payload.h), named by a preceding 'n' command. The upload
+ * replaces the running payload only when UPLOAD_DONE reports success;
+ * an aborted or failed upload leaves the previous payload active.
+ * UPLOAD_TARGET_RAM loads the RAM payload instead, with no flash
+ * erase or programming at all.
+ *
+ * Replies are sent with cdcacm_write_reply(), so they reach the host
+ * even with DTR off. The console output around an upload (the 'n'
+ * command, quiet mode "ok" lines) still needs DTR.
+ *
+ * @see upload.c for implementation
+ * @see crc.h for the CRC-32 definition
+ * @license LGPL-3.0-or-later
+ */
+
+#ifndef __UPLOAD_H
+#define __UPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*============================================================================
+ * Constants
+ *===========================================================================*/
+
+/**
+ * @brief First byte of an upload header and of every reply
+ */
+#define UPLOAD_MAGIC		0xB5
+
+/**
+ * @brief Upload target: a payload slot in flash (see payload.h)
+ */
+#define UPLOAD_TARGET_FLASH	0
+
+/**
+ * @brief Upload target: the RAM payload, started as soon as it is complete
+ */
+#define UPLOAD_TARGET_RAM	1
+
+/**
+ * @brief Largest data field accepted in one chunk
+ */
+#define UPLOAD_CHUNK_MAX	256
+
+/**
+ * @defgroup UploadReplyCodes Upload reply codes
+ * @{
+ */
+#define UPLOAD_READY		'R'	/**< Header accepted, send chunks */
+#define UPLOAD_ACK		'A'	/**< Chunk written */
+#define UPLOAD_NAK		'N'	/**< Chunk rejected, resend from seq */
+#define UPLOAD_DONE		'D'	/**< Upload complete */
+#define UPLOAD_ERROR		'E'	/**< Upload aborted */
+/** @} */
+
+/**
+ * @defgroup UploadErrors Upload error status values
+ * @brief Values of upload_reply.status for UPLOAD_ERROR that are not
+ *        flash status codes
+ * @{
+ */
+#define UPLOAD_ERR_HEADER	0x01	/**< Bad header CRC, unknown target or reserved not 0 */
+#define UPLOAD_ERR_LENGTH	0x02	/**< Payload or chunk too large */
+#define UPLOAD_ERR_ABORTED	0x03	/**< Host sent a zero-length chunk */
+/** @} */
+
+/*============================================================================
+ * Data Structures
+ *===========================================================================*/
+
+/**
+ * @brief Upload header sent by the host to start an upload
+ */
+struct upload_header {
+	uint8_t magic;      /**< UPLOAD_MAGIC */
+	uint8_t target;     /**< UPLOAD_TARGET_* */
+	uint16_t reserved;  /**< Must be 0 */
+	uint32_t length;    /**< Total payload length in bytes */
+	uint32_t crc;       /**< CRC-32 of the preceding 8 bytes */
+} __attribute__((packed));
+
+/**
+ * @brief Reply sent by the device for the header and for each chunk
+ */
+struct upload_reply {
+	uint8_t magic;      /**< UPLOAD_MAGIC */
+	uint8_t code;       /**< UPLOAD_READY, _ACK, _NAK, _DONE or _ERROR */
+	uint8_t seq;        /**< Sequence number (see code table) */
+	uint8_t status;     /**< RESULT_OK, flash status or UPLOAD_ERR_* */
+} __attribute__((packed));
+
+/*============================================================================
+ * Function Declarations
+ *===========================================================================*/
+
+/**
+ * @brief Check whether a binary upload is in progress
+ *
+ * @return true while bytes received on the CDC endpoint belong to an
+ *         upload and must be passed to upload_receive()
+ */
+bool upload_active(void);
+
+/**
+ * @brief Feed bytes received on the CDC endpoint to the upload parser
+ *
+ * The first byte of a new upload must be UPLOAD_MAGIC. Frames may be
+ * split across USB packets in any way. Replies are sent with
+ * cdcacm_write().
+ *
+ * @param buf Received bytes
+ * @param len Number of bytes in buf
+ *
+ * @return Number of bytes consumed. Less than len only when the upload
+ *         finished part way through buf; the rest is line-mode input.
+ */
+int upload_receive(const uint8_t *buf, int len);
+
+/**
+ * @brief Abandon any upload in progress (e.g. on USB reconfiguration)
+ */
+void upload_reset(void);
+
+#endif /* __UPLOAD_H */